@@ -0,0 +1,405 @@
+/**
+ * Copyright (C) 2015 Hewlett Packard Enterprise Development LP
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+/**
+ * @file buffer.hpp
+ * libviface packet buffer header file.
+ * Define the packet buffers used for in-place packet manipulation and the
+ * pools they are allocated from.
+ */
+
+#ifndef _VIFACE_BUFFER_HPP
+#define _VIFACE_BUFFER_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <utility>
+
+namespace viface
+{
+/**
+ * @ingroup libviface Public Interface
+ * @{
+ */
+
+class PacketPool;
+class PacketPoolImpl;
+
+/**
+ * Packet buffer memory descriptor.
+ *
+ * Internal bookkeeping shared by all the PacketBuffer handles pointing to
+ * the same memory. Not meant to be used directly.
+ */
+struct packet_slot
+{
+    std::atomic<uint32_t> refs;
+    PacketPoolImpl* pool;
+    uint8_t* memory;
+    size_t size;
+    size_t reserved_head;
+    size_t reserved_tail;
+    size_t offset;
+    size_t length;
+};
+
+/**
+ * Packet buffer with reserved headroom and tailroom.
+ *
+ * The buffer holds a packet (if tun) or frame (if tap) surrounded by free
+ * space, so headers can be pushed in front of it or popped from it, and
+ * trailers appended or removed, without moving or copying the packet.
+ *
+ * Reception functions place the packet after the configured headroom and
+ * never use the configured tailroom, so a received packet can always be
+ * encapsulated in place (for example, in VXLAN or GRE) and sent again.
+ *
+ * PacketBuffer objects are reference counted handles: copying one is cheap
+ * and the copy refers to the same memory and packet. The memory is released
+ * (back to its PacketPool, if any) when the last handle is destroyed.
+ * Buffers are meant to be reused: a reception resets the buffer before
+ * storing the new packet.
+ */
+class PacketBuffer
+{
+    private:
+
+        packet_slot* slot;
+
+        explicit PacketBuffer(packet_slot* slot) : slot(slot) {}
+        void release();
+        friend class PacketPoolImpl;
+
+    public:
+
+        /**
+         * Create a standalone packet buffer, not backed by any pool.
+         *
+         * @param[in]  size Total size in bytes of the buffer, including the
+         *             reserved headroom and tailroom.
+         * @param[in]  headroom Bytes reserved in front of received packets.
+         * @param[in]  tailroom Bytes reserved after received packets.
+         *
+         * An exception is thrown if the reserved room leaves no space for
+         * the packet.
+         */
+        explicit PacketBuffer(
+            size_t size = 2048,
+            size_t headroom = 128,
+            size_t tailroom = 0
+            );
+
+        PacketBuffer(const PacketBuffer& other) : slot(other.slot)
+        {
+            if (this->slot != nullptr) {
+                this->slot->refs.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        PacketBuffer(PacketBuffer&& other) : slot(other.slot)
+        {
+            other.slot = nullptr;
+        }
+
+        PacketBuffer& operator=(PacketBuffer rhs)
+        {
+            std::swap(this->slot, rhs.slot);
+            return *this;
+        }
+
+        ~PacketBuffer()
+        {
+            if (this->slot != nullptr) {
+                this->release();
+            }
+        }
+
+        /**
+         * Check if the handle refers to a buffer.
+         *
+         * @return false for the empty handle returned by an exhausted pool.
+         *         No other method can be called on such handle.
+         */
+        explicit operator bool() const
+        {
+            return this->slot != nullptr;
+        }
+
+        /**
+         * Getter method for the number of handles sharing this buffer.
+         *
+         * @return the reference count of the buffer.
+         */
+        uint32_t getRefs() const
+        {
+            return this->slot->refs.load(std::memory_order_relaxed);
+        }
+
+        /**
+         * Getter method for the start of the packet.
+         *
+         * @return pointer to the first byte of the packet.
+         */
+        uint8_t* getData() const
+        {
+            return this->slot->memory + this->slot->offset;
+        }
+
+        /**
+         * Getter method for the size of the packet.
+         *
+         * @return the number of bytes of the packet.
+         */
+        size_t getLength() const
+        {
+            return this->slot->length;
+        }
+
+        /**
+         * Getter method for the free space in front of the packet.
+         *
+         * @return the number of bytes that can be pushed with push().
+         */
+        size_t getHeadroom() const
+        {
+            return this->slot->offset;
+        }
+
+        /**
+         * Getter method for the free space after the packet.
+         *
+         * @return the number of bytes that can be appended with put().
+         */
+        size_t getTailroom() const
+        {
+            return this->slot->size - this->slot->offset - this->slot->length;
+        }
+
+        /**
+         * Getter method for the maximum packet size a reception can store.
+         *
+         * @return the total size minus the reserved headroom and tailroom.
+         */
+        size_t getCapacity() const
+        {
+            return this->slot->size - this->slot->reserved_head -
+                   this->slot->reserved_tail;
+        }
+
+        /**
+         * Empty the buffer.
+         *
+         * The packet is discarded and the start of the packet is placed
+         * right after the reserved headroom.
+         */
+        void reset()
+        {
+            this->slot->offset = this->slot->reserved_head;
+            this->slot->length = 0;
+        }
+
+        /**
+         * Set the size of the packet, after it was written at getData().
+         *
+         * @param[in]  length New size of the packet in bytes.
+         *
+         * @return false if length exceeds the available space, in which case
+         *         the buffer is not modified.
+         */
+        bool setLength(size_t length)
+        {
+            if (length > this->slot->size - this->slot->offset) {
+                return false;
+            }
+            this->slot->length = length;
+            return true;
+        }
+
+        /**
+         * Prepend space to the packet, for example to add a header.
+         *
+         * @param[in]  bytes Number of bytes to prepend.
+         *
+         * @return pointer to the new start of the packet where the header
+         *         must be written, or nullptr if not enough headroom is
+         *         available.
+         */
+        uint8_t* push(size_t bytes)
+        {
+            if (bytes > this->slot->offset) {
+                return nullptr;
+            }
+            this->slot->offset -= bytes;
+            this->slot->length += bytes;
+            return this->getData();
+        }
+
+        /**
+         * Remove bytes from the start of the packet, for example to strip a
+         * header.
+         *
+         * @param[in]  bytes Number of bytes to remove.
+         *
+         * @return pointer to the new start of the packet, or nullptr if the
+         *         packet is shorter than bytes.
+         */
+        uint8_t* pull(size_t bytes)
+        {
+            if (bytes > this->slot->length) {
+                return nullptr;
+            }
+            this->slot->offset += bytes;
+            this->slot->length -= bytes;
+            return this->getData();
+        }
+
+        /**
+         * Append space to the packet, for example to add a trailer.
+         *
+         * @param[in]  bytes Number of bytes to append.
+         *
+         * @return pointer to the appended space where the trailer must be
+         *         written, or nullptr if not enough tailroom is available.
+         */
+        uint8_t* put(size_t bytes)
+        {
+            if (bytes > this->getTailroom()) {
+                return nullptr;
+            }
+            uint8_t* tail = this->getData() + this->slot->length;
+            this->slot->length += bytes;
+            return tail;
+        }
+
+        /**
+         * Remove bytes from the end of the packet.
+         *
+         * @param[in]  bytes Number of bytes to remove.
+         *
+         * @return false if the packet is shorter than bytes, in which case
+         *         the buffer is not modified.
+         */
+        bool trim(size_t bytes)
+        {
+            if (bytes > this->slot->length) {
+                return false;
+            }
+            this->slot->length -= bytes;
+            return true;
+        }
+};
+
+/**
+ * Pool of packet buffers.
+ *
+ * All the buffers of a pool are carved out of a single slab allocated at
+ * construction time. Buffers are fixed-size and cache-line aligned, and
+ * allocating or releasing one never touches the general-purpose heap, so
+ * steady-state packet I/O using pooled buffers performs no allocation and
+ * memory stays bounded.
+ *
+ * Pools are thread-safe. Buffers may outlive the PacketPool object, in which
+ * case the slab is freed when the last buffer is released.
+ *
+ * Each Dispatcher reads packets into buffers of a pool of its own, which
+ * handlers can keep or send without copying. Functions taking a
+ * PacketBuffer, such as VIface::receive(PacketBuffer&) and
+ * VIface::send(PacketBuffer const&), work on pooled buffers when the caller
+ * allocates them from a pool.
+ */
+class PacketPool
+{
+    private:
+
+        PacketPoolImpl* pimpl;
+        PacketPool(const PacketPool& other) = delete;
+        PacketPool& operator=(PacketPool rhs) = delete;
+
+    public:
+
+        /**
+         * Create a pool of packet buffers.
+         *
+         * @param[in]  count Number of buffers in the pool.
+         * @param[in]  size Total size in bytes of each buffer, including the
+         *             reserved headroom and tailroom. It is rounded up to a
+         *             multiple of the cache-line size.
+         * @param[in]  headroom Bytes reserved in front of received packets.
+         * @param[in]  tailroom Bytes reserved after received packets.
+         *
+         * An exception is thrown if the reserved room leaves no space for
+         * the packet or if the slab cannot be allocated.
+         */
+        explicit PacketPool(
+            size_t count,
+            size_t size = 2048,
+            size_t headroom = 128,
+            size_t tailroom = 0
+            );
+        ~PacketPool();
+
+        /**
+         * Take a buffer from the pool.
+         *
+         * The buffer is returned empty (reset).
+         *
+         * @return a handle to the buffer, or an empty handle (that evaluates
+         *         to false) if the pool is exhausted.
+         */
+        PacketBuffer alloc();
+
+        /**
+         * Getter method for the number of buffers in the pool.
+         *
+         * @return the total number of buffers.
+         */
+        size_t getCount() const;
+
+        /**
+         * Getter method for the size of each buffer in the pool.
+         *
+         * @return the size in bytes of each buffer.
+         */
+        size_t getBufferSize() const;
+
+        /**
+         * Getter method for the pool occupancy.
+         *
+         * @return the number of buffers currently handed out.
+         */
+        size_t getInUse() const;
+
+        /**
+         * Getter method for the pool occupancy peak.
+         *
+         * @return the maximum number of buffers handed out at the same time.
+         */
+        size_t getPeak() const;
+
+        /**
+         * Getter method for the pool exhaustion counter.
+         *
+         * @return the number of times alloc() failed because no buffer was
+         *         available.
+         */
+        uint64_t getExhausted() const;
+};
+
+/** @} */ // End of libviface
+};
+#endif // _VIFACE_BUFFER_HPP
@@ -24,10 +24,16 @@
 #include <fstream>     // ifstream
 #include <iomanip>     // setw
 #include <map>         // map
+#include <deque>       // deque
+#include <algorithm>   // min
+#include <mutex>       // mutex
+#include <chrono>      // steady_clock
 
 // C
+#include <cstdlib>     // posix_memalign
 #include <cstring>     // memset
 #include <cerrno>      // EAGAIN
+#include <climits>     // IOV_MAX
 
 // Posix
 #include <unistd.h>    // open(), close()
@@ -39,18 +45,38 @@
 
 // Linux TUN/TAP includes
 #include <sys/select.h>
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <linux/if.h>
 #include <linux/if_tun.h>
 #include <linux/if_arp.h>
+#include <linux/if_ether.h> // ETH_HLEN
+#include <linux/if_packet.h> // tpacket_req3
+#include <poll.h>      // POLLIN, POLLOUT, poll
+#include <sys/mman.h>  // mmap()
 
 // Interfaces
 #include <ifaddrs.h>   // getifaddrs
 
+// eBPF steering programs, loaded through raw system calls
+#include <sys/syscall.h>
+#include <linux/filter.h> // SKF_NET_OFF
+#include <linux/bpf.h>
+
+// AF_XDP sockets and the program redirecting to them
+#include <linux/if_xdp.h>
+#include <linux/if_link.h> // XDP_FLAGS_SKB_MODE
+
 // Framework
 #include "viface/viface.hpp"
 
+// io_uring, used through raw system calls
+#ifdef VIFACE_HAVE_IO_URING
+#include <linux/io_uring.h>
+#endif
+
 using namespace std;
 using namespace viface;
 
@@ -63,20 +89,197 @@ struct in6_ifreq
     int ifr6_ifindex;
 };
 
+// Maximum number of packets handled by a single batched system call
+const size_t batch_max = 64;
+
+// Cache-line size used to align packet buffers
+const size_t cache_line = 64;
+
+// Features selecting the fanout mode of hooked interfaces
+const uint fanout_flags = FLAG_FANOUT_CPU | FLAG_FANOUT_LB |
+                          FLAG_FANOUT_ROLLOVER;
+
+// Features tuning the packet sockets of hooked interfaces
+const uint socket_flags = FLAG_IGNORE_OUTGOING | FLAG_QDISC_BYPASS;
+
+// Largest GSO super-frame: maximum IP datagram plus Ethernet and VLAN headers
+const size_t gso_frame_max = 65535 + ETH_HLEN + 4;
+
+// The public header mirrors struct virtio_net_hdr, so it is read and written
+// as is. <linux/virtio_net.h> can't be included from C++ (it has a member
+// named class), but the layout is part of the kernel ABI.
+static_assert(sizeof(vnet_header) == 10,
+              "vnet_header doesn't match virtio_net_hdr");
+
+// Memory-mapped packet ring shared with the kernel, disabled if map is null
+struct viface_ring
+{
+    uint8_t* map;
+    size_t block_size;
+    uint blocks;
+    size_t frame_size;
+    uint frames;
+    uint current;
+    uint pending;
+    uint8_t* next;
+    uint64_t dropped;
+};
+
 struct viface_queues
 {
     int rx;
     int tx;
+    bool attached;
+    struct viface_ring rx_ring;
+    mutable struct viface_ring tx_ring;
+};
+
+// Number of descriptors of each AF_XDP ring, UMEM holds twice as many frames
+const uint32_t xdp_ring_size = 512;
+
+// Size of a UMEM frame, holding a single packet
+const uint32_t xdp_frame_size = 4096;
+
+class XdpSocket
+{
+    private:
+
+        // Single producer, single consumer ring shared with the kernel
+        struct xdp_queue
+        {
+            void* map;
+            size_t map_size;
+            uint32_t* producer;
+            uint32_t* consumer;
+            void* descs;
+        };
+
+        string name;
+        int fd;
+        uint8_t* umem;
+        struct xdp_queue fill;
+        struct xdp_queue completion;
+        struct xdp_queue rx;
+        struct xdp_queue tx;
+        vector<uint64_t> frames;
+
+        void mapQueue(struct xdp_queue& queue,
+                      struct xdp_ring_offset const& offsets,
+                      uint64_t page, size_t desc_size);
+
+        void release();
+
+        void reclaim();
+
+        bool kick();
+
+        ssize_t enqueue(struct iovec const* iovecs, size_t count);
+
+    public:
+
+        XdpSocket(string const& name, uint queue);
+        ~XdpSocket();
+
+        int getFD() const
+        {
+            return this->fd;
+        }
+
+        size_t getMemoryFootprint() const;
+
+        ssize_t receive(uint8_t* buffer, size_t size);
+
+        size_t receiveBatch(packet_buffer* buffers, size_t count);
+
+        ssize_t send(struct iovec const* iovecs, size_t count);
+
+        size_t sendBatch(packet_buffer const* buffers, size_t count);
+};
+
+// XDP program redirecting the frames received on each device queue to the
+// AF_XDP socket bound to it, through an XSKMAP shared by the sockets
+class XdpRedirect
+{
+    private:
+
+        string name;
+        int map_fd;
+        int prog_fd;
+        int link_fd;
+
+        void release();
+
+    public:
+
+        XdpRedirect(string const& name,
+                    vector<unique_ptr<XdpSocket> > const& sockets);
+        ~XdpRedirect();
+
+        static uint getQueues(string const& name);
+};
+
+class PacketPoolImpl
+{
+    private:
+
+        mutable mutex lock;
+        unique_ptr<packet_slot[]> slots;
+        uint8_t* slab;
+        vector<packet_slot*> available;
+        size_t count;
+        size_t size;
+        size_t peak;
+        uint64_t exhausted;
+        bool orphaned;
+
+    public:
+
+        PacketPoolImpl(size_t count, size_t size, size_t headroom,
+                       size_t tailroom);
+        ~PacketPoolImpl();
+
+        PacketBuffer alloc();
+
+        // Handle referring to no buffer, as returned by an exhausted pool
+        static PacketBuffer none()
+        {
+            return PacketBuffer(nullptr);
+        }
+
+        void release(packet_slot* slot);
+
+        void orphan();
+
+        size_t getCount() const
+        {
+            return this->count;
+        }
+
+        size_t getBufferSize() const
+        {
+            return this->size;
+        }
+
+        size_t getInUse() const;
+
+        size_t getPeak() const;
+
+        uint64_t getExhausted() const;
 };
 
 class VIfaceImpl
 {
     private:
 
-        struct viface_queues queues;
+        vector<struct viface_queues> queues;
+        vector<unique_ptr<XdpSocket> > xsks;
+        unique_ptr<XdpRedirect> xdp;
         int kernel_socket;
         int kernel_socket_ipv6;
-        vector<uint8_t> pktbuff;
+        bool hooked;
+        bool tap;
+        uint flags;
+        steering_mode steering;
 
         string name;
         uint id;
@@ -89,15 +292,16 @@ class VIfaceImpl
 
         set<string> stats_keys_cache;
         map<string,uint64_t> stats_cache;
+        uint64_t outgoing_base;
 
         static uint idseq;
 
     public:
 
-        VIfaceImpl(string name, bool tap, int id);
+        VIfaceImpl(string name, bool tap, int id, uint queues, uint flags);
         ~VIfaceImpl();
 
-        string getName() const
+        string const& getName() const
         {
             return this->name;
         }
@@ -107,16 +311,66 @@ class VIfaceImpl
             return this->id;
         }
 
-        int getTX() const
+        uint getQueues() const
+        {
+            return this->queues.size();
+        }
+
+        struct viface_queues const& getQueue(uint queue) const;
+
+        bool isValidQueue(uint queue) const
+        {
+            return queue < this->queues.size();
+        }
+
+        XdpSocket* getXdp(uint queue) const
         {
-            return this->queues.tx;
+            return this->xsks.empty() ? nullptr : this->xsks[queue].get();
         }
 
-        int getRX() const
+        bool isRawTX(uint queue) const
         {
-            return this->queues.rx;
+            return this->getHeaderSize() == 0 && this->xsks.empty() &&
+                   this->getQueue(queue).tx_ring.map == nullptr;
         }
 
+        int getTX(uint queue = 0) const
+        {
+            return this->getQueue(queue).tx;
+        }
+
+        int getRX(uint queue = 0) const
+        {
+            return this->getQueue(queue).rx;
+        }
+
+        uint getFlags() const
+        {
+            return this->flags;
+        }
+
+        size_t getHeaderSize() const
+        {
+            return (this->flags & FLAG_VNET_HDR) ? sizeof(vnet_header) : 0;
+        }
+
+        size_t getFrameSize() const
+        {
+            return (this->flags & FLAG_VNET_HDR) ? gso_frame_max : this->mtu;
+        }
+
+        // Segments of a single packet, leaving room for the header
+        size_t getSegmentLimit() const
+        {
+            return IOV_MAX - (this->getHeaderSize() > 0 ? 1 : 0);
+        }
+
+        ssize_t readPacket(int fd, uint8_t* buffer, size_t size,
+                           vnet_header* header) const;
+
+        ssize_t writePacket(int fd, struct iovec* iovecs, size_t count,
+                            vnet_header const* header) const;
+
         void setMAC(string mac);
 
         string getMAC() const;
@@ -143,15 +397,101 @@ class VIfaceImpl
 
         uint getMTU() const;
 
+        uint getIndex() const;
+
         void up();
 
         void down() const;
 
         bool isUp() const;
 
-        vector<uint8_t> receive();
+        void setAttached(uint queue, bool attached);
+
+        bool isAttached(uint queue) const;
+
+        void setSteering(steering_mode mode);
+
+        void setSteeringProgram(int program);
+
+        struct viface_ring& getRing(uint queue);
+
+        void enableRing(uint blocks, size_t block_size, uint millis,
+                        uint queue);
+
+        size_t receiveRing(packet_view* views, size_t count, int millis,
+                           uint queue);
+
+        void releaseBlock(uint queue);
+
+        struct viface_ring& getSendRing(uint queue) const;
+
+        void enableSendRing(uint frames, size_t frame_size, uint queue);
+
+        size_t acquireSlots(packet_buffer* slots, size_t count,
+                            uint queue) const;
+
+        void sendSlots(packet_buffer const* slots, size_t count,
+                       uint queue) const;
+
+        uint64_t getDroppedSlots(uint queue) const
+        {
+            return this->getSendRing(queue).dropped;
+        }
+
+        int flushSlots(packet_buffer const* slots, size_t count,
+                       uint queue) const;
+
+        ssize_t writeRing(struct iovec const* iovecs, size_t count,
+                          uint queue) const;
+
+        void checkRead(uint queue) const;
+
+        steering_mode getSteering() const
+        {
+            return this->steering;
+        }
+
+        vector<uint8_t> receive(uint queue);
+
+        size_t receive(uint8_t* buffer, size_t size, uint queue);
+
+        size_t receive(uint8_t* buffer, size_t size, vnet_header* header,
+                       uint queue);
+
+        size_t receiveBatch(packet_buffer* buffers, size_t count, uint queue);
 
-        void send(vector<uint8_t>& packet) const;
+        size_t receive(PacketBuffer& buffer, vnet_header* header, uint queue);
+
+        io_status tryReceive(uint8_t* buffer, size_t size, vnet_header* header,
+                             size_t* length, uint queue) noexcept;
+
+        io_status tryReceiveBatch(packet_buffer* buffers, size_t count,
+                                  size_t* nreceived, uint queue) noexcept;
+
+        bool isValidSize(size_t size, bool gso = false) const;
+
+        void checkSize(size_t size, bool gso = false) const;
+
+        void send(vector<uint8_t>& packet, uint queue) const;
+
+        size_t sendBatch(packet_buffer const* buffers, size_t count,
+                         uint queue) const;
+
+        void send(packet_segment const* segments, size_t count,
+                  uint queue) const;
+
+        void send(packet_segment const* segments, size_t count,
+                  vnet_header const* header, uint queue) const;
+
+        void send(PacketBuffer const& buffer, vnet_header const* header,
+                  uint queue) const;
+
+        io_status trySend(packet_segment const* segments, size_t count,
+                          vnet_header const* header,
+                          uint queue) const noexcept;
+
+        io_status trySendBatch(packet_buffer const* buffers, size_t count,
+                               size_t* sent, uint queue) const noexcept;
 
         set<string> listStats();
 
@@ -160,6 +500,471 @@ class VIfaceImpl
         uint64_t readStat(string const& stat);
 
         void clearStat(string const& stat);
+
+        uint64_t getIgnoredOutgoing();
+
+        size_t getMemoryFootprint() const;
+};
+
+/**
+ * Minimal eBPF assembler for the built-in steering and XDP programs.
+ *
+ * R1 holds the context on entry and R0 the return value on exit(). Steering
+ * programs are socket filters: the legacy packet loads (LD_ABS, LD_IND)
+ * expect the __sk_buff context in R6, and the return value selects the
+ * queue.
+ */
+class BpfProgram
+{
+    private:
+
+        vector<struct bpf_insn> insns;
+        map<string,size_t> labels;
+        vector<pair<size_t,string> > fixups;
+
+        void emit(uint8_t code, uint8_t dst, uint8_t src, int16_t off,
+                  int32_t imm)
+        {
+            struct bpf_insn insn;
+            memset(&insn, 0, sizeof(struct bpf_insn));
+            insn.code = code;
+            insn.dst_reg = dst;
+            insn.src_reg = src;
+            insn.off = off;
+            insn.imm = imm;
+            this->insns.push_back(insn);
+        }
+
+    public:
+
+        void label(string const& name)
+        {
+            this->labels[name] = this->insns.size();
+        }
+
+        void mov(uint8_t dst, uint8_t src)
+        {
+            this->emit(BPF_ALU64 | BPF_MOV | BPF_X, dst, src, 0, 0);
+        }
+
+        void movi(uint8_t dst, int32_t imm)
+        {
+            this->emit(BPF_ALU64 | BPF_MOV | BPF_K, dst, 0, 0, imm);
+        }
+
+        void alu(uint8_t op, uint8_t dst, uint8_t src)
+        {
+            this->emit(BPF_ALU64 | op | BPF_X, dst, src, 0, 0);
+        }
+
+        void alui(uint8_t op, uint8_t dst, int32_t imm)
+        {
+            this->emit(BPF_ALU64 | op | BPF_K, dst, 0, 0, imm);
+        }
+
+        // R0 = packet[offset], converted to host order
+        void ldabs(uint8_t size, int32_t offset)
+        {
+            this->emit(BPF_LD | BPF_ABS | size, 0, 0, 0, offset);
+        }
+
+        // R0 = packet[src + offset], converted to host order
+        void ldind(uint8_t size, uint8_t src, int32_t offset)
+        {
+            this->emit(BPF_LD | BPF_IND | size, 0, src, 0, offset);
+        }
+
+        // dst = context[offset]
+        void ldctx(uint8_t dst, int16_t offset)
+        {
+            this->emit(BPF_LDX | BPF_MEM | BPF_W, dst, BPF_REG_1, offset, 0);
+        }
+
+        void jump(uint8_t op, uint8_t dst, int32_t imm, string const& target)
+        {
+            this->fixups.push_back(make_pair(this->insns.size(), target));
+            this->emit(BPF_JMP | op | BPF_K, dst, 0, 0, imm);
+        }
+
+        // dst = map referenced by a file descriptor, a double instruction
+        void ldmap(uint8_t dst, int fd)
+        {
+            this->emit(BPF_LD | BPF_DW | BPF_IMM, dst, BPF_PSEUDO_MAP_FD, 0,
+                       fd);
+            this->emit(0, 0, 0, 0, 0);
+        }
+
+        void call(int32_t helper)
+        {
+            this->emit(BPF_JMP | BPF_CALL, 0, 0, 0, helper);
+        }
+
+        void exit()
+        {
+            this->emit(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+        }
+
+        int load(uint32_t type = BPF_PROG_TYPE_SOCKET_FILTER);
+};
+
+#ifdef VIFACE_HAVE_IO_URING
+// Reads posted at once on each interface by the io_uring engine. Whether the
+// last one finds a packet too tells if more are queued.
+const unsigned uring_reads = 2;
+
+class UringEngine
+{
+    private:
+
+        // Reads are posted as a chain, each into its part of the buffer
+        struct uring_slot
+        {
+            void* owner;
+            int fd;
+            int file_index;
+            int buf_index;
+            unique_ptr<uint8_t[]> buffer;
+            size_t size;
+            short events;
+            int results[uring_reads];
+            unsigned reads;
+            unsigned posted;
+            unsigned completed;
+            bool inflight;
+            bool removed;
+            bool held;
+        };
+
+        // Completed read waiting to be dispatched
+        struct uring_ready
+        {
+            size_t index;
+            unsigned part;
+            bool last;
+        };
+
+        int ring_fd;
+
+        uint8_t* ring;
+        size_t ring_size;
+
+        unsigned* sq_head;
+        unsigned* sq_tail;
+        unsigned* sq_array;
+        unsigned sq_mask;
+        unsigned sq_entries;
+        unsigned sqe_tail;
+        unsigned to_submit;
+        struct io_uring_sqe* sqes;
+        size_t sqes_size;
+
+        unsigned* cq_head;
+        unsigned* cq_tail;
+        unsigned cq_mask;
+        struct io_uring_cqe* cqes;
+
+        bool fixed_files;
+        bool fixed_buffers;
+        size_t inflight;
+
+        vector<uring_slot> slots;
+        vector<size_t> free_slots;
+        deque<uring_ready> ready;
+
+        vector<PacketBuffer> writes;
+        vector<size_t> free_writes;
+        uint64_t send_errors;
+
+        struct io_uring_sqe* getSQE(unsigned needed = 1);
+
+        int submit(unsigned min_complete, int millis);
+
+        void reap();
+
+        void post(size_t index, bool poll);
+
+        void cancel(size_t index);
+
+        void complete(size_t index);
+
+        void updateFile(int index, int fd);
+
+        void updateBuffer(int index, uint8_t* buffer, size_t size);
+
+    public:
+
+        UringEngine();
+        ~UringEngine();
+
+        size_t add(void* owner, int fd, size_t size, short events = POLLIN);
+
+        void remove(size_t index);
+
+        bool hold(size_t index, uint8_t** data, ssize_t* result);
+
+        void send(int fd, PacketBuffer const& buffer);
+
+        void flush();
+
+        ssize_t wait(int millis);
+
+        bool pop(size_t* index, void** owner, uint8_t** data,
+                 ssize_t* result, bool* last, bool* busy);
+
+        void rearm(size_t index, bool poll);
+
+        void setReads(size_t index, unsigned reads)
+        {
+            this->slots[index].reads = reads;
+        }
+
+        bool isFixed() const
+        {
+            return this->fixed_files && this->fixed_buffers;
+        }
+
+        uint64_t getSendErrors() const
+        {
+            return this->send_errors;
+        }
+};
+#endif
+
+// Default number of packets read from a ready interface before moving on
+const uint dispatch_budget = 64;
+
+// Time given to pending packets when a send queue is removed on destruction
+const int send_linger = 100;
+
+// Minimum number of buffers in the reception pool of a dispatcher, and the
+// room reserved in front of the packets read into them
+const size_t dispatch_pool = 256;
+const size_t dispatch_headroom = 128;
+
+// Interface queue registered in a dispatcher
+typedef pair<VIface*,uint> dispatcher_key;
+
+struct dispatcher_txq;
+
+struct dispatcher_entry
+{
+    VIface* iface;
+    uint queue;
+    size_t slot;
+    uint budget;
+    dispatcher_stats stats;
+
+    // Packets were left in the queue by its last drain
+    bool pending;
+
+    // Metadata of its packets, only data, length and timestamp change
+    packet_info info;
+
+    // Send queue polled for writability, if not a reception entry
+    dispatcher_txq* txq;
+};
+
+// Packet waiting in a send queue, with the time it was accepted
+struct dispatcher_frame
+{
+    PacketBuffer buffer;
+    uint64_t time;
+};
+
+struct dispatcher_txq
+{
+    dispatcher_entry poller;
+    int fd;
+    bool armed;
+    bool dirty;
+    size_t high_water;
+    deque<dispatcher_frame> frames;
+    send_queue_stats stats;
+};
+
+// Handler of a dispatch loop, called for each batch
+struct dispatcher_handler
+{
+    dispatcher_fn fn;
+    void* context;
+};
+
+class DispatcherImpl
+{
+    private:
+
+        int epoll_fd;
+        map<dispatcher_key,dispatcher_entry> ifaces;
+        dispatcher_engine engine;
+
+        // Send queues, and those with packets queued since the last flush
+        map<dispatcher_key,dispatcher_txq> txqs;
+        vector<dispatcher_txq*> dirty;
+
+#ifdef VIFACE_HAVE_IO_URING
+        unique_ptr<UringEngine> uring;
+
+        io_status runUring(dispatcher_handler& handler, int millis);
+
+        io_status stage(dispatcher_entry* entry, uint8_t const* data,
+                        size_t length, dispatcher_handler& handler,
+                        bool* proceed);
+#endif
+
+        // Queue whose failure stopped the last dispatch, if any, so the
+        // error message is only formatted when reported
+        dispatcher_entry* failed;
+
+        // Copy of the packet handed to dispatcher_cb callbacks, reused and
+        // with room for the largest frame, so dispatching doesn't allocate
+        vector<uint8_t> packet;
+
+        // Pool the reception slots are taken from, replaced by a larger one
+        // when a frame doesn't fit in its buffers
+        unique_ptr<PacketPool> pool;
+
+        // Packets gathered for the handler, read in place into their slots,
+        // and how many of them are waiting to be handed over
+        vector<PacketBuffer> slots;
+        vector<packet_buffer> buffers;
+        vector<packet_info> batch;
+        size_t batch_size;
+        size_t batched;
+
+        dispatcher_entry& getEntry(VIface* iface, uint queue);
+
+        io_status drain(dispatcher_entry* entry, uint work,
+                        dispatcher_handler& handler, bool* proceed);
+
+        bool reserve(size_t count, size_t size) noexcept;
+
+        bool refill(PacketBuffer& slot, size_t size) noexcept;
+
+        bool deliver(dispatcher_handler& handler);
+
+        io_status fail(dispatcher_handler& handler);
+
+        void resume(dispatcher_entry& entry, bool empty);
+
+        void setBatchSize(size_t size);
+
+        io_status run(dispatcher_handler& handler, int millis);
+
+        void checkStatus(io_status status) const;
+
+        dispatcher_txq& getSendQueue(VIface* iface, uint queue);
+
+        io_status flushQueue(dispatcher_txq& txq);
+
+        io_status flushQueues();
+
+        io_status pollSendQueue(dispatcher_txq& txq);
+
+    public:
+
+        DispatcherImpl(dispatcher_engine engine);
+        ~DispatcherImpl();
+
+        dispatcher_engine getEngine() const
+        {
+            return this->engine;
+        }
+
+        void add(VIface* iface, uint queue);
+
+        void remove(VIface* iface, uint queue);
+
+        size_t getSize() const
+        {
+            return this->ifaces.size();
+        }
+
+        void setBudget(VIface* iface, uint budget, uint queue);
+
+        uint getBudget(VIface* iface, uint queue);
+
+        dispatcher_stats getStats(VIface* iface, uint queue);
+
+        pool_stats getPoolStats() const;
+
+        size_t drainQueue(VIface* iface, packet_cb& callback, uint queue);
+
+        vector<uint8_t>& getPacket()
+        {
+            this->packet.reserve(gso_frame_max);
+            return this->packet;
+        }
+
+        // Name of an interface, without the copy VIface::getName() makes
+        static string const& getName(VIface const* iface)
+        {
+            return iface->pimpl->getName();
+        }
+
+        void dispatch(dispatcher_fn fn, void* context, int millis,
+                      size_t size);
+
+        io_status tryDispatch(dispatcher_fn fn, void* context, int millis,
+                              size_t size) noexcept;
+
+        void send(VIface* iface, PacketBuffer const& buffer, uint queue);
+
+        void flush();
+
+        uint64_t getSendErrors() const;
+
+        void addSendQueue(VIface* iface, size_t high_water, uint queue);
+
+        void removeSendQueue(VIface* iface, uint queue, int millis);
+
+        bool enqueue(VIface* iface, PacketBuffer&& buffer, uint queue);
+
+        send_queue_stats getSendQueueStats(VIface* iface, uint queue);
+};
+
+class QueueControllerImpl
+{
+    private:
+
+        Dispatcher& dispatcher;
+        VIface* iface;
+        uint min_queues;
+        double low;
+        double high;
+
+        // Packets of queues about to be detached go there, or are dropped
+        packet_cb callback;
+        uint64_t dropped;
+
+        // Counters at the previous update, for the attached queues
+        vector<dispatcher_stats> last;
+        chrono::steady_clock::time_point last_update;
+
+        void attach(uint queue);
+
+        void detach(uint queue);
+
+    public:
+
+        QueueControllerImpl(Dispatcher& dispatcher, VIface* iface,
+                            uint min_queues);
+        ~QueueControllerImpl();
+
+        void setThresholds(double low, double high);
+
+        void setCallback(packet_cb callback)
+        {
+            this->callback = callback;
+        }
+
+        uint64_t getDropped() const
+        {
+            return this->dropped;
+        }
+
+        uint update();
+
+        uint getAttached() const;
 };
 };
 #endif // _VIFACE_PRIV_HPP
\ No newline at end of file
@@ -30,8 +30,10 @@
 #include <vector>
 #include <set>
 #include <functional>
+#include <utility>
 
 #include "viface/config.hpp"
+#include "viface/buffer.hpp"
 
 namespace viface
 {
@@ -42,6 +44,162 @@ namespace viface
 
 class VIfaceImpl;
 class VIface;
+class DispatcherImpl;
+class QueueControllerImpl;
+
+/**
+ * Caller-owned packet buffer descriptor used by the batched I/O functions.
+ */
+struct packet_buffer
+{
+    /** Memory holding the packet (if tun) or frame (if tap). */
+    uint8_t* data;
+
+    /** Capacity in bytes of the memory pointed by data. */
+    size_t size;
+
+    /**
+     * Number of valid bytes in data. Set by reception functions, read by
+     * emission functions.
+     */
+    size_t length;
+};
+
+/**
+ * Caller-owned packet segment descriptor used by scatter-gather emission.
+ */
+struct packet_segment
+{
+    /** Memory holding the segment bytes. */
+    uint8_t const* data;
+
+    /** Number of bytes in the segment. */
+    size_t length;
+};
+
+/**
+ * Frame held in place by a reception ring. See VIface::receiveRing().
+ */
+struct packet_view
+{
+    /** Memory holding the frame, inside the ring. */
+    uint8_t const* data;
+
+    /**
+     * Number of bytes of the frame in data. Frames larger than a block of
+     * the ring are truncated.
+     */
+    size_t length;
+};
+
+/**
+ * Outcome of the exception-free data path methods, such as
+ * VIface::tryReceive(). Anything but IO_OK leaves errno set to the reason.
+ */
+enum io_status
+{
+    /** Done. */
+    IO_OK = 0,
+
+    /**
+     * Nothing to receive, or no room to send, for now (EAGAIN or ENOBUFS).
+     */
+    IO_AGAIN,
+
+    /**
+     * Invalid request, nothing was done. For example, the queue doesn't exist
+     * (EINVAL) or the packet size is out of bounds (EMSGSIZE).
+     */
+    IO_INVALID,
+
+    /** The system call failed, see errno. */
+    IO_ERROR
+};
+
+/**
+ * Metadata of a packet received by a Dispatcher. See packet_cb.
+ */
+struct packet_info
+{
+    /** Virtual interface that received the packet. */
+    VIface* iface;
+
+    /** Numeric ID assigned to the virtual interface. */
+    uint id;
+
+    /** Queue of the interface that received the packet. */
+    uint queue;
+
+    /** Kernel index of the network interface. See VIface::getIndex(). */
+    uint ifindex;
+
+    /**
+     * Time the dispatcher woke up for the queue, in nanoseconds of the
+     * steady clock. Packets drained on the same wakeup share it.
+     */
+    uint64_t timestamp;
+
+    /**
+     * Packet (if tun) or frame (if tap). Owned by the dispatcher and only
+     * valid until the callback returns.
+     */
+    uint8_t* data;
+
+    /** Number of bytes of the packet in data. */
+    size_t length;
+
+    /**
+     * Pooled buffer holding the packet, with headroom to add headers in
+     * place. Copying the handle keeps the packet past the callback, for
+     * example to pass it to Dispatcher::enqueue(), and the dispatcher reads
+     * the next packets into other buffers. Null for packets passed by
+     * Dispatcher::drainQueue().
+     */
+    PacketBuffer* buffer;
+};
+
+/**
+ * Dispatch callback type to handle packet reception with its metadata.
+ *
+ * Unlike dispatcher_cb, nothing is built for each packet but the metadata
+ * record, so no interface name is copied.
+ *
+ * @param[in]  info Packet received and where it came from.
+ *
+ * @return true if the dispatcher should continue processing or false to stop.
+ */
+typedef std::function<bool (packet_info const& info)> packet_cb;
+
+/**
+ * Dispatch callback type to handle packet reception in batches.
+ *
+ * Packets are gathered from every interface ready on the same wakeup, in
+ * the order they were read, and handed over at once so they can be
+ * processed as a vector.
+ *
+ * @param[in]  packets Array of received packets. Their data is owned by the
+ *             dispatcher and only valid until the callback returns.
+ * @param[in]  count Number of packets in the array, never 0.
+ *
+ * @return true if the dispatcher should continue processing or false to stop.
+ */
+typedef std::function<bool (packet_info const* packets,
+                            size_t count)> batch_cb;
+
+/**
+ * Low-level dispatch handler, called with the packets gathered on a wakeup.
+ * See Dispatcher::dispatchRaw().
+ *
+ * @param[in]  context Opaque pointer given to Dispatcher::dispatchRaw().
+ * @param[in]  packets Array of received packets. Their data is owned by the
+ *             dispatcher and only valid until the handler returns.
+ * @param[in]  count Number of packets in the array, never 0.
+ *
+ * @return true if the dispatcher should continue processing or false to stop.
+ *         Every packet passed is considered handled either way.
+ */
+typedef bool (*dispatcher_fn)(void* context, packet_info const* packets,
+                              size_t count);
 
 /**
  * Dispatch callback type to handle packet reception.
@@ -59,8 +217,9 @@ typedef std::function<bool (std::string const& name, uint id,
 /**
  * Dispatch function to handle packet reception for a group of interfaces.
  *
- * This function is implemented using an efficient select() system call to
- * monitor many network interfaces.
+ * This function is implemented using a temporary Dispatcher object, where
+ * every queue of the given interfaces is registered. Use a Dispatcher
+ * directly to avoid registering the interfaces on each call.
  *
  * @param[in]  ifaces a std::set of virtual interfaces to monitor.
  * @param[in]  callback a dispatcher_cb callback to be called to handle packet
@@ -78,6 +237,197 @@ typedef std::function<bool (std::string const& name, uint id,
 void dispatch(std::set<VIface*>& ifaces, dispatcher_cb callback,
               int millis = -1);
 
+/**
+ * Optional features of a virtual interface, combined as a bitmask. See
+ * VIface::VIface().
+ */
+enum viface_flags
+{
+    /**
+     * Exchange a vnet_header with every packet (IFF_VNET_HDR) and enable
+     * the checksum and segmentation offloads (TCP over IPv4 and IPv6, and
+     * UDP if the kernel supports it). The kernel then hands over packets
+     * with a partial checksum and super-frames of up to 64 KB, to be
+     * described by their header, and accepts the same on send.
+     *
+     * When hooking an existing interface PACKET_VNET_HDR is set on its
+     * packet sockets instead. Super-frames are then received whole rather
+     * than truncated to the MTU, and the kernel segments the ones sent as
+     * needed by the interface. Its offloads are left untouched.
+     */
+    FLAG_VNET_HDR = 1 << 0,
+
+    /**
+     * Hook an existing interface through AF_XDP sockets instead of packet
+     * sockets, for the highest packet rates. An XDP program redirecting the
+     * frames received on each device queue to the socket bound to it is
+     * attached to the interface, natively if the driver supports XDP and as
+     * generic XDP otherwise, so any interface (for example, one end of a
+     * veth pair) can be used. The hook must have as many queues as the
+     * device has receive queues, queue N getting the frames of device
+     * queue N.
+     *
+     * Frames are exchanged through a memory area shared with the kernel
+     * (UMEM), and the send and receive methods copy them in and out of it,
+     * so applications don't change. Unlike packet sockets, only frames
+     * received by the interface are seen, not the ones it sends, and they
+     * are not delivered to the kernel anymore. Only one XDP hook per
+     * interface is possible, and it can't be combined with FLAG_VNET_HDR or
+     * memory-mapped rings.
+     */
+    FLAG_XDP = 1 << 1,
+
+    /**
+     * Spread the frames seen by a hooked interface with multiple queues by
+     * the CPU that handled them (PACKET_FANOUT_CPU), instead of by flow
+     * hash (PACKET_FANOUT_HASH, default).
+     */
+    FLAG_FANOUT_CPU = 1 << 2,
+
+    /**
+     * Spread the frames seen by a hooked interface with multiple queues
+     * round-robin (PACKET_FANOUT_LB), regardless of their flow.
+     */
+    FLAG_FANOUT_LB = 1 << 3,
+
+    /**
+     * Deliver the frames seen by a hooked interface with multiple queues to
+     * a single queue, moving on to the next one only when it is full
+     * (PACKET_FANOUT_ROLLOVER).
+     */
+    FLAG_FANOUT_ROLLOVER = 1 << 4,
+
+    /**
+     * Keep the frames sent on a hooked interface off its receive sockets
+     * (PACKET_IGNORE_OUTGOING). Hooked sockets see every frame crossing the
+     * interface, including those sent by the virtual interface itself,
+     * which otherwise have to be received and filtered out. See
+     * VIface::getIgnoredOutgoing().
+     */
+    FLAG_IGNORE_OUTGOING = 1 << 5,
+
+    /**
+     * Send the frames of a hooked interface straight to its driver,
+     * skipping the queueing discipline layer (PACKET_QDISC_BYPASS). This
+     * lowers the transmission latency, but frames are dropped instead of
+     * queued when the driver is busy and no traffic shaping applies to
+     * them. Frames sent this way are not seen by other packet sockets
+     * either.
+     */
+    FLAG_QDISC_BYPASS = 1 << 6
+};
+
+/**
+ * Segmentation and checksum metadata of a packet, as exchanged with the
+ * kernel in FLAG_VNET_HDR mode.
+ *
+ * The layout and values mirror struct virtio_net_hdr, in host byte order.
+ */
+struct vnet_header
+{
+    /**
+     * VNET_HDR_F_* flags.
+     */
+    uint8_t flags;
+
+    /**
+     * VNET_HDR_GSO_* segmentation type, VNET_HDR_GSO_NONE for a regular
+     * packet.
+     */
+    uint8_t gso_type;
+
+    /**
+     * Length of the headers to copy into each segment.
+     */
+    uint16_t hdr_len;
+
+    /**
+     * Payload size of each segment.
+     */
+    uint16_t gso_size;
+
+    /**
+     * Offset where checksumming starts, if VNET_HDR_F_NEEDS_CSUM.
+     */
+    uint16_t csum_start;
+
+    /**
+     * Offset after csum_start where the checksum is stored, if
+     * VNET_HDR_F_NEEDS_CSUM.
+     */
+    uint16_t csum_offset;
+} __attribute__((packed));
+
+/**
+ * Values of the vnet_header flags.
+ */
+enum vnet_header_flags
+{
+    /**
+     * The checksum described by csum_start and csum_offset is partial and
+     * must be completed.
+     */
+    VNET_HDR_F_NEEDS_CSUM = 1,
+
+    /**
+     * The checksum was already validated.
+     */
+    VNET_HDR_F_DATA_VALID = 2
+};
+
+/**
+ * Values of the vnet_header segmentation type.
+ */
+enum vnet_header_gso
+{
+    VNET_HDR_GSO_NONE = 0,
+    VNET_HDR_GSO_TCPV4 = 1,
+    VNET_HDR_GSO_UDP = 3,
+    VNET_HDR_GSO_TCPV6 = 4,
+    VNET_HDR_GSO_UDP_L4 = 5,
+    VNET_HDR_GSO_ECN = 0x80
+};
+
+/**
+ * Queue selection policies for the packets sent to a multi-queue tun/tap
+ * interface. See VIface::setSteering().
+ */
+enum steering_mode
+{
+    /**
+     * The kernel picks the queue using its own flow hash (default).
+     */
+    STEERING_KERNEL,
+
+    /**
+     * IPv4 and IPv6 packets are spread by 5-tuple. The hash is the XOR of
+     * the 32-bit words of the source and destination addresses, the
+     * protocol number and, for unfragmented TCP, UDP and SCTP packets, the
+     * 32-bit word holding the source and destination ports, all in host
+     * order. The queue is (hash ^ (hash >> 16)) modulo the number of
+     * attached queues. Other packets go to the first attached queue.
+     */
+    STEERING_FLOW,
+
+    /**
+     * Ethernet frames are spread by VLAN id, modulo the number of attached
+     * queues. Untagged frames go to the first attached queue. Tap only.
+     */
+    STEERING_VLAN,
+
+    /**
+     * Ethernet frames are spread by destination MAC address, so all the
+     * frames for a given MAC address go to the same queue. Tap only.
+     */
+    STEERING_MAC,
+
+    /**
+     * A user-provided eBPF program picks the queue. See
+     * VIface::setSteeringProgram().
+     */
+    STEERING_PROGRAM
+};
+
 /**
  * Virtual Interface object.
  *
@@ -90,8 +440,7 @@ class VIface
         std::unique_ptr<VIfaceImpl> pimpl;
         VIface(const VIface& other) = delete;
         VIface& operator=(VIface rhs) = delete;
-        friend void dispatch(std::set<VIface*>& ifaces, dispatcher_cb callback,
-                             int millis);
+        friend class DispatcherImpl;
 
     public:
 
@@ -103,11 +452,22 @@ class VIface
          * @param[in]  tap Tap device (default, true) or Tun device (false).
          * @param[in]  id Optional numeric id. If given id < 0 a sequential
          *             number will be given.
+         * @param[in]  queues Optional number of queues of a new tun/tap
+         *             device. Each queue can be used independently, for
+         *             example, by a different thread. When hooking, each
+         *             queue gets its own packet sockets, joined into a
+         *             fanout group that spreads the frames seen across them
+         *             (see FLAG_FANOUT_CPU and following). With the XDP
+         *             backend, there must be one per receive queue of the
+         *             device.
+         * @param[in]  flags Optional bitmask of viface_flags features.
          */
         explicit VIface(
             std::string name = "viface%d",
             bool tap = true,
-            int id = -1
+            int id = -1,
+            uint queues = 1,
+            uint flags = 0
             );
         ~VIface();
 
@@ -125,6 +485,124 @@ class VIface
          */
         uint getID() const;
 
+        /**
+         * Getter method for the number of queues of the virtual interface.
+         *
+         * The kernel spreads the packets sent to the interface across its
+         * queues by flow, so all packets of a flow are received on the same
+         * queue. Hooked interfaces spread the frames seen according to
+         * their fanout mode instead. Packets can be sent on any queue.
+         * Every send and receive method takes an optional queue index,
+         * which defaults to the first one. An exception is thrown if the
+         * index is out of range.
+         *
+         * @return the number of queues of the virtual interface.
+         */
+        uint getQueues() const;
+
+        /**
+         * Getter method for the features of the virtual interface.
+         *
+         * @return the viface_flags bitmask given on creation.
+         */
+        uint getFlags() const;
+
+        /**
+         * Getter method for the number of outgoing frames kept off the
+         * receive sockets of a hooked interface.
+         *
+         * Counts the frames transmitted by the interface, as reported by its
+         * tx_packets statistic, since it was hooked. Each of them would have
+         * been received as well without FLAG_IGNORE_OUTGOING.
+         *
+         * @return number of outgoing frames ignored, 0 if the interface was
+         *         not hooked with FLAG_IGNORE_OUTGOING.
+         *         An exception is thrown in case of IO error.
+         */
+        uint64_t getIgnoredOutgoing();
+
+        /**
+         * Attach a detached queue back to the virtual interface.
+         *
+         * The kernel resumes steering flows to the queue. See detachQueue().
+         *
+         * @param[in]  queue Queue to attach.
+         *
+         * @return always void.
+         *         An exception is thrown if the queue doesn't exist, the
+         *         interface is hooked or the kernel refuses the request.
+         */
+        void attachQueue(uint queue);
+
+        /**
+         * Detach a queue from the virtual interface.
+         *
+         * The kernel stops steering flows to the queue and spreads them
+         * across the queues still attached, but the queue is kept open so
+         * it can be attached again without recreating the interface. A
+         * detached queue can still send packets. Packets already queued in
+         * it are dropped by the kernel, so drain it right before, see
+         * Dispatcher::drainQueue().
+         *
+         * @param[in]  queue Queue to detach.
+         *
+         * @return always void.
+         *         An exception is thrown if the queue doesn't exist, the
+         *         interface is hooked or the kernel refuses the request.
+         */
+        void detachQueue(uint queue);
+
+        /**
+         * Check if a queue is attached to the virtual interface.
+         *
+         * @param[in]  queue Queue to check.
+         *
+         * @return true if the queue is attached, false if it was detached.
+         */
+        bool isAttached(uint queue) const;
+
+        /**
+         * Select how the kernel spreads the packets sent to this interface
+         * across its queues.
+         *
+         * Except for STEERING_KERNEL, an eBPF steering program is built,
+         * loaded and attached to the interface. The queue selected for a
+         * packet only depends on its headers, so a given flow is always
+         * received on the same queue while the set of attached queues
+         * doesn't change.
+         *
+         * @param[in]  mode Steering mode. Use setSteeringProgram() for
+         *             STEERING_PROGRAM.
+         *
+         * @return always void.
+         *         An exception is thrown if the interface is hooked, the mode
+         *         doesn't apply to this kind of device, or the program can't
+         *         be loaded or attached.
+         */
+        void setSteering(steering_mode mode);
+
+        /**
+         * Attach a user-provided eBPF steering program to this interface.
+         *
+         * @param[in]  program File descriptor of a loaded eBPF program of
+         *             type BPF_PROG_TYPE_SOCKET_FILTER. Its return value,
+         *             modulo the number of attached queues, selects the
+         *             queue. The kernel takes its own reference, so the
+         *             caller may close the descriptor afterwards.
+         *
+         * @return always void.
+         *         An exception is thrown if the interface is hooked or the
+         *         program can't be attached.
+         */
+        void setSteeringProgram(int program);
+
+        /**
+         * Getter method for the steering mode in use.
+         *
+         * @return the steering mode of this interface.
+         */
+        steering_mode getSteering() const;
+
         /**
          * Set the MAC address of the virtual interface.
          *
@@ -265,6 +743,15 @@ class VIface
          */
         uint getMTU() const;
 
+        /**
+         * Getter method for the kernel index of the network interface.
+         *
+         * For hooked interfaces, this is the index of the hooked interface.
+         *
+         * @return the interface index, as used by sockaddr_ll and netlink.
+         */
+        uint getIndex() const;
+
         /**
          * Bring up the virtual interface.
          *
@@ -303,10 +790,76 @@ class VIface
          * interface with the name of the instance of this class. If not packet
          * was available, and empty vector is returned.
          *
+         * A new vector is allocated for each packet. Use
+         * receive(PacketBuffer&) with buffers from a PacketPool to receive
+         * without allocating.
+         *
+         * @param[in]  queue Optional queue to use, see getQueues().
+         *
          * @return the packet (if tun) or frame (if tap) as a binary blob
          *         (array of bytes).
          */
-        std::vector<uint8_t> receive();
+        std::vector<uint8_t> receive(uint queue = 0);
+
+        /**
+         * Receive a packet from the virtual interface into a caller-owned
+         * buffer.
+         *
+         * This is the zero-copy version of receive(): the packet is read
+         * directly into the given memory and no allocation is performed.
+         * The buffer should be large enough to hold a full packet (MTU, plus
+         * the Ethernet 2 header if tap), any excess will be truncated.
+         *
+         * @param[out] buffer Memory to store the packet (if tun) or frame
+         *             (if tap) into.
+         * @param[in]  size Capacity in bytes of the given buffer.
+         * @param[in]  queue Optional queue to use, see getQueues().
+         *
+         * @return the number of bytes written into the buffer. 0 means no
+         *         packet was available.
+         *         Exceptions are thrown in case of read errors.
+         */
+        size_t receive(uint8_t* buffer, size_t size, uint queue = 0);
+
+        /**
+         * Receive up to count packets from the virtual interface in a single
+         * call.
+         *
+         * The pending packets are drained into the given caller-owned
+         * buffers until either all buffers are used or no more packets are
+         * available. For hooked interfaces a single recvmmsg() system call is
+         * used, for tun/tap devices the queue is read in a tight loop.
+         *
+         * @param[in,out] buffers Array of buffers to store the packets into.
+         *             The length of each used buffer is updated with the size
+         *             of the packet received in it.
+         * @param[in]  count Number of buffers in the array.
+         * @param[in]  queue Optional queue to use, see getQueues().
+         *
+         * @return the number of packets received, stored in the first
+         *         buffers of the array. 0 means no packet was available.
+         *         Exceptions are thrown in case of read errors if no packet
+         *         could be received.
+         */
+        size_t receiveBatch(packet_buffer* buffers, size_t count,
+                            uint queue = 0);
+
+        /**
+         * Receive a packet from the virtual interface into a packet buffer.
+         *
+         * The buffer is reset and the packet is stored right after its
+         * reserved headroom, leaving its reserved tailroom untouched, so
+         * headers and trailers can be added or removed in place afterwards.
+         *
+         * @param[in,out] buffer Packet buffer to store the packet (if tun) or
+         *             frame (if tap) into.
+         * @param[in]  queue Optional queue to use, see getQueues().
+         *
+         * @return the size of the packet received. 0 means no packet was
+         *         available.
+         *         Exceptions are thrown in case of read errors.
+         */
+        size_t receive(PacketBuffer& buffer, uint queue = 0);
 
         /**
          * Send a packet to this virtual interface.
@@ -318,50 +871,1121 @@ class VIface
          *
          * @param[in]  packet Packet (if tun) or frame (if tap) to send as a
          *             binary blob (array of bytes).
+         * @param[in]  queue Optional queue to use, see getQueues().
          *
          * @return always void.
          *         Exceptions are thrown in case of misbehaviours. For example,
          *         size of the packet will be checked against MTU and minimal
          *         Ethernet 2 size. Another case can be write errors.
          */
-        void send(std::vector<uint8_t>& packet) const;
+        void send(std::vector<uint8_t>& packet, uint queue = 0) const;
 
         /**
-         * List available statistics for this interface.
+         * Send up to count packets to this virtual interface in a single
+         * call.
          *
-         * @return set of statistics names.
-         *         For example, {"rx_packets", "tx_bytes", ...}
-         *         Exceptions can be thrown in case of generic IO errors.
+         * For hooked interfaces a single sendmmsg() system call is used, for
+         * tun/tap devices the queue is written in a tight loop. Emission
+         * stops as soon as the kernel queue is full, so the caller can retry
+         * the remaining packets later.
+         *
+         * @param[in]  buffers Array of packets (if tun) or frames (if tap) to
+         *             send. The length of each buffer is the size of the
+         *             packet.
+         * @param[in]  count Number of buffers in the array.
+         * @param[in]  queue Optional queue to use, see getQueues().
+         *
+         * @return the number of packets accepted, always the first ones of
+         *         the array.
+         *         Exceptions are thrown in case of misbehaviours. The size of
+         *         every packet is checked against MTU and minimal Ethernet 2
+         *         size before sending any of them. Write errors throw only if
+         *         no packet could be sent.
          */
-        std::set<std::string> listStats();
+        size_t sendBatch(packet_buffer const* buffers, size_t count,
+                         uint queue = 0) const;
 
         /**
-         * Read given statistic for this interface.
+         * Send a packet built from several memory segments to this virtual
+         * interface.
          *
-         * @param[in]  stat statistic name. See listStats().
+         * The segments are concatenated by the kernel in the given order,
+         * using writev() for tun/tap devices and sendmsg() for hooked
+         * interfaces. This allows, for example, to prepend a separately
+         * built header to an existing payload without copying any of them.
          *
-         * @return current value of the given statistic.
-         *         An exception is thrown if stat is unknown or in case of IO
-         *         errors.
+         * @param[in]  segments Array of segments that form the packet (if
+         *             tun) or frame (if tap) to send.
+         * @param[in]  count Number of segments in the array.
+         * @param[in]  queue Optional queue to use, see getQueues().
+         *
+         * @return always void.
+         *         Exceptions are thrown in case of misbehaviours. For example,
+         *         total size of the packet will be checked against MTU and
+         *         minimal Ethernet 2 size. Another case can be write errors.
          */
-        uint64_t readStat(std::string const& stat);
+        void send(packet_segment const* segments, size_t count,
+                  uint queue = 0) const;
 
         /**
-         * Clear given statistic for this interface.
+         * Send the packet held by a packet buffer to this virtual interface.
          *
-         * Please note that this feature is implemented in library as there is
-         * currently no way to clear them (except by destroying the interface).
-         * If you clear the statistics using this method, subsequent calls to
-         * readStat() results will differ from, for example, those reported
-         * by tools like ifconfig.
+         * @param[in]  buffer Packet buffer holding the packet (if tun) or
+         *             frame (if tap) to send.
+         * @param[in]  queue Optional queue to use, see getQueues().
          *
-         * @param[in]  stat statistic name. See listStats().
+         * @return always void.
+         *         Exceptions are thrown in case of misbehaviours. See send().
+         */
+        void send(PacketBuffer const& buffer, uint queue = 0) const;
+
+        /**
+         * Receive a packet without throwing exceptions.
+         *
+         * Same as receive(), but failures are reported by a status code and
+         * errno instead of an exception, so they cost no more than a
+         * successful call. The throwing methods are built on this one, and
+         * only format their error messages on failure.
+         *
+         * @param[in,out] packet Buffer to store the packet (if tun) or frame
+         *             (if tap) into. Its length is updated with the size of
+         *             the packet received, or set to 0.
+         * @param[in]  queue Optional queue to use, see getQueues().
+         *
+         * @return IO_OK if a packet was received, IO_AGAIN if none was
+         *         available, or the reason of the failure.
+         */
+        io_status tryReceive(packet_buffer& packet, uint queue = 0) noexcept;
+
+        /**
+         * Receive up to count packets without throwing exceptions. See
+         * receiveBatch() and tryReceive().
+         *
+         * @param[in,out] buffers Array of buffers to store the packets into.
+         * @param[in]  count Number of buffers in the array.
+         * @param[out] received Number of packets received, stored in the
+         *             first buffers of the array.
+         * @param[in]  queue Optional queue to use, see getQueues().
+         *
+         * @return IO_OK if any packet was received, IO_AGAIN if none was
+         *         available, or the reason of the failure.
+         */
+        io_status tryReceiveBatch(packet_buffer* buffers, size_t count,
+                                  size_t& received, uint queue = 0) noexcept;
+
+        /**
+         * Send a packet without throwing exceptions. See send() and
+         * tryReceive().
+         *
+         * @param[in]  packet Packet (if tun) or frame (if tap) to send. Its
+         *             length is the size of the packet.
+         * @param[in]  queue Optional queue to use, see getQueues().
+         *
+         * @return IO_OK if the packet was sent, IO_AGAIN if the kernel queue
+         *         is full, or the reason of the failure.
+         */
+        io_status trySend(packet_buffer const& packet,
+                          uint queue = 0) const noexcept;
+
+        /**
+         * Send up to count packets without throwing exceptions. See
+         * sendBatch() and tryReceive().
+         *
+         * @param[in]  buffers Array of packets (if tun) or frames (if tap) to
+         *             send.
+         * @param[in]  count Number of buffers in the array.
+         * @param[out] sent Number of packets accepted, always the first ones
+         *             of the array.
+         * @param[in]  queue Optional queue to use, see getQueues().
+         *
+         * @return IO_OK if any packet was sent, IO_AGAIN if the kernel queue
+         *         is full, or the reason of the failure. Sizes are checked
+         *         before sending any packet.
+         */
+        io_status trySendBatch(packet_buffer const* buffers, size_t count,
+                               size_t& sent, uint queue = 0) const noexcept;
+
+        /**
+         * Receive a packet and its segmentation and checksum metadata from
+         * the virtual interface into a caller-owned buffer.
+         *
+         * In FLAG_VNET_HDR mode the packet may be a super-frame of up to
+         * 64 KB, so the buffer should be that large. Otherwise the header is
+         * zeroed. The other receive methods discard the header.
+         *
+         * @param[out] buffer Memory to store the packet (if tun) or frame
+         *             (if tap) into.
+         * @param[in]  size Capacity in bytes of the given buffer.
+         * @param[out] header Metadata of the packet received.
+         * @param[in]  queue Optional queue to use, see getQueues().
+         *
+         * @return the number of bytes written into the buffer. 0 means no
+         *         packet was available.
+         *         Exceptions are thrown in case of read errors.
+         */
+        size_t receive(uint8_t* buffer, size_t size, vnet_header& header,
+                       uint queue = 0);
+
+        /**
+         * Receive a packet and its segmentation and checksum metadata from
+         * the virtual interface into a packet buffer.
+         *
+         * @param[in,out] buffer Packet buffer to store the packet (if tun) or
+         *             frame (if tap) into. See receive(PacketBuffer&).
+         * @param[out] header Metadata of the packet received.
+         * @param[in]  queue Optional queue to use, see getQueues().
+         *
+         * @return the size of the packet received. 0 means no packet was
+         *         available.
+         *         Exceptions are thrown in case of read errors.
+         */
+        size_t receive(PacketBuffer& buffer, vnet_header& header,
+                       uint queue = 0);
+
+        /**
+         * Send a packet built from several memory segments, along with its
+         * segmentation and checksum metadata, to this virtual interface.
+         *
+         * In FLAG_VNET_HDR mode a packet with a segmentation type other than
+         * VNET_HDR_GSO_NONE may be a super-frame of up to 64 KB, the kernel
+         * segments it and completes the checksums as described. Otherwise
+         * the header is ignored. The other send methods use an empty header.
+         *
+         * @param[in]  segments Array of segments that form the packet (if
+         *             tun) or frame (if tap) to send.
+         * @param[in]  count Number of segments in the array.
+         * @param[in]  header Metadata of the packet.
+         * @param[in]  queue Optional queue to use, see getQueues().
          *
          * @return always void.
-         *         An exception is thrown if stat is unknown or in case of IO
-         *         errors.
+         *         Exceptions are thrown in case of misbehaviours. See send().
          */
-        void clearStat(std::string const& stat);
+        void send(packet_segment const* segments, size_t count,
+                  vnet_header const& header, uint queue = 0) const;
+
+        /**
+         * Send the packet held by a packet buffer, along with its
+         * segmentation and checksum metadata, to this virtual interface.
+         *
+         * @param[in]  buffer Packet buffer holding the packet (if tun) or
+         *             frame (if tap) to send.
+         * @param[in]  header Metadata of the packet.
+         * @param[in]  queue Optional queue to use, see getQueues().
+         *
+         * @return always void.
+         *         Exceptions are thrown in case of misbehaviours. See send().
+         */
+        void send(PacketBuffer const& buffer, vnet_header const& header,
+                  uint queue = 0) const;
+
+        /**
+         * Enable a memory-mapped reception ring on a hooked interface.
+         *
+         * The kernel stores the received frames into a ring of blocks
+         * (TPACKET_V3) shared with this process, and hands over a block once
+         * it is full or its timeout expires. Frames are then read in place
+         * with receiveRing(), without a system call or a copy per frame.
+         * From now on frames are only delivered through the ring, so the
+         * other receive methods can't be used with this queue, nor can it be
+         * added to a Dispatcher.
+         *
+         * @param[in]  blocks Number of blocks of the ring.
+         * @param[in]  block_size Size in bytes of each block, a multiple of
+         *             the page size.
+         * @param[in]  millis Time in milliseconds after which a block that
+         *             isn't full is handed over anyway. 0 lets the kernel
+         *             choose.
+         * @param[in]  queue Optional queue to use, see getQueues().
+         *
+         * @return always void.
+         *         An exception is thrown if the interface isn't hooked, uses
+         *         FLAG_VNET_HDR, already has a ring, the geometry is invalid
+         *         or the kernel refuses the request.
+         */
+        void enableRing(uint blocks = 64, size_t block_size = 128 * 1024,
+                        uint millis = 1, uint queue = 0);
+
+        /**
+         * Get the next frames of the reception ring.
+         *
+         * Frames are taken from the block being read, up to count per call,
+         * and their views stay valid until the block is released with
+         * releaseBlock(). Once all of them were returned no more frames are
+         * available until the block is released, which lets the kernel reuse
+         * it and moves on to the next one.
+         *
+         * @param[out] views Array of views to point to the frames.
+         * @param[in]  count Number of views in the array.
+         * @param[in]  millis Optional time in milliseconds to wait for a
+         *             block if none is ready. < 0 means wait forever.
+         * @param[in]  queue Optional queue to use, see getQueues().
+         *
+         * @return the number of frames returned, stored in the first views
+         *         of the array. 0 means no frame was available.
+         *         An exception is thrown if the queue has no reception ring
+         *         or in case of poll errors.
+         */
+        size_t receiveRing(packet_view* views, size_t count, int millis = 0,
+                           uint queue = 0);
+
+        /**
+         * Give the block being read back to the kernel.
+         *
+         * Views returned by receiveRing() become invalid, and frames of the
+         * block not returned yet are dropped. Nothing is done if no block is
+         * being read.
+         *
+         * @param[in]  queue Optional queue to use, see getQueues().
+         *
+         * @return always void.
+         *         An exception is thrown if the queue has no reception ring.
+         */
+        void releaseBlock(uint queue = 0);
+
+        /**
+         * Enable a memory-mapped transmission ring on a hooked interface.
+         *
+         * Frames are written in place into the slots of a ring shared with
+         * the kernel (TPACKET_V2), see acquireSlots(), and a batch of them
+         * is sent with a single system call, see sendSlots(). From now on
+         * the other send methods of this queue copy the packets into the
+         * ring too, and fail or stop early if it is full, instead of having
+         * them dropped.
+         *
+         * @param[in]  frames Minimum number of slots of the ring.
+         * @param[in]  frame_size Size in bytes of each slot, a multiple of
+         *             16 including a header of 32 bytes.
+         * @param[in]  queue Optional queue to use, see getQueues().
+         *
+         * @return always void.
+         *         An exception is thrown if the interface isn't hooked, uses
+         *         FLAG_VNET_HDR, already has a ring, the geometry is invalid
+         *         or the kernel refuses the request.
+         */
+        void enableSendRing(uint frames = 256, size_t frame_size = 2048,
+                            uint queue = 0);
+
+        /**
+         * Get free slots of the transmission ring to write frames into.
+         *
+         * The slots are the ones following the last slot sent, and are
+         * returned again until sent. Fewer slots than requested means the
+         * ring is full: the kernel still owns the other ones, until their
+         * frames are sent.
+         *
+         * A frame the kernel refuses (for example, if the MTU was lowered
+         * after it was checked) stops the ring at its slot. The slot is
+         * returned again once reached, and the frame counted as dropped, see
+         * getDroppedSlots().
+         *
+         * @param[out] slots Array of buffers to point to the slots. Their
+         *             size is the capacity of the slot and their length 0.
+         * @param[in]  count Number of buffers in the array.
+         * @param[in]  queue Optional queue to use, see getQueues().
+         *
+         * @return the number of slots acquired, stored in the first buffers
+         *         of the array. 0 means the ring is full.
+         *         An exception is thrown if the queue has no transmission
+         *         ring.
+         */
+        size_t acquireSlots(packet_buffer* slots, size_t count,
+                            uint queue = 0) const;
+
+        /**
+         * Send the frames written into acquired slots.
+         *
+         * The slots are handed over to the kernel and the ring is flushed
+         * with a single system call. Frames the device doesn't take at once
+         * stay in the ring and are sent by the next flush.
+         *
+         * @param[in]  slots First slots returned by acquireSlots(), in the
+         *             same order. The length of each slot is the size of
+         *             the frame written into it.
+         * @param[in]  count Number of slots to send.
+         * @param[in]  queue Optional queue to use, see getQueues().
+         *
+         * @return always void.
+         *         An exception is thrown if the queue has no transmission
+         *         ring, a slot wasn't acquired, a frame size is invalid (see
+         *         send()) or in case of write errors.
+         */
+        void sendSlots(packet_buffer const* slots, size_t count,
+                       uint queue = 0) const;
+
+        /**
+         * Getter method for the number of frames of the transmission ring
+         * refused by the kernel.
+         *
+         * @param[in]  queue Optional queue to use, see getQueues().
+         *
+         * @return the number of frames dropped since the ring was enabled.
+         *         An exception is thrown if the queue has no transmission
+         *         ring.
+         */
+        uint64_t getDroppedSlots(uint queue = 0) const;
+
+        /**
+         * List available statistics for this interface.
+         *
+         * @return set of statistics names.
+         *         For example, {"rx_packets", "tx_bytes", ...}
+         *         Exceptions can be thrown in case of generic IO errors.
+         */
+        std::set<std::string> listStats();
+
+        /**
+         * Read given statistic for this interface.
+         *
+         * @param[in]  stat statistic name. See listStats().
+         *
+         * @return current value of the given statistic.
+         *         An exception is thrown if stat is unknown or in case of IO
+         *         errors.
+         */
+        uint64_t readStat(std::string const& stat);
+
+        /**
+         * Clear given statistic for this interface.
+         *
+         * Please note that this feature is implemented in library as there is
+         * currently no way to clear them (except by destroying the interface).
+         * If you clear the statistics using this method, subsequent calls to
+         * readStat() results will differ from, for example, those reported
+         * by tools like ifconfig.
+         *
+         * @param[in]  stat statistic name. See listStats().
+         *
+         * @return always void.
+         *         An exception is thrown if stat is unknown or in case of IO
+         *         errors.
+         */
+        void clearStat(std::string const& stat);
+
+        /**
+         * Report the memory used by this interface.
+         *
+         * Reception buffers are not owned by interfaces: receive() uses a
+         * buffer shared by all the interfaces used from the calling thread,
+         * and zero-copy functions use caller-owned or pooled buffers. Thus,
+         * this footprint does not depend on the MTU and stays small even
+         * when idle interfaces are counted by the thousands.
+         *
+         * Packet rings enabled with enableRing() and enableSendRing() are
+         * mapped by this interface, so they are counted.
+         *
+         * @return the approximate number of bytes of memory held by this
+         *         interface object.
+         */
+        size_t getMemoryFootprint() const;
+};
+
+/**
+ * I/O engines available for the Dispatcher.
+ */
+enum dispatcher_engine
+{
+    /**
+     * epoll() readiness notification followed by a read() on each ready
+     * interface.
+     */
+    ENGINE_EPOLL,
+
+    /**
+     * io_uring with reads pre-posted on every interface, using fixed files
+     * and registered buffers when the kernel supports them. Completions drive
+     * the callback directly, and Dispatcher::send() writes are submitted in
+     * batches. Two reads are chained, the second one only taking a packet
+     * already queued, so the rest of the budget is read synchronously only
+     * when the interface is busy. Falls back to ENGINE_EPOLL if io_uring is
+     * not available.
+     */
+    ENGINE_IO_URING
+};
+
+/**
+ * Reception counters kept by a Dispatcher for each registered interface.
+ */
+struct dispatcher_stats
+{
+    /**
+     * Number of times the interface was found ready for reading.
+     */
+    uint64_t polls;
+
+    /**
+     * Number of packets read from the interface and passed to the callback.
+     */
+    uint64_t packets;
+
+    /**
+     * Number of times the budget was used up before the interface was found
+     * empty.
+     */
+    uint64_t exhausted;
+
+    /**
+     * Time spent reading packets from the interface and handling them in
+     * the callback, in nanoseconds.
+     */
+    uint64_t busy;
+};
+
+/**
+ * Transmission counters kept by a Dispatcher for each send queue.
+ */
+struct send_queue_stats
+{
+    /**
+     * Number of packets waiting in the queue.
+     */
+    size_t pending;
+
+    /**
+     * Number of packets accepted in the queue.
+     */
+    uint64_t queued;
+
+    /**
+     * Number of packets written to the interface.
+     */
+    uint64_t sent;
+
+    /**
+     * Number of packets dropped, either refused because the queue was at
+     * its high-water mark, rejected by the interface (for example, too
+     * large), or still pending when the queue was removed.
+     */
+    uint64_t dropped;
+
+    /**
+     * Time the written packets spent in the queue, in nanoseconds.
+     */
+    uint64_t delay;
+
+    /**
+     * Longest time a written packet spent in the queue, in nanoseconds.
+     */
+    uint64_t max_delay;
+};
+
+/**
+ * Occupancy counters of the buffer pool of a Dispatcher.
+ */
+struct pool_stats
+{
+    /**
+     * Number of buffers in the pool.
+     */
+    size_t count;
+
+    /**
+     * Size in bytes of each buffer, including the headroom.
+     */
+    size_t size;
+
+    /**
+     * Number of buffers in use, either as reception slots or kept by
+     * handlers.
+     */
+    size_t in_use;
+
+    /**
+     * Maximum number of buffers in use at the same time.
+     */
+    size_t peak;
+
+    /**
+     * Number of times no buffer was left to read a packet into.
+     */
+    uint64_t exhausted;
+};
+
+/**
+ * Persistent dispatcher object.
+ *
+ * Handles packet reception for a group of interfaces that are registered
+ * once and kept across calls to dispatch(). It is implemented using the
+ * epoll() system call, so it is not limited by FD_SETSIZE and the cost of
+ * each wakeup depends on the number of interfaces with pending packets, not
+ * on the number of interfaces registered. A single dispatcher can serve tens
+ * of thousands of interfaces.
+ *
+ * Once ready, an interface is drained until it has no more packets or until
+ * its budget is used up, whichever comes first. In the latter case it is
+ * left pending and served again after the other ready interfaces, so a busy
+ * interface cannot starve the rest.
+ *
+ * Packets are received into buffers taken from a PacketPool owned by the
+ * dispatcher, so dispatching performs no allocation in steady state and
+ * memory doesn't grow with the number of interfaces. The pool holds at
+ * least 256 buffers, or two batches if larger, sized after the largest
+ * frame read so far. A buffer is reused for the next packets once the
+ * handler returns, unless the handler kept a copy of its handle, see
+ * packet_info. If handlers keep every buffer, dispatching fails with
+ * ENOBUFS until some are released. See getPoolStats().
+ */
+class Dispatcher
+{
+    private:
+
+        std::unique_ptr<DispatcherImpl> pimpl;
+        Dispatcher(const Dispatcher& other) = delete;
+        Dispatcher& operator=(Dispatcher rhs) = delete;
+
+        // Calls the handler with the packet just read, without going
+        // through a std::function. The read loop is compiled in the library
+        // and reaches this through a dispatcher_fn pointer, once per packet.
+        // Per-packet handlers get batches of one: nothing is read ahead of
+        // what they handle, so stopping leaves the rest of the packets in
+        // the kernel.
+        template<typename Handler>
+        static bool invoke(void* context, packet_info const* packets,
+                           size_t)
+        {
+            return (*static_cast<Handler*>(context))(packets[0]);
+        }
+
+    public:
+
+        /**
+         * Create an empty Dispatcher object.
+         *
+         * @param[in]  engine I/O engine to use. If the io_uring engine is
+         *             requested but not available (not built in or not
+         *             supported by the running kernel) the epoll engine is
+         *             used instead. See getEngine().
+         *
+         * An exception is thrown if the engine cannot be created.
+         */
+        explicit Dispatcher(dispatcher_engine engine = ENGINE_EPOLL);
+        ~Dispatcher();
+
+        /**
+         * Getter method for the I/O engine in use.
+         *
+         * @return the engine used by this dispatcher.
+         */
+        dispatcher_engine getEngine() const;
+
+        /**
+         * Register a virtual interface queue to monitor.
+         *
+         * Each queue of an interface is registered on its own, so the
+         * queues of a multi-queue interface can be spread across several
+         * dispatchers, for example, one per thread. Interfaces must be
+         * removed from the dispatcher before being destroyed. With the
+         * io_uring engine, reads sized after the current MTU are posted
+         * right away.
+         *
+         * @param[in]  iface Virtual interface to monitor.
+         * @param[in]  queue Optional queue of the interface to monitor.
+         *
+         * @return always void.
+         *         An exception is thrown if the queue is already registered,
+         *         doesn't exist or cannot be monitored.
+         */
+        void add(VIface* iface, uint queue = 0);
+
+        /**
+         * Unregister a virtual interface queue.
+         *
+         * @param[in]  iface Virtual interface to stop monitoring.
+         * @param[in]  queue Optional queue of the interface to stop
+         *             monitoring.
+         *
+         * @return always void.
+         *         An exception is thrown if the queue isn't registered.
+         */
+        void remove(VIface* iface, uint queue = 0);
+
+        /**
+         * Getter method for the number of registered interface queues.
+         *
+         * @return the number of interface queues monitored by this
+         *         dispatcher.
+         */
+        size_t getSize() const;
+
+        /**
+         * Set the budget of a registered interface queue.
+         *
+         * @param[in]  iface Registered virtual interface.
+         * @param[in]  budget Maximum number of packets read from the
+         *             queue each time it is found ready. Must be > 0.
+         *             The default is 64.
+         * @param[in]  queue Optional registered queue of the interface.
+         *
+         * @return always void.
+         *         An exception is thrown if the queue isn't registered or
+         *         the budget is 0.
+         */
+        void setBudget(VIface* iface, uint budget, uint queue = 0);
+
+        /**
+         * Getter method for the budget of a registered interface queue.
+         *
+         * @param[in]  iface Registered virtual interface.
+         * @param[in]  queue Optional registered queue of the interface.
+         *
+         * @return the maximum number of packets read from the queue each
+         *         time it is found ready.
+         *         An exception is thrown if the queue isn't registered.
+         */
+        uint getBudget(VIface* iface, uint queue = 0) const;
+
+        /**
+         * Getter method for the reception counters of a registered interface
+         * queue.
+         *
+         * @param[in]  iface Registered virtual interface.
+         * @param[in]  queue Optional registered queue of the interface.
+         *
+         * @return a copy of the counters kept for the queue since it was
+         *         registered.
+         *         An exception is thrown if the queue isn't registered.
+         */
+        dispatcher_stats getStats(VIface* iface, uint queue = 0) const;
+
+        /**
+         * Getter method for the occupancy counters of the reception pool.
+         *
+         * The pool is created on the first dispatch, and replaced by a
+         * larger one when a frame doesn't fit in its buffers, in which case
+         * the counters start over.
+         *
+         * @return a copy of the counters of the pool, all zero if no
+         *         packet was dispatched yet.
+         */
+        pool_stats getPoolStats() const;
+
+        /**
+         * Read every packet queued in a registered interface queue right
+         * away, without waiting and regardless of its budget.
+         *
+         * Meant for queues about to be detached, see VIface::detachQueue().
+         *
+         * @param[in]  iface Registered virtual interface.
+         * @param[in]  callback a packet_cb callback to be called for each
+         *             packet. Its return value is ignored.
+         * @param[in]  queue Optional registered queue of the interface.
+         *
+         * @return the number of packets read.
+         *         An exception is thrown if the queue isn't registered or in
+         *         case of IO error.
+         */
+        size_t drainQueue(VIface* iface, packet_cb callback, uint queue = 0);
+
+        /**
+         * Handle packet reception for the registered interfaces.
+         *
+         * @param[in]  callback a dispatcher_cb callback to be called to
+         *             handle packet reception.
+         * @param[in]  millis optional timeout value in milliseconds. < 0
+         *             means wait forever.
+         *
+         * @return always void.
+         *         This call blocks under the same conditions as the
+         *         dispatch() function.
+         *         An exception is thrown if no interface is registered.
+         */
+        void dispatch(dispatcher_cb callback, int millis = -1);
+
+        /**
+         * Handle packet reception with a handler known at compile time.
+         *
+         * Same as dispatchPackets(), but the handler is taken by type
+         * instead of through a packet_cb, which saves the std::function
+         * call. The handler is still not inlined into the read loop: the
+         * loop lives in the library and calls the handler through a
+         * function pointer for each packet, see dispatchRaw(). Packets are
+         * read one at a time, so stopping never leaves read packets behind.
+         * Any callable taking a packet_info const& and returning bool can
+         * be used; dispatch() with a dispatcher_cb is itself built on top of
+         * this.
+         *
+         * @param[in]  handler callable to be called for each packet.
+         * @param[in]  millis optional timeout value in milliseconds. < 0
+         *             means wait forever.
+         *
+         * @return always void.
+         *         An exception is thrown if no interface is registered.
+         */
+        template<typename Handler, typename = decltype(
+                     std::declval<Handler&>()(
+                         std::declval<packet_info const&>()))>
+        void dispatch(Handler handler, int millis = -1)
+        {
+            this->dispatchRaw(&Dispatcher::invoke<Handler>, &handler,
+                              millis, 1);
+        }
+
+        /**
+         * Handle packet reception with a handler known at compile time,
+         * without throwing exceptions.
+         *
+         * Same as the dispatch() template, but failures are reported as in
+         * tryDispatch(). The handler must not throw.
+         *
+         * @param[in]  handler callable to be called for each packet.
+         * @param[in]  millis optional timeout value in milliseconds. < 0
+         *             means wait forever.
+         *
+         * @return same as tryDispatch().
+         */
+        template<typename Handler, typename = decltype(
+                     std::declval<Handler&>()(
+                         std::declval<packet_info const&>()))>
+        io_status tryDispatch(Handler handler, int millis = -1) noexcept
+        {
+            return this->tryDispatchRaw(&Dispatcher::invoke<Handler>,
+                                        &handler, millis, 1);
+        }
+
+        /**
+         * Handle packet reception with a low-level handler.
+         *
+         * Packets are gathered as in dispatchBatch() and passed to the
+         * handler along with the given context. This is what the dispatch()
+         * templates and every other dispatch method are built on, the
+         * per-packet ones with batches of one.
+         *
+         * @param[in]  handler a dispatcher_fn to be called for each batch.
+         * @param[in]  context opaque pointer passed to the handler.
+         * @param[in]  millis optional timeout value in milliseconds. < 0
+         *             means wait forever.
+         * @param[in]  size maximum number of packets in a batch.
+         *
+         * @return always void.
+         *         An exception is thrown if no interface is registered or
+         *         the batch size is 0.
+         */
+        void dispatchRaw(dispatcher_fn handler, void* context,
+                         int millis = -1, size_t size = 64);
+
+        /**
+         * Handle packet reception with a low-level handler without throwing
+         * exceptions.
+         *
+         * Same as dispatchRaw(), but failures are reported as in
+         * tryDispatch(). The handler must not throw.
+         *
+         * @param[in]  handler a dispatcher_fn to be called for each batch.
+         * @param[in]  context opaque pointer passed to the handler.
+         * @param[in]  millis optional timeout value in milliseconds. < 0
+         *             means wait forever.
+         * @param[in]  size maximum number of packets in a batch.
+         *
+         * @return same as tryDispatch(). IO_INVALID if the batch size is 0.
+         */
+        io_status tryDispatchRaw(dispatcher_fn handler, void* context,
+                                 int millis = -1,
+                                 size_t size = 64) noexcept;
+
+        /**
+         * Handle packet reception without throwing exceptions.
+         *
+         * Same as dispatch(), but failures are reported by a status code and
+         * errno instead of an exception. The callback must not throw.
+         *
+         * @param[in]  callback a dispatcher_cb callback to be called to
+         *             handle packet reception.
+         * @param[in]  millis optional timeout value in milliseconds. < 0
+         *             means wait forever.
+         *
+         * @return IO_OK once the callback asked to stop, the timeout was
+         *         reached or a signal was caught. IO_INVALID if no interface
+         *         is registered, IO_ERROR if waiting or reading failed.
+         */
+        io_status tryDispatch(dispatcher_cb callback,
+                              int millis = -1) noexcept;
+
+        /**
+         * Handle packet reception, passing the packets with their metadata.
+         *
+         * Same as dispatch(), but the callback gets a packet_info record
+         * instead of the interface name and a packet vector.
+         *
+         * @param[in]  callback a packet_cb callback to be called to handle
+         *             packet reception.
+         * @param[in]  millis optional timeout value in milliseconds. < 0
+         *             means wait forever.
+         *
+         * @return always void.
+         *         An exception is thrown if no interface is registered.
+         */
+        void dispatchPackets(packet_cb callback, int millis = -1);
+
+        /**
+         * Handle packet reception with metadata without throwing exceptions.
+         *
+         * Same as dispatchPackets(), but failures are reported as in
+         * tryDispatch(). The callback must not throw.
+         *
+         * @param[in]  callback a packet_cb callback to be called to handle
+         *             packet reception.
+         * @param[in]  millis optional timeout value in milliseconds. < 0
+         *             means wait forever.
+         *
+         * @return same as tryDispatch().
+         */
+        io_status tryDispatchPackets(packet_cb callback,
+                                     int millis = -1) noexcept;
+
+        /**
+         * Handle packet reception in batches.
+         *
+         * Same as dispatchPackets(), but packets are gathered from the
+         * ready interfaces and passed to the callback up to size at a time.
+         * A batch is handed over once it is full, and at the end of every
+         * wakeup with whatever was gathered. Interfaces are still drained up
+         * to their budget, possibly over several batches.
+         *
+         * @param[in]  callback a batch_cb callback to be called to handle
+         *             packet reception.
+         * @param[in]  millis optional timeout value in milliseconds. < 0
+         *             means wait forever.
+         * @param[in]  size maximum number of packets in a batch.
+         *
+         * @return always void.
+         *         An exception is thrown if no interface is registered or
+         *         the batch size is 0.
+         */
+        void dispatchBatch(batch_cb callback, int millis = -1,
+                           size_t size = 64);
+
+        /**
+         * Handle packet reception in batches without throwing exceptions.
+         *
+         * Same as dispatchBatch(), but failures are reported as in
+         * tryDispatch(). The callback must not throw.
+         *
+         * @param[in]  callback a batch_cb callback to be called to handle
+         *             packet reception.
+         * @param[in]  millis optional timeout value in milliseconds. < 0
+         *             means wait forever.
+         * @param[in]  size maximum number of packets in a batch.
+         *
+         * @return same as tryDispatch(). IO_INVALID if the batch size is 0.
+         */
+        io_status tryDispatchBatch(batch_cb callback, int millis = -1,
+                                   size_t size = 64) noexcept;
+
+        /**
+         * Send a packet to a virtual interface through this dispatcher.
+         *
+         * With the io_uring engine the write is queued and submitted
+         * together with other pending requests, either by dispatch() or by
+         * flush(). The buffer is kept alive until the write completes. With
+         * the epoll engine the packet is sent right away.
+         *
+         * @param[in]  iface Virtual interface to send the packet to. It
+         *             doesn't need to be registered in this dispatcher.
+         * @param[in]  buffer Packet buffer holding the packet (if tun) or
+         *             frame (if tap) to send.
+         * @param[in]  queue Optional queue of the interface to use.
+         *
+         * @return always void.
+         *         Exceptions are thrown in case of misbehaviours. See
+         *         VIface::send(). Errors of queued writes are counted, see
+         *         getSendErrors().
+         */
+        void send(VIface* iface, PacketBuffer const& buffer, uint queue = 0);
+
+        /**
+         * Submit all queued writes, and write the packets waiting in send
+         * queues until their interfaces are full.
+         *
+         * @return always void.
+         */
+        void flush();
+
+        /**
+         * Getter method for the number of failed queued writes.
+         *
+         * @return the number of writes queued with send() that failed or
+         *         were short.
+         */
+        uint64_t getSendErrors() const;
+
+        /**
+         * Create a send queue for a virtual interface queue.
+         *
+         * Interface queues are non-blocking, so a packet sent while the
+         * kernel queue is full is refused. Packets given to enqueue()
+         * instead wait in the send queue, and are written in batches by
+         * dispatch() and flush(). If the interface is full, dispatch() waits
+         * for it to become writable and writes the rest then. The queue
+         * doesn't need to be registered for reception in this dispatcher.
+         *
+         * Packets that fail to be written are kept, and the error is
+         * reported by dispatch() and flush(), so a persistent failure (for
+         * example, the interface going down) fills the queue up to its
+         * high-water mark instead of emptying it.
+         *
+         * @param[in]  iface Virtual interface to send packets to.
+         * @param[in]  high_water Maximum number of packets waiting in the
+         *             queue. Must be > 0.
+         * @param[in]  queue Optional queue of the interface to send packets
+         *             to.
+         *
+         * @return always void.
+         *         An exception is thrown if the queue already has a send
+         *         queue, doesn't exist or cannot be monitored.
+         */
+        void addSendQueue(VIface* iface, size_t high_water = 1024,
+                          uint queue = 0);
+
+        /**
+         * Remove a send queue.
+         *
+         * Pending packets are written first, waiting for the interface to
+         * become writable if needed. Those still pending after the given
+         * time are dropped. Send queues left are removed the same way when
+         * the dispatcher is destroyed, which must then happen before the
+         * interface is destroyed.
+         *
+         * @param[in]  iface Virtual interface of the send queue.
+         * @param[in]  queue Optional queue of the interface.
+         * @param[in]  millis Optional time to wait for pending packets to be
+         *             written, in milliseconds.
+         *
+         * @return always void.
+         *         An exception is thrown if the queue has no send queue.
+         */
+        void removeSendQueue(VIface* iface, uint queue = 0, int millis = 100);
+
+        /**
+         * Add a packet to a send queue.
+         *
+         * @param[in]  iface Virtual interface of the send queue.
+         * @param[in]  buffer Packet buffer holding the packet (if tun) or
+         *             frame (if tap) to send. It is kept until written or
+         *             dropped.
+         * @param[in]  queue Optional queue of the interface.
+         *
+         * @return true if the packet was queued, false if it was dropped
+         *         because the queue is at its high-water mark.
+         *         An exception is thrown if the queue has no send queue or
+         *         the packet size is invalid.
+         */
+        bool enqueue(VIface* iface, PacketBuffer&& buffer, uint queue = 0);
+
+        /**
+         * Getter method for the transmission counters of a send queue.
+         *
+         * @param[in]  iface Virtual interface of the send queue.
+         * @param[in]  queue Optional queue of the interface.
+         *
+         * @return a copy of the counters kept for the send queue since it was
+         *         created.
+         *         An exception is thrown if the queue has no send queue.
+         */
+        send_queue_stats getSendQueueStats(VIface* iface,
+                                           uint queue = 0) const;
+};
+
+/**
+ * Queue controller object.
+ *
+ * Follows the load of a multi-queue interface served by a Dispatcher, and
+ * attaches or detaches its queues accordingly, so idle queues are released
+ * during quiet periods without recreating the interface.
+ *
+ * On each update() the load of every attached queue is measured from the
+ * dispatcher counters, as the fraction of the elapsed time spent draining
+ * it. If any queue used up its budget (backlog) or the average load is above
+ * the high threshold, a detached queue is attached. Otherwise, if the
+ * average load is below the low threshold, the last attached queue is
+ * detached. At most one queue is changed on each update.
+ *
+ * Detaching a queue makes the kernel drop the packets queued in it, so the
+ * queue is drained through the dispatcher right before, into the callback
+ * given to setCallback(). Packets drained without a callback are counted as
+ * dropped. Packets arriving between the drain and the detach are still
+ * dropped by the kernel, which doesn't report them.
+ *
+ * Like the Dispatcher, a controller is not thread safe. update() must be
+ * called from the thread running the dispatcher, between dispatch() calls.
+ */
+class QueueController
+{
+    private:
+
+        std::unique_ptr<QueueControllerImpl> pimpl;
+        QueueController(const QueueController& other) = delete;
+        QueueController& operator=(QueueController rhs) = delete;
+
+    public:
+
+        /**
+         * Create a QueueController object.
+         *
+         * Every attached queue of the interface is registered in the
+         * dispatcher, and unregistered when the controller is destroyed. The
+         * dispatcher must outlive the controller.
+         *
+         * @param[in]  dispatcher Dispatcher serving the interface.
+         * @param[in]  iface Multi-queue virtual interface to control. It
+         *             must not be registered in the dispatcher.
+         * @param[in]  min_queues Optional minimum number of queues to keep
+         *             attached.
+         *
+         * An exception is thrown if min_queues is 0 or greater than the
+         * number of queues of the interface, or if a queue can't be
+         * registered.
+         */
+        QueueController(Dispatcher& dispatcher, VIface* iface,
+                        uint min_queues = 1);
+        ~QueueController();
+
+        /**
+         * Set the load thresholds.
+         *
+         * @param[in]  low Average load below which a queue is detached. The
+         *             default is 0.1.
+         * @param[in]  high Average load above which a queue is attached. The
+         *             default is 0.5.
+         *
+         * @return always void.
+         *         An exception is thrown unless 0 <= low < high <= 1.
+         */
+        void setThresholds(double low, double high);
+
+        /**
+         * Set the callback for the packets of queues about to be detached.
+         *
+         * @param[in]  callback a packet_cb callback to be called for each
+         *             packet drained. Its return value is ignored. An empty
+         *             callback drops the packets.
+         *
+         * @return always void.
+         */
+        void setCallback(packet_cb callback);
+
+        /**
+         * Getter method for the number of packets dropped on detach.
+         *
+         * @return the number of packets drained from queues about to be
+         *         detached while no callback was set.
+         */
+        uint64_t getDropped() const;
+
+        /**
+         * Measure the load since the previous update and attach or detach a
+         * queue if needed.
+         *
+         * @return the number of queues attached after the update.
+         *         Exceptions are thrown if a queue can't be attached,
+         *         detached, registered or unregistered.
+         */
+        uint update();
+
+        /**
+         * Getter method for the number of attached queues.
+         *
+         * @return the number of queues of the interface currently attached.
+         */
+        uint getAttached() const;
 };
 
 /** @} */ // End of libviface
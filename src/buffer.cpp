@@ -0,0 +1,259 @@
+/**
+ * Copyright (C) 2015 Hewlett Packard Enterprise Development LP
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include "viface/private/viface.hpp"
+
+namespace viface
+{
+/*= Helpers ==================================================================*/
+
+static void check_room(size_t size, size_t headroom, size_t tailroom)
+{
+    // Check there is room left for the packet
+    if (headroom >= size || tailroom >= size - headroom) {
+        ostringstream what;
+        what << "--- Reserved room (" << headroom << " + " << tailroom;
+        what << ") leaves no space in a buffer of " << size << " bytes.";
+        what << endl;
+        throw invalid_argument(what.str());
+    }
+}
+
+static uint8_t* alloc_aligned(size_t size)
+{
+    void* memory = NULL;
+
+    int error = posix_memalign(&memory, cache_line, size);
+    if (error != 0) {
+        ostringstream what;
+        what << "--- Unable to allocate " << size << " bytes of packet ";
+        what << "buffer memory." << endl;
+        what << "    Error: " << strerror(error);
+        what << " (" << error << ")." << endl;
+        throw runtime_error(what.str());
+    }
+
+    return (uint8_t*) memory;
+}
+
+static void init_slot(packet_slot* slot, PacketPoolImpl* pool,
+                      uint8_t* memory, size_t size, size_t headroom,
+                      size_t tailroom)
+{
+    slot->refs.store(1, memory_order_relaxed);
+    slot->pool = pool;
+    slot->memory = memory;
+    slot->size = size;
+    slot->reserved_head = headroom;
+    slot->reserved_tail = tailroom;
+    slot->offset = headroom;
+    slot->length = 0;
+}
+
+
+/*= Packet Buffer ============================================================*/
+
+PacketBuffer::PacketBuffer(size_t size, size_t headroom, size_t tailroom) :
+    slot(nullptr)
+{
+    check_room(size, headroom, tailroom);
+
+    uint8_t* memory = alloc_aligned(size);
+    this->slot = new packet_slot;
+    init_slot(this->slot, nullptr, memory, size, headroom, tailroom);
+}
+
+void PacketBuffer::release()
+{
+    // Other handles still refer to this buffer
+    if (this->slot->refs.fetch_sub(1, memory_order_acq_rel) != 1) {
+        return;
+    }
+
+    if (this->slot->pool != nullptr) {
+        this->slot->pool->release(this->slot);
+    } else {
+        free(this->slot->memory);
+        delete this->slot;
+    }
+    this->slot = nullptr;
+}
+
+
+/*= Packet Pool Implementation ===============================================*/
+
+PacketPoolImpl::PacketPoolImpl(size_t count, size_t size, size_t headroom,
+                               size_t tailroom)
+{
+    // Round buffer size up to keep every buffer cache-line aligned
+    size = (size + cache_line - 1) & ~(cache_line - 1);
+    check_room(size, headroom, tailroom);
+
+    if (count == 0) {
+        throw invalid_argument("--- Packet pool must have buffers.");
+    }
+
+    this->slab = alloc_aligned(count * size);
+    this->slots.reset(new packet_slot[count]);
+    this->available.reserve(count);
+
+    // Carve buffers out of the slab. Stack them in reverse order so they
+    // are handed out in memory order.
+    for (size_t i = count; i > 0; i--) {
+        packet_slot* slot = &this->slots[i - 1];
+        init_slot(slot, this, this->slab + (i - 1) * size, size, headroom,
+                  tailroom);
+        this->available.push_back(slot);
+    }
+
+    this->count = count;
+    this->size = size;
+    this->peak = 0;
+    this->exhausted = 0;
+    this->orphaned = false;
+}
+
+PacketPoolImpl::~PacketPoolImpl()
+{
+    free(this->slab);
+}
+
+PacketBuffer PacketPoolImpl::alloc()
+{
+    packet_slot* slot = nullptr;
+
+    {
+        lock_guard<mutex> guard(this->lock);
+
+        if (this->available.empty()) {
+            this->exhausted++;
+            return PacketBuffer(nullptr);
+        }
+
+        slot = this->available.back();
+        this->available.pop_back();
+
+        size_t inuse = this->count - this->available.size();
+        if (inuse > this->peak) {
+            this->peak = inuse;
+        }
+    }
+
+    slot->refs.store(1, memory_order_relaxed);
+    slot->offset = slot->reserved_head;
+    slot->length = 0;
+    return PacketBuffer(slot);
+}
+
+void PacketPoolImpl::release(packet_slot* slot)
+{
+    bool destroy;
+
+    {
+        lock_guard<mutex> guard(this->lock);
+        this->available.push_back(slot);
+        destroy = this->orphaned && this->available.size() == this->count;
+    }
+
+    // Last buffer of a destroyed pool
+    if (destroy) {
+        delete this;
+    }
+}
+
+void PacketPoolImpl::orphan()
+{
+    bool destroy;
+
+    {
+        lock_guard<mutex> guard(this->lock);
+        this->orphaned = true;
+        destroy = this->available.size() == this->count;
+    }
+
+    // Otherwise the last buffer released will do it
+    if (destroy) {
+        delete this;
+    }
+}
+
+size_t PacketPoolImpl::getInUse() const
+{
+    lock_guard<mutex> guard(this->lock);
+    return this->count - this->available.size();
+}
+
+size_t PacketPoolImpl::getPeak() const
+{
+    lock_guard<mutex> guard(this->lock);
+    return this->peak;
+}
+
+uint64_t PacketPoolImpl::getExhausted() const
+{
+    lock_guard<mutex> guard(this->lock);
+    return this->exhausted;
+}
+
+
+/*============================================================================
+   =   PIMPL IDIOM BUREAUCRACY
+   =
+   =   Starting this point there is not much relevant things...
+   =   Stop scrolling...
+ *============================================================================*/
+
+PacketPool::PacketPool(size_t count, size_t size, size_t headroom,
+                       size_t tailroom) :
+    pimpl(new PacketPoolImpl(count, size, headroom, tailroom))
+{}
+
+PacketPool::~PacketPool()
+{
+    this->pimpl->orphan();
+}
+
+PacketBuffer PacketPool::alloc()
+{
+    return this->pimpl->alloc();
+}
+
+size_t PacketPool::getCount() const
+{
+    return this->pimpl->getCount();
+}
+
+size_t PacketPool::getBufferSize() const
+{
+    return this->pimpl->getBufferSize();
+}
+
+size_t PacketPool::getInUse() const
+{
+    return this->pimpl->getInUse();
+}
+
+size_t PacketPool::getPeak() const
+{
+    return this->pimpl->getPeak();
+}
+
+uint64_t PacketPool::getExhausted() const
+{
+    return this->pimpl->getExhausted();
+}
+}
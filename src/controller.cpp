@@ -0,0 +1,224 @@
+/**
+ * Copyright (C) 2015 Hewlett Packard Enterprise Development LP
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include "viface/private/viface.hpp"
+
+namespace viface
+{
+/*= Queue Controller Implementation ==========================================*/
+
+QueueControllerImpl::QueueControllerImpl(Dispatcher& dispatcher,
+                                         VIface* iface, uint min_queues) :
+    dispatcher(dispatcher), iface(iface), min_queues(min_queues),
+    low(0.1), high(0.5), dropped(0), last(iface->getQueues())
+{
+    if (min_queues == 0 || min_queues > iface->getQueues()) {
+        ostringstream what;
+        what << "--- Invalid minimum number of queues (" << min_queues;
+        what << ") for " << iface->getName() << " (";
+        what << iface->getQueues() << " queues)." << endl;
+        throw invalid_argument(what.str());
+    }
+
+    // Serve every attached queue, rolling back on failure
+    uint queue = 0;
+    try {
+        for (queue = 0; queue < iface->getQueues(); queue++) {
+            if (iface->isAttached(queue)) {
+                dispatcher.add(iface, queue);
+                this->last[queue] = dispatcher.getStats(iface, queue);
+            }
+        }
+    } catch (...) {
+        while (queue-- > 0) {
+            if (iface->isAttached(queue)) {
+                dispatcher.remove(iface, queue);
+            }
+        }
+        throw;
+    }
+
+    this->last_update = chrono::steady_clock::now();
+}
+
+QueueControllerImpl::~QueueControllerImpl()
+{
+    for (uint queue = 0; queue < this->iface->getQueues(); queue++) {
+        if (!this->iface->isAttached(queue)) {
+            continue;
+        }
+
+        // Already unregistered by the user, nothing to undo
+        try {
+            this->dispatcher.remove(this->iface, queue);
+        } catch (invalid_argument const& ex) {
+        }
+    }
+}
+
+void QueueControllerImpl::setThresholds(double low, double high)
+{
+    if (low < 0 || low >= high || high > 1) {
+        ostringstream what;
+        what << "--- Invalid load thresholds (" << low << ", " << high;
+        what << ") for " << this->iface->getName() << "." << endl;
+        throw invalid_argument(what.str());
+    }
+
+    this->low = low;
+    this->high = high;
+}
+
+void QueueControllerImpl::attach(uint queue)
+{
+    // The kernel must steer flows to the queue before it is served
+    this->iface->attachQueue(queue);
+    try {
+        this->dispatcher.add(this->iface, queue);
+    } catch (...) {
+        this->iface->detachQueue(queue);
+        throw;
+    }
+    this->last[queue] = this->dispatcher.getStats(this->iface, queue);
+}
+
+void QueueControllerImpl::detach(uint queue)
+{
+    // The kernel drops what is queued on detach, so hand it over first.
+    // What arrives after the drain is dropped unnoticed.
+    this->dispatcher.drainQueue(this->iface, [this](packet_info const& info) {
+            if (this->callback) {
+                this->callback(info);
+            } else {
+                this->dropped++;
+            }
+            return true;
+        }, queue);
+
+    this->iface->detachQueue(queue);
+    try {
+        this->dispatcher.remove(this->iface, queue);
+    } catch (...) {
+        this->iface->attachQueue(queue);
+        throw;
+    }
+}
+
+uint QueueControllerImpl::update()
+{
+    auto now = chrono::steady_clock::now();
+    uint64_t elapsed = chrono::duration_cast<chrono::nanoseconds>(
+        now - this->last_update).count();
+    uint queues = this->iface->getQueues();
+    uint attached = 0;
+    bool backlog = false;
+    double load = 0;
+
+    if (elapsed == 0) {
+        return this->getAttached();
+    }
+
+    // Measure the load of the attached queues since the previous update
+    for (uint queue = 0; queue < queues; queue++) {
+        if (!this->iface->isAttached(queue)) {
+            continue;
+        }
+
+        dispatcher_stats stats = this->dispatcher.getStats(this->iface, queue);
+        load += (double) (stats.busy - this->last[queue].busy) / elapsed;
+        backlog |= stats.exhausted > this->last[queue].exhausted;
+        this->last[queue] = stats;
+        attached++;
+    }
+    if (attached > 0) {
+        load /= attached;
+    }
+    this->last_update = now;
+
+    if ((backlog || load > this->high) && attached < queues) {
+        // Bring back the first detached queue
+        for (uint queue = 0; queue < queues; queue++) {
+            if (!this->iface->isAttached(queue)) {
+                this->attach(queue);
+                return attached + 1;
+            }
+        }
+    }
+
+    if (!backlog && load < this->low && attached > this->min_queues) {
+        // Release the last attached queue
+        for (uint queue = queues; queue-- > 0;) {
+            if (this->iface->isAttached(queue)) {
+                this->detach(queue);
+                return attached - 1;
+            }
+        }
+    }
+
+    return attached;
+}
+
+uint QueueControllerImpl::getAttached() const
+{
+    uint attached = 0;
+
+    for (uint queue = 0; queue < this->iface->getQueues(); queue++) {
+        attached += this->iface->isAttached(queue);
+    }
+
+    return attached;
+}
+
+
+/*============================================================================
+   =   PIMPL IDIOM BUREAUCRACY
+   =
+   =   Starting this point there is not much relevant things...
+   =   Stop scrolling...
+ *============================================================================*/
+
+QueueController::QueueController(Dispatcher& dispatcher, VIface* iface,
+                                 uint min_queues) :
+    pimpl(new QueueControllerImpl(dispatcher, iface, min_queues))
+{}
+QueueController::~QueueController() = default;
+
+void QueueController::setThresholds(double low, double high)
+{
+    return this->pimpl->setThresholds(low, high);
+}
+
+void QueueController::setCallback(packet_cb callback)
+{
+    return this->pimpl->setCallback(callback);
+}
+
+uint64_t QueueController::getDropped() const
+{
+    return this->pimpl->getDropped();
+}
+
+uint QueueController::update()
+{
+    return this->pimpl->update();
+}
+
+uint QueueController::getAttached() const
+{
+    return this->pimpl->getAttached();
+}
+}
@@ -0,0 +1,1266 @@
+/**
+ * Copyright (C) 2015 Hewlett Packard Enterprise Development LP
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include "viface/private/viface.hpp"
+
+namespace viface
+{
+/*= Helpers ==================================================================*/
+
+static uint64_t now()
+{
+    return chrono::duration_cast<chrono::nanoseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Hands a whole batch to a batch_cb, see Dispatcher::dispatchBatch()
+static bool invoke_batch(void* context, packet_info const* packets,
+                         size_t count)
+{
+    return (*static_cast<batch_cb*>(context))(packets, count);
+}
+
+
+/*= Dispatcher Implementation ================================================*/
+
+DispatcherImpl::DispatcherImpl(dispatcher_engine engine) :
+    epoll_fd(-1), engine(ENGINE_EPOLL), failed(nullptr), batch_size(0),
+    batched(0)
+{
+#ifdef VIFACE_HAVE_IO_URING
+    if (engine == ENGINE_IO_URING) {
+        try {
+            this->uring.reset(new UringEngine());
+            this->engine = ENGINE_IO_URING;
+            return;
+        } catch (runtime_error const& ex) {
+            // Not supported by the running kernel, fall back to epoll
+        }
+    }
+#endif
+
+    this->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (this->epoll_fd < 0) {
+        ostringstream what;
+        what << "--- Unable to create epoll instance for dispatcher." << endl;
+        what << "    Error: " << strerror(errno);
+        what << " (" << errno << ")." << endl;
+        throw runtime_error(what.str());
+    }
+}
+
+DispatcherImpl::~DispatcherImpl()
+{
+    // Give pending packets a last chance before closing the send queues
+    while (!this->txqs.empty()) {
+        auto first = this->txqs.begin();
+        try {
+            this->removeSendQueue(first->first.first, first->first.second,
+                                  send_linger);
+        } catch (...) {
+            close(first->second.fd);
+            this->txqs.erase(first);
+        }
+    }
+
+    if (this->epoll_fd >= 0) {
+        close(this->epoll_fd);
+    }
+}
+
+void DispatcherImpl::add(VIface* iface, uint queue)
+{
+    ostringstream what;
+    VIfaceImpl* impl = iface->pimpl.get();
+    dispatcher_key key(iface, queue);
+
+    if (this->ifaces.find(key) != this->ifaces.end()) {
+        what << "--- Virtual interface " << iface->getName();
+        what << " queue " << queue;
+        what << " already registered in dispatcher." << endl;
+        throw invalid_argument(what.str());
+    }
+
+    // Validates the queue, frames must be read from it
+    impl->checkRead(queue);
+    int fd = impl->getRX(queue);
+
+    dispatcher_entry entry;
+    memset(&entry, 0, sizeof(dispatcher_entry));
+    entry.iface = iface;
+    entry.queue = queue;
+    entry.budget = dispatch_budget;
+    entry.info.iface = iface;
+    entry.info.id = iface->getID();
+    entry.info.queue = queue;
+    entry.info.ifindex = impl->getIndex();
+
+    // Map nodes don't move, so the entry is given back on wakeup
+    dispatcher_entry* stored = &this->ifaces[key];
+    *stored = entry;
+
+#ifdef VIFACE_HAVE_IO_URING
+    if (this->uring) {
+        // XDP sockets can't be read(), their readiness is polled instead
+        size_t size = impl->getXdp(queue) != nullptr ? 0 :
+                      impl->getHeaderSize() + impl->getFrameSize();
+        try {
+            stored->slot = this->uring->add(stored, fd, size);
+        } catch (...) {
+            this->ifaces.erase(key);
+            throw;
+        }
+        return;
+    }
+#endif
+
+    // Register RX queue
+    struct epoll_event event;
+    memset(&event, 0, sizeof(struct epoll_event));
+    event.events = EPOLLIN;
+    event.data.ptr = stored;
+
+    if (epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+        this->ifaces.erase(key);
+        what << "--- Unable to register " << iface->getName();
+        what << " in dispatcher." << endl;
+        what << "    Error: " << strerror(errno);
+        what << " (" << errno << ")." << endl;
+        throw runtime_error(what.str());
+    }
+}
+
+void DispatcherImpl::remove(VIface* iface, uint queue)
+{
+    ostringstream what;
+    dispatcher_entry& entry = this->getEntry(iface, queue);
+
+#ifdef VIFACE_HAVE_IO_URING
+    if (this->uring) {
+        this->uring->remove(entry.slot);
+        this->ifaces.erase(dispatcher_key(iface, queue));
+        return;
+    }
+#endif
+
+    if (epoll_ctl(this->epoll_fd, EPOLL_CTL_DEL,
+                  iface->pimpl->getRX(entry.queue), NULL) != 0) {
+        what << "--- Unable to unregister " << iface->getName();
+        what << " from dispatcher." << endl;
+        what << "    Error: " << strerror(errno);
+        what << " (" << errno << ")." << endl;
+        throw runtime_error(what.str());
+    }
+
+    this->ifaces.erase(dispatcher_key(iface, queue));
+}
+
+dispatcher_entry& DispatcherImpl::getEntry(VIface* iface, uint queue)
+{
+    auto found = this->ifaces.find(dispatcher_key(iface, queue));
+
+    if (found == this->ifaces.end()) {
+        ostringstream what;
+        what << "--- Virtual interface " << iface->getName();
+        what << " queue " << queue;
+        what << " not registered in dispatcher." << endl;
+        throw invalid_argument(what.str());
+    }
+
+    return found->second;
+}
+
+void DispatcherImpl::setBudget(VIface* iface, uint budget, uint queue)
+{
+    dispatcher_entry& entry = this->getEntry(iface, queue);
+
+    if (budget == 0) {
+        ostringstream what;
+        what << "--- Invalid budget for " << iface->getName();
+        what << ", must be greater than 0." << endl;
+        throw invalid_argument(what.str());
+    }
+
+    entry.budget = budget;
+
+#ifdef VIFACE_HAVE_IO_URING
+    // A single read is posted if only one packet can be read per wakeup
+    if (this->uring) {
+        this->uring->setReads(entry.slot, min(budget, uring_reads));
+    }
+#endif
+}
+
+uint DispatcherImpl::getBudget(VIface* iface, uint queue)
+{
+    return this->getEntry(iface, queue).budget;
+}
+
+dispatcher_stats DispatcherImpl::getStats(VIface* iface, uint queue)
+{
+    return this->getEntry(iface, queue).stats;
+}
+
+pool_stats DispatcherImpl::getPoolStats() const
+{
+    pool_stats stats;
+
+    // No packet was dispatched yet
+    if (!this->pool) {
+        memset(&stats, 0, sizeof(pool_stats));
+        return stats;
+    }
+
+    stats.count = this->pool->getCount();
+    stats.size = this->pool->getBufferSize();
+    stats.in_use = this->pool->getInUse();
+    stats.peak = this->pool->getPeak();
+    stats.exhausted = this->pool->getExhausted();
+    return stats;
+}
+
+size_t DispatcherImpl::drainQueue(VIface* iface, packet_cb& callback,
+                                  uint queue)
+{
+    dispatcher_entry& entry = this->getEntry(iface, queue);
+    VIfaceImpl* impl = iface->pimpl.get();
+    size_t drained = 0;
+    size_t length;
+
+    entry.info.timestamp = now();
+
+#ifdef VIFACE_HAVE_IO_URING
+    if (this->uring) {
+        // Stop the reads posted on the queue, they may hold packets already
+        uint8_t* data;
+        ssize_t result;
+        while (this->uring->hold(entry.slot, &data, &result) &&
+               data != nullptr) {
+            size_t skip = min((size_t) result, impl->getHeaderSize());
+            entry.info.data = data + skip;
+            entry.info.length = result - skip;
+            entry.stats.packets++;
+            drained++;
+            try {
+                callback(entry.info);
+            } catch (...) {
+                this->resume(entry, false);
+                throw;
+            }
+        }
+    }
+#endif
+
+    // Read until the queue is found empty
+    try {
+        while (true) {
+            this->packet.resize(impl->getFrameSize());
+            io_status status = impl->tryReceive(&this->packet[0],
+                                                this->packet.size(), nullptr,
+                                                &length, queue);
+            if (status == IO_AGAIN) {
+                break;
+            }
+            if (status != IO_OK) {
+                this->failed = &entry;
+                this->checkStatus(IO_ERROR);
+            }
+
+            entry.info.data = this->packet.data();
+            entry.info.length = length;
+            entry.stats.packets++;
+            drained++;
+            callback(entry.info);
+        }
+    } catch (...) {
+        this->resume(entry, false);
+        throw;
+    }
+
+    this->resume(entry, true);
+    return drained;
+}
+
+io_status DispatcherImpl::drain(dispatcher_entry* entry, uint work,
+                                dispatcher_handler& handler, bool* proceed)
+{
+    VIfaceImpl* impl = entry->iface->pimpl.get();
+    size_t frame = impl->getFrameSize();
+
+    // Read straight into the free slots of the batch, which is handed over
+    // as soon as it is full, so there is always room for the next read.
+    // Queues are non-blocking, so an empty queue just returns IO_AGAIN.
+    *proceed = true;
+    entry->pending = true;
+    while (work < entry->budget) {
+        size_t first = this->batched;
+        size_t count = min(this->batch_size - first,
+                           (size_t) (entry->budget - work));
+        size_t received;
+
+        if (!this->reserve(count, frame)) {
+            this->failed = entry;
+            return IO_ERROR;
+        }
+        for (size_t i = first; i < first + count; i++) {
+            this->buffers[i].data = this->slots[i].getData();
+            this->buffers[i].size = this->slots[i].getCapacity();
+        }
+
+        io_status status = impl->tryReceiveBatch(&this->buffers[first],
+                                                 count, &received,
+                                                 entry->queue);
+        if (status == IO_AGAIN) {
+            // Even if this is very unlikely, supposedly it can happen on the
+            // first read. See receive() comments about this.
+            entry->pending = false;
+            return IO_OK;
+        }
+        if (status != IO_OK) {
+            this->failed = entry;
+            return IO_ERROR;
+        }
+
+        for (size_t i = first; i < first + received; i++) {
+            this->slots[i].setLength(this->buffers[i].length);
+            this->batch[i] = entry->info;
+            this->batch[i].data = this->buffers[i].data;
+            this->batch[i].length = this->buffers[i].length;
+            this->batch[i].buffer = &this->slots[i];
+        }
+        this->batched += received;
+        work += received;
+        entry->stats.packets += received;
+
+        if (this->batched == this->batch_size && !this->deliver(handler)) {
+            *proceed = false;
+            return IO_OK;
+        }
+
+        // Queue is empty
+        if (received < count) {
+            entry->pending = false;
+            return IO_OK;
+        }
+    }
+
+    // Budget used up, remaining packets are left for the next wakeup
+    entry->stats.exhausted++;
+    return IO_OK;
+}
+
+void DispatcherImpl::resume(dispatcher_entry& entry, bool empty)
+{
+#ifdef VIFACE_HAVE_IO_URING
+    // Post the reads stopped by drainQueue() again, behind a poll if the
+    // queue was found empty
+    if (this->uring) {
+        this->uring->rearm(entry.slot, empty);
+    }
+#endif
+}
+
+bool DispatcherImpl::reserve(size_t count, size_t size) noexcept
+{
+    for (size_t i = this->batched; i < this->batched + count; i++) {
+        if (!this->refill(this->slots[i], size)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool DispatcherImpl::refill(PacketBuffer& slot, size_t size) noexcept
+{
+    // The buffer is reused unless a handler kept it or it is too small
+    if (slot && slot.getRefs() == 1 && slot.getCapacity() >= size) {
+        slot.reset();
+        return true;
+    }
+
+    // Pools only grow, so this allocates on the first batches only, or when
+    // the MTU is raised. Buffers of the previous pool stay valid until
+    // released. Running out of memory is reported as an error of the queue
+    // being read.
+    size_t count = max(dispatch_pool, 2 * this->batch_size);
+    if (!this->pool || this->pool->getCount() < count ||
+        this->pool->getBufferSize() < size + dispatch_headroom) {
+        size = max(size + dispatch_headroom,
+                   this->pool ? this->pool->getBufferSize() : 0);
+        try {
+            this->pool.reset(new PacketPool(count, size, dispatch_headroom));
+        } catch (exception const& ex) {
+            errno = ENOMEM;
+            return false;
+        }
+    }
+
+    // Handlers keep too many buffers
+    slot = this->pool->alloc();
+    if (!slot) {
+        errno = ENOBUFS;
+        return false;
+    }
+    return true;
+}
+
+bool DispatcherImpl::deliver(dispatcher_handler& handler)
+{
+    size_t count = this->batched;
+
+    this->batched = 0;
+    return count == 0 || handler.fn(handler.context, this->batch.data(),
+                                    count);
+}
+
+io_status DispatcherImpl::fail(dispatcher_handler& handler)
+{
+    int error = errno;
+
+    // Packets already read are handed over before the error is reported,
+    // so none is left behind for the next dispatch
+    this->deliver(handler);
+    errno = error;
+    return IO_ERROR;
+}
+
+void DispatcherImpl::dispatch(dispatcher_fn fn, void* context, int millis,
+                              size_t size)
+{
+    if (size == 0) {
+        ostringstream what;
+        what << "--- Invalid batch size for dispatcher, must be greater";
+        what << " than 0." << endl;
+        throw invalid_argument(what.str());
+    }
+
+    this->setBatchSize(size);
+    dispatcher_handler handler = {fn, context};
+    this->checkStatus(this->run(handler, millis));
+}
+
+io_status DispatcherImpl::tryDispatch(dispatcher_fn fn, void* context,
+                                      int millis, size_t size) noexcept
+{
+    if (size == 0) {
+        errno = EINVAL;
+        return IO_INVALID;
+    }
+
+    try {
+        this->setBatchSize(size);
+    } catch (bad_alloc const& ex) {
+        errno = ENOMEM;
+        return IO_ERROR;
+    }
+    dispatcher_handler handler = {fn, context};
+    return this->run(handler, millis);
+}
+
+void DispatcherImpl::setBatchSize(size_t size)
+{
+    // Storage only grows, so slots already allocated are kept
+    if (this->batch.size() < size) {
+        this->slots.resize(size, PacketPoolImpl::none());
+        this->buffers.resize(size);
+        this->batch.resize(size);
+    }
+    this->batch_size = size;
+}
+
+void DispatcherImpl::checkStatus(io_status status) const
+{
+    ostringstream what;
+    int error = errno;
+
+    if (status == IO_OK) {
+        return;
+    }
+
+    if (status == IO_INVALID && this->failed == nullptr) {
+        what << "--- Empty virtual interfaces set" << endl;
+        throw invalid_argument(what.str());
+    }
+
+    // Something bad happened
+    if (this->failed == nullptr) {
+        what << "--- Unknown error in ";
+        what << (this->epoll_fd < 0 ? "io_uring_enter()" : "epoll_wait()");
+        what << " system call." << endl;
+    } else if (this->failed->txq != nullptr) {
+        what << "--- IO error on the send queue of ";
+        what << this->failed->iface->getName() << " in dispatcher." << endl;
+    } else {
+        what << "--- IO error while reading from ";
+        what << this->failed->iface->getName() << "." << endl;
+    }
+    what << "    Error: " << strerror(error);
+    what << " (" << error << ")." << endl;
+    throw runtime_error(what.str());
+}
+
+io_status DispatcherImpl::run(dispatcher_handler& handler, int millis)
+{
+    struct epoll_event events[batch_max];
+    int nevents = -1;
+    io_status status;
+    bool proceed;
+
+    this->failed = nullptr;
+    this->batched = 0;
+
+    // Check non-empty set
+    if (this->ifaces.empty() && this->txqs.empty()) {
+        errno = EINVAL;
+        return IO_INVALID;
+    }
+
+    // Normalize timeout, any negative value means wait forever
+    if (millis < 0) {
+        millis = -1;
+    }
+
+#ifdef VIFACE_HAVE_IO_URING
+    if (this->uring) {
+        return this->runUring(handler, millis);
+    }
+#endif
+
+    while (true) {
+        // Write what was queued meanwhile, polling the full interfaces
+        if (this->flushQueues() != IO_OK) {
+            return IO_ERROR;
+        }
+
+        nevents = epoll_wait(this->epoll_fd, events, batch_max, millis);
+
+        // Check if epoll error
+        if (nevents == -1) {
+            // A signal was caught. Return.
+            if (errno == EINTR) {
+                return IO_OK;
+            }
+
+            // Something bad happened
+            return IO_ERROR;
+        }
+
+        // Check if timeout
+        if (nevents == 0) {
+            return IO_OK;
+        }
+
+        // Iterate only the interfaces ready for reading. Interfaces left
+        // with pending packets are level-triggered again, and epoll moves
+        // them to the end of its ready list, which makes the service
+        // round-robin.
+        for (int i = 0; i < nevents; i++) {
+            dispatcher_entry* entry = (dispatcher_entry*) events[i].data.ptr;
+
+            // Send queue ready for writing
+            if (entry->txq != nullptr) {
+                status = this->flushQueue(*entry->txq);
+                if (this->pollSendQueue(*entry->txq) != IO_OK ||
+                    status != IO_OK) {
+                    return this->fail(handler);
+                }
+                continue;
+            }
+
+            entry->stats.polls++;
+            uint64_t start = now();
+            entry->info.timestamp = start;
+            status = this->drain(entry, 0, handler, &proceed);
+            entry->stats.busy += now() - start;
+
+            if (status != IO_OK) {
+                return this->fail(handler);
+            }
+            if (!proceed) {
+                return this->flushQueues();
+            }
+        }
+
+        // Hand over what was gathered from every ready interface
+        if (!this->deliver(handler)) {
+            return this->flushQueues();
+        }
+    }
+}
+
+#ifdef VIFACE_HAVE_IO_URING
+io_status DispatcherImpl::runUring(dispatcher_handler& handler,
+                                   int millis)
+{
+    size_t index;
+    void* owner;
+    uint8_t* data;
+    ssize_t result;
+    ssize_t ready;
+    io_status status;
+    bool proceed;
+    bool last;
+    bool busy;
+    bool empty;
+
+    // Wait for completions, reads are already posted on every interface.
+    // What was queued meanwhile is written first.
+    while (true) {
+        if (this->flushQueues() != IO_OK) {
+            return IO_ERROR;
+        }
+
+        ready = this->uring->wait(millis);
+        if (ready < 0) {
+            return IO_ERROR;
+        }
+
+        // Timeout reached or signal caught
+        if (ready == 0) {
+            return IO_OK;
+        }
+
+        while (this->uring->pop(&index, &owner, &data, &result, &last,
+                                &busy)) {
+            dispatcher_entry* entry = (dispatcher_entry*) owner;
+            VIfaceImpl* impl = entry->iface->pimpl.get();
+
+            // Send queue ready for writing, or its poll failed
+            if (entry->txq != nullptr) {
+                entry->txq->armed = false;
+                status = this->flushQueue(*entry->txq);
+                this->pollSendQueue(*entry->txq);
+                if (status != IO_OK) {
+                    return this->fail(handler);
+                }
+                continue;
+            }
+
+            if (result < 0) {
+                // Something bad happened
+                if (last) {
+                    this->uring->rearm(index, false);
+                }
+                this->failed = entry;
+                errno = -result;
+                return this->fail(handler);
+            }
+
+            if (last) {
+                entry->stats.polls++;
+            }
+            uint64_t start = now();
+            entry->info.timestamp = start;
+
+            // Strip the virtio net header, if any. Polled queues have no
+            // data, only the readiness.
+            size_t length = 0;
+            uint work = 0;
+            if (data != nullptr) {
+                size_t skip = min((size_t) result, impl->getHeaderSize());
+                data += skip;
+                length = result - skip;
+                work = uring_reads;
+            }
+
+            // Dispatch the packets of the completed reads. Only if the last
+            // one got a packet too, or the queue was polled, the rest of the
+            // budget is drained synchronously, otherwise the queue was found
+            // empty. The reads are posted again afterwards, so packets are
+            // never reordered, and behind a poll if the queue is known to be
+            // empty.
+            try {
+                status = IO_OK;
+                proceed = true;
+                empty = !busy;
+                if (length > 0) {
+                    entry->stats.packets++;
+                    status = this->stage(entry, data, length, handler,
+                                         &proceed);
+                }
+                if (status == IO_OK && proceed && last && busy) {
+                    status = this->drain(entry, work, handler, &proceed);
+                    empty = !entry->pending;
+                }
+            } catch (...) {
+                if (last) {
+                    this->uring->rearm(index, false);
+                }
+                throw;
+            }
+            if (last) {
+                this->uring->rearm(index, empty);
+            }
+            entry->stats.busy += now() - start;
+
+            if (status != IO_OK) {
+                return this->fail(handler);
+            }
+            if (!proceed) {
+                status = this->flushQueues();
+                this->uring->flush();
+                return status;
+            }
+        }
+
+        // Hand over what was gathered from every completed interface
+        if (!this->deliver(handler)) {
+            status = this->flushQueues();
+            this->uring->flush();
+            return status;
+        }
+    }
+}
+
+io_status DispatcherImpl::stage(dispatcher_entry* entry,
+                                uint8_t const* data, size_t length,
+                                dispatcher_handler& handler, bool* proceed)
+{
+    // Copied into the next slot, the completion buffer is posted again.
+    // Slots are sized after the frame, so the pool isn't replaced for each
+    // larger packet.
+    size_t frame = entry->iface->pimpl->getFrameSize();
+    if (!this->reserve(1, max(length, frame))) {
+        this->failed = entry;
+        return IO_ERROR;
+    }
+    PacketBuffer& slot = this->slots[this->batched];
+    memcpy(slot.getData(), data, length);
+    slot.setLength(length);
+
+    this->batch[this->batched] = entry->info;
+    this->batch[this->batched].data = slot.getData();
+    this->batch[this->batched].length = length;
+    this->batch[this->batched].buffer = &slot;
+    this->batched++;
+
+    *proceed = this->batched < this->batch_size || this->deliver(handler);
+    return IO_OK;
+}
+#endif
+
+void DispatcherImpl::send(VIface* iface, PacketBuffer const& buffer,
+                          uint queue)
+{
+    VIfaceImpl* impl = iface->pimpl.get();
+
+#ifdef VIFACE_HAVE_IO_URING
+    // Queued writes are plain writes, send the others right away
+    if (this->uring && impl->isRawTX(queue)) {
+        impl->checkSize(buffer.getLength());
+        this->uring->send(impl->getTX(queue), buffer);
+        return;
+    }
+#endif
+
+    impl->send(buffer, nullptr, queue);
+}
+
+void DispatcherImpl::flush()
+{
+    this->failed = nullptr;
+    this->checkStatus(this->flushQueues());
+
+#ifdef VIFACE_HAVE_IO_URING
+    if (this->uring) {
+        this->uring->flush();
+    }
+#endif
+}
+
+uint64_t DispatcherImpl::getSendErrors() const
+{
+#ifdef VIFACE_HAVE_IO_URING
+    if (this->uring) {
+        return this->uring->getSendErrors();
+    }
+#endif
+    return 0;
+}
+
+dispatcher_txq& DispatcherImpl::getSendQueue(VIface* iface, uint queue)
+{
+    auto found = this->txqs.find(dispatcher_key(iface, queue));
+
+    if (found == this->txqs.end()) {
+        ostringstream what;
+        what << "--- Virtual interface " << iface->getName();
+        what << " queue " << queue;
+        what << " has no send queue in dispatcher." << endl;
+        throw invalid_argument(what.str());
+    }
+
+    return found->second;
+}
+
+void DispatcherImpl::addSendQueue(VIface* iface, size_t high_water,
+                                  uint queue)
+{
+    ostringstream what;
+    VIfaceImpl* impl = iface->pimpl.get();
+    dispatcher_key key(iface, queue);
+
+    if (this->txqs.find(key) != this->txqs.end()) {
+        what << "--- Virtual interface " << iface->getName();
+        what << " queue " << queue;
+        what << " already has a send queue in dispatcher." << endl;
+        throw invalid_argument(what.str());
+    }
+
+    if (high_water == 0) {
+        what << "--- Invalid high-water mark for " << iface->getName();
+        what << ", must be greater than 0." << endl;
+        throw invalid_argument(what.str());
+    }
+
+    // Polled on a descriptor of its own, as tun/tap queues use the same
+    // one for reception, which may be registered too
+    int fd = dup(impl->getTX(queue));
+    if (fd < 0) {
+        what << "--- Unable to duplicate the descriptor of ";
+        what << iface->getName() << " queue " << queue << "." << endl;
+        what << "    Error: " << strerror(errno);
+        what << " (" << errno << ")." << endl;
+        throw runtime_error(what.str());
+    }
+
+    // Map nodes don't move, so the queue is given back on wakeup
+    dispatcher_txq* txq = &this->txqs[key];
+    txq->poller.iface = iface;
+    txq->poller.queue = queue;
+    txq->poller.txq = txq;
+    txq->fd = fd;
+    txq->high_water = high_water;
+
+#ifdef VIFACE_HAVE_IO_URING
+    if (this->uring) {
+        // The first poll is posted right away, and just finds nothing to
+        // write. Packets queued meanwhile are written by the next flush.
+        try {
+            txq->poller.slot = this->uring->add(&txq->poller, fd, 0, POLLOUT);
+        } catch (...) {
+            close(fd);
+            this->txqs.erase(key);
+            throw;
+        }
+        return;
+    }
+#endif
+
+    // Writability is only polled while packets are pending
+    struct epoll_event event;
+    memset(&event, 0, sizeof(struct epoll_event));
+    event.events = 0;
+    event.data.ptr = &txq->poller;
+
+    if (epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+        close(fd);
+        this->txqs.erase(key);
+        what << "--- Unable to register the send queue of ";
+        what << iface->getName() << " in dispatcher." << endl;
+        what << "    Error: " << strerror(errno);
+        what << " (" << errno << ")." << endl;
+        throw runtime_error(what.str());
+    }
+}
+
+void DispatcherImpl::removeSendQueue(VIface* iface, uint queue, int millis)
+{
+    dispatcher_txq& txq = this->getSendQueue(iface, queue);
+    uint64_t deadline = now() + (uint64_t) max(millis, 0) * 1000000;
+
+    // Write the pending packets while the interface keeps up
+    io_status status = this->flushQueue(txq);
+    while (status == IO_OK && !txq.frames.empty()) {
+        uint64_t current = now();
+        if (current >= deadline) {
+            break;
+        }
+
+        struct pollfd pfd;
+        pfd.fd = txq.fd;
+        pfd.events = POLLOUT;
+        pfd.revents = 0;
+        int timeout = (deadline - current + 999999) / 1000000;
+        if (poll(&pfd, 1, timeout) <= 0) {
+            break;
+        }
+        status = this->flushQueue(txq);
+    }
+    txq.stats.dropped += txq.frames.size();
+    txq.frames.clear();
+
+#ifdef VIFACE_HAVE_IO_URING
+    if (this->uring) {
+        this->uring->remove(txq.poller.slot);
+    }
+#endif
+
+    if (this->epoll_fd >= 0 &&
+        epoll_ctl(this->epoll_fd, EPOLL_CTL_DEL, txq.fd, NULL) != 0) {
+        ostringstream what;
+        what << "--- Unable to unregister the send queue of ";
+        what << iface->getName() << " from dispatcher." << endl;
+        what << "    Error: " << strerror(errno);
+        what << " (" << errno << ")." << endl;
+        throw runtime_error(what.str());
+    }
+
+    auto found = find(this->dirty.begin(), this->dirty.end(), &txq);
+    if (found != this->dirty.end()) {
+        this->dirty.erase(found);
+    }
+    close(txq.fd);
+    this->txqs.erase(dispatcher_key(iface, queue));
+}
+
+bool DispatcherImpl::enqueue(VIface* iface, PacketBuffer&& buffer,
+                             uint queue)
+{
+    dispatcher_txq& txq = this->getSendQueue(iface, queue);
+
+    iface->pimpl->checkSize(buffer.getLength());
+    if (txq.frames.size() >= txq.high_water) {
+        txq.stats.dropped++;
+        return false;
+    }
+
+    txq.frames.push_back({move(buffer), now()});
+    txq.stats.queued++;
+
+    // Written on the next flush, or when the interface becomes writable
+    if (!txq.dirty && !txq.armed) {
+        txq.dirty = true;
+        this->dirty.push_back(&txq);
+    }
+    return true;
+}
+
+io_status DispatcherImpl::flushQueue(dispatcher_txq& txq)
+{
+    VIfaceImpl* impl = txq.poller.iface->pimpl.get();
+    packet_buffer buffers[batch_max];
+    size_t batch = batch_max;
+
+    while (!txq.frames.empty()) {
+        size_t count = min(txq.frames.size(), batch);
+        size_t sent;
+
+        for (size_t i = 0; i < count; i++) {
+            PacketBuffer& buffer = txq.frames[i].buffer;
+            buffers[i].data = buffer.getData();
+            buffers[i].size = buffer.getLength();
+            buffers[i].length = buffer.getLength();
+        }
+
+        io_status status = impl->trySendBatch(buffers, count, &sent,
+                                              txq.poller.queue);
+
+        uint64_t time = now();
+        for (size_t i = 0; i < sent; i++) {
+            uint64_t delay = time - txq.frames.front().time;
+            txq.stats.delay += delay;
+            txq.stats.max_delay = max(txq.stats.max_delay, delay);
+            txq.stats.sent++;
+            txq.frames.pop_front();
+        }
+
+        // Sizes are checked for the whole batch, so go one by one to find
+        // the packet that doesn't fit anymore, e.g. after an MTU change.
+        // Packets that fail on their own are dropped.
+        if (status == IO_INVALID && count > 1) {
+            batch = 1;
+            continue;
+        }
+        if (status == IO_INVALID) {
+            txq.frames.pop_front();
+            txq.stats.dropped++;
+            continue;
+        }
+
+        // Write errors aren't the packets' fault (e.g. the interface is
+        // down), so they are kept, and dropped at the high-water mark
+        if (status == IO_ERROR) {
+            this->failed = &txq.poller;
+            return IO_ERROR;
+        }
+
+        // Interface is full
+        if (sent < count) {
+            break;
+        }
+    }
+
+    return IO_OK;
+}
+
+io_status DispatcherImpl::flushQueues()
+{
+    io_status status = IO_OK;
+    dispatcher_entry* failed = nullptr;
+    int error = 0;
+
+    // Every queue is flushed and polled, the first failure is reported
+    for (auto txq : this->dirty) {
+        txq->dirty = false;
+        io_status flushed = this->flushQueue(*txq);
+        io_status polled = this->pollSendQueue(*txq);
+        if (status == IO_OK && (flushed != IO_OK || polled != IO_OK)) {
+            status = IO_ERROR;
+            failed = this->failed;
+            error = errno;
+        }
+    }
+    this->dirty.clear();
+
+    if (status != IO_OK) {
+        this->failed = failed;
+        errno = error;
+    }
+    return status;
+}
+
+io_status DispatcherImpl::pollSendQueue(dispatcher_txq& txq)
+{
+    bool pending = !txq.frames.empty();
+
+#ifdef VIFACE_HAVE_IO_URING
+    if (this->uring) {
+        // Polls are one-shot, posted again while packets are pending
+        if (pending && !txq.armed) {
+            this->uring->rearm(txq.poller.slot, true);
+            txq.armed = true;
+        }
+        return IO_OK;
+    }
+#endif
+
+    // Level-triggered, so only polled while packets are pending
+    if (pending == txq.armed) {
+        return IO_OK;
+    }
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(struct epoll_event));
+    event.events = pending ? (uint32_t) EPOLLOUT : 0;
+    event.data.ptr = &txq.poller;
+
+    if (epoll_ctl(this->epoll_fd, EPOLL_CTL_MOD, txq.fd, &event) != 0) {
+        this->failed = &txq.poller;
+        return IO_ERROR;
+    }
+    txq.armed = pending;
+    return IO_OK;
+}
+
+send_queue_stats DispatcherImpl::getSendQueueStats(VIface* iface, uint queue)
+{
+    dispatcher_txq& txq = this->getSendQueue(iface, queue);
+    send_queue_stats stats = txq.stats;
+
+    stats.pending = txq.frames.size();
+    return stats;
+}
+
+
+void dispatch(set<VIface*>& ifaces, dispatcher_cb callback, int millis)
+{
+    Dispatcher dispatcher;
+
+    for (auto iface : ifaces) {
+        for (uint queue = 0; queue < iface->getQueues(); queue++) {
+            dispatcher.add(iface, queue);
+        }
+    }
+
+    dispatcher.dispatch(callback, millis);
+}
+
+
+/*============================================================================
+   =   PIMPL IDIOM BUREAUCRACY
+   =
+   =   Starting this point there is not much relevant things...
+   =   Stop scrolling...
+ *============================================================================*/
+
+Dispatcher::Dispatcher(dispatcher_engine engine) :
+    pimpl(new DispatcherImpl(engine))
+{}
+Dispatcher::~Dispatcher() = default;
+
+dispatcher_engine Dispatcher::getEngine() const
+{
+    return this->pimpl->getEngine();
+}
+
+void Dispatcher::add(VIface* iface, uint queue)
+{
+    return this->pimpl->add(iface, queue);
+}
+
+void Dispatcher::remove(VIface* iface, uint queue)
+{
+    return this->pimpl->remove(iface, queue);
+}
+
+size_t Dispatcher::getSize() const
+{
+    return this->pimpl->getSize();
+}
+
+void Dispatcher::setBudget(VIface* iface, uint budget, uint queue)
+{
+    return this->pimpl->setBudget(iface, budget, queue);
+}
+
+uint Dispatcher::getBudget(VIface* iface, uint queue) const
+{
+    return this->pimpl->getBudget(iface, queue);
+}
+
+dispatcher_stats Dispatcher::getStats(VIface* iface, uint queue) const
+{
+    return this->pimpl->getStats(iface, queue);
+}
+
+pool_stats Dispatcher::getPoolStats() const
+{
+    return this->pimpl->getPoolStats();
+}
+
+size_t Dispatcher::drainQueue(VIface* iface, packet_cb callback, uint queue)
+{
+    return this->pimpl->drainQueue(iface, callback, queue);
+}
+
+void Dispatcher::dispatch(dispatcher_cb callback, int millis)
+{
+    // The callback takes a vector, the packet is copied into a reused one
+    vector<uint8_t>& packet = this->pimpl->getPacket();
+
+    return this->dispatch([&](packet_info const& info) {
+            packet.assign(info.data, info.data + info.length);
+            return callback(DispatcherImpl::getName(info.iface), info.id,
+                            packet);
+        }, millis);
+}
+
+io_status Dispatcher::tryDispatch(dispatcher_cb callback, int millis) noexcept
+{
+    vector<uint8_t>* packet;
+    bool exhausted = false;
+
+    // Room for the largest frame is reserved before dispatching, so copying
+    // only allocates if the callback replaced the vector. If that fails the
+    // packet is dropped and the dispatch stopped.
+    try {
+        packet = &this->pimpl->getPacket();
+    } catch (bad_alloc const& ex) {
+        errno = ENOMEM;
+        return IO_ERROR;
+    }
+
+    io_status status = this->tryDispatch([&](packet_info const& info) {
+            try {
+                packet->assign(info.data, info.data + info.length);
+            } catch (bad_alloc const& ex) {
+                exhausted = true;
+                return false;
+            }
+            return callback(DispatcherImpl::getName(info.iface), info.id,
+                            *packet);
+        }, millis);
+
+    if (status == IO_OK && exhausted) {
+        errno = ENOMEM;
+        return IO_ERROR;
+    }
+    return status;
+}
+
+void Dispatcher::dispatchPackets(packet_cb callback, int millis)
+{
+    return this->dispatch(callback, millis);
+}
+
+io_status Dispatcher::tryDispatchPackets(packet_cb callback,
+                                         int millis) noexcept
+{
+    return this->tryDispatch(callback, millis);
+}
+
+void Dispatcher::dispatchBatch(batch_cb callback, int millis, size_t size)
+{
+    return this->pimpl->dispatch(invoke_batch, &callback, millis, size);
+}
+
+io_status Dispatcher::tryDispatchBatch(batch_cb callback, int millis,
+                                       size_t size) noexcept
+{
+    return this->pimpl->tryDispatch(invoke_batch, &callback, millis, size);
+}
+
+void Dispatcher::dispatchRaw(dispatcher_fn handler, void* context,
+                             int millis, size_t size)
+{
+    return this->pimpl->dispatch(handler, context, millis, size);
+}
+
+io_status Dispatcher::tryDispatchRaw(dispatcher_fn handler, void* context,
+                                     int millis, size_t size) noexcept
+{
+    return this->pimpl->tryDispatch(handler, context, millis, size);
+}
+
+void Dispatcher::send(VIface* iface, PacketBuffer const& buffer,
+                      uint queue)
+{
+    return this->pimpl->send(iface, buffer, queue);
+}
+
+void Dispatcher::flush()
+{
+    return this->pimpl->flush();
+}
+
+uint64_t Dispatcher::getSendErrors() const
+{
+    return this->pimpl->getSendErrors();
+}
+
+void Dispatcher::addSendQueue(VIface* iface, size_t high_water, uint queue)
+{
+    return this->pimpl->addSendQueue(iface, high_water, queue);
+}
+
+void Dispatcher::removeSendQueue(VIface* iface, uint queue, int millis)
+{
+    return this->pimpl->removeSendQueue(iface, queue, millis);
+}
+
+bool Dispatcher::enqueue(VIface* iface, PacketBuffer&& buffer, uint queue)
+{
+    return this->pimpl->enqueue(iface, move(buffer), queue);
+}
+
+send_queue_stats Dispatcher::getSendQueueStats(VIface* iface,
+                                               uint queue) const
+{
+    return this->pimpl->getSendQueueStats(iface, queue);
+}
+}
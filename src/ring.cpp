@@ -0,0 +1,473 @@
+/**
+ * Copyright (C) 2015 Hewlett Packard Enterprise Development LP
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include "viface/private/viface.hpp"
+
+namespace viface
+{
+/*= Helpers ==================================================================*/
+
+// Frame size declared to the kernel. TPACKET_V3 packs frames of any size
+// into blocks, but still checks the ring geometry against it.
+const size_t ring_frame_size = TPACKET_ALIGNMENT << 7;
+
+// Frames are laid out after a tpacket2_hdr, where the address would be
+const size_t ring_frame_offset = TPACKET2_HDRLEN - sizeof(struct sockaddr_ll);
+
+static struct tpacket_block_desc* ring_block(struct viface_ring const& ring)
+{
+    return (struct tpacket_block_desc*)
+           (ring.map + ring.current * ring.block_size);
+}
+
+// Frames don't cross block boundaries
+static struct tpacket2_hdr* ring_frame(struct viface_ring const& ring,
+                                       uint index)
+{
+    size_t per_block = ring.block_size / ring.frame_size;
+    return (struct tpacket2_hdr*)
+           (ring.map + (index / per_block) * ring.block_size +
+            (index % per_block) * ring.frame_size);
+}
+
+
+/*= Virtual Interface Implementation =========================================*/
+
+void VIfaceImpl::checkRead(uint queue) const
+{
+    if (this->getQueue(queue).rx_ring.map != nullptr) {
+        ostringstream what;
+        what << "--- Queue " << queue << " of " << this->name;
+        what << " delivers frames through its reception ring." << endl;
+        throw invalid_argument(what.str());
+    }
+}
+
+struct viface_ring& VIfaceImpl::getRing(uint queue)
+{
+    // Validates the queue
+    this->getQueue(queue);
+    struct viface_ring& ring = this->queues[queue].rx_ring;
+
+    if (ring.map == nullptr) {
+        ostringstream what;
+        what << "--- Queue " << queue << " of " << this->name;
+        what << " has no reception ring." << endl;
+        throw invalid_argument(what.str());
+    }
+
+    return ring;
+}
+
+void VIfaceImpl::enableRing(uint blocks, size_t block_size, uint millis,
+                            uint queue)
+{
+    ostringstream what;
+    int fd = this->getQueue(queue).rx;
+    struct viface_ring& ring = this->queues[queue].rx_ring;
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    if (!this->hooked) {
+        what << "--- Reception rings are only supported on hooked";
+        what << " interfaces, " << this->name << " is a tun/tap device.";
+        what << endl;
+        throw invalid_argument(what.str());
+    }
+
+    if (!this->xsks.empty()) {
+        what << "--- Reception rings are not supported by the XDP backend,";
+        what << " used by " << this->name << "." << endl;
+        throw invalid_argument(what.str());
+    }
+
+    // The kernel would place the header before each frame
+    if (this->flags & FLAG_VNET_HDR) {
+        what << "--- Reception rings don't support virtio net headers, ";
+        what << this->name << " uses them." << endl;
+        throw invalid_argument(what.str());
+    }
+
+    if (ring.map != nullptr) {
+        what << "--- Queue " << queue << " of " << this->name;
+        what << " already has a reception ring." << endl;
+        throw invalid_argument(what.str());
+    }
+
+    if (blocks == 0 || block_size == 0 || block_size % page != 0 ||
+        block_size > UINT_MAX) {
+        what << "--- Invalid reception ring geometry (" << blocks;
+        what << " blocks of " << block_size << " bytes) for ";
+        what << this->name << "." << endl;
+        what << "    Blocks must be a multiple of " << page << " bytes.";
+        what << endl;
+        throw invalid_argument(what.str());
+    }
+
+    // Block-based delivery
+    int version = TPACKET_V3;
+    if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &version,
+                   sizeof(version)) != 0) {
+        what << "--- Unable to select TPACKET_V3 on " << this->name;
+        what << "." << endl;
+        what << "    Error: " << strerror(errno);
+        what << " (" << errno << ")." << endl;
+        throw runtime_error(what.str());
+    }
+
+    struct tpacket_req3 req;
+    memset(&req, 0, sizeof(struct tpacket_req3));
+    req.tp_block_size = block_size;
+    req.tp_block_nr = blocks;
+    req.tp_frame_size = ring_frame_size;
+    req.tp_frame_nr = (block_size / ring_frame_size) * blocks;
+    req.tp_retire_blk_tov = millis;
+
+    if (setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req,
+                   sizeof(struct tpacket_req3)) != 0) {
+        what << "--- Unable to create reception ring on " << this->name;
+        what << "." << endl;
+        what << "    Error: " << strerror(errno);
+        what << " (" << errno << ")." << endl;
+        throw runtime_error(what.str());
+    }
+
+    void* map = mmap(nullptr, blocks * block_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        what << "--- Unable to map reception ring of " << this->name;
+        what << "." << endl;
+        what << "    Error: " << strerror(errno);
+        what << " (" << errno << ")." << endl;
+
+        // Destroy the ring, an empty request does so
+        memset(&req, 0, sizeof(struct tpacket_req3));
+        setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req,
+                   sizeof(struct tpacket_req3));
+        throw runtime_error(what.str());
+    }
+
+    ring.map = (uint8_t*) map;
+    ring.block_size = block_size;
+    ring.blocks = blocks;
+    ring.current = 0;
+    ring.pending = 0;
+    ring.next = nullptr;
+}
+
+size_t VIfaceImpl::receiveRing(packet_view* views, size_t count, int millis,
+                               uint queue)
+{
+    struct viface_ring& ring = this->getRing(queue);
+    int fd = this->queues[queue].rx;
+
+    // Open the current block once the kernel hands it over
+    if (ring.next == nullptr) {
+        struct tpacket_block_desc* block = ring_block(ring);
+        uint32_t* status = &block->hdr.bh1.block_status;
+
+        if (!(__atomic_load_n(status, __ATOMIC_ACQUIRE) & TP_STATUS_USER)) {
+            if (millis == 0) {
+                return 0;
+            }
+
+            struct pollfd pfd;
+            memset(&pfd, 0, sizeof(struct pollfd));
+            pfd.fd = fd;
+            pfd.events = POLLIN;
+
+            // Interrupted by a signal, as in dispatch()
+            if (poll(&pfd, 1, millis) < 0 && errno != EINTR) {
+                ostringstream what;
+                what << "--- Error while waiting for the reception ring of ";
+                what << this->name << "." << endl;
+                what << "    Error: " << strerror(errno);
+                what << " (" << errno << ")." << endl;
+                throw runtime_error(what.str());
+            }
+
+            if (!(__atomic_load_n(status, __ATOMIC_ACQUIRE) &
+                  TP_STATUS_USER)) {
+                return 0;
+            }
+        }
+
+        ring.pending = block->hdr.bh1.num_pkts;
+        ring.next = (uint8_t*) block + block->hdr.bh1.offset_to_first_pkt;
+    }
+
+    // Frames are chained by offset inside the block
+    size_t received = 0;
+    while (received < count && ring.pending > 0) {
+        struct tpacket3_hdr* frame = (struct tpacket3_hdr*) ring.next;
+
+        views[received].data = ring.next + frame->tp_mac;
+        views[received].length = frame->tp_snaplen;
+
+        ring.next += frame->tp_next_offset;
+        ring.pending--;
+        received++;
+    }
+
+    return received;
+}
+
+void VIfaceImpl::releaseBlock(uint queue)
+{
+    struct viface_ring& ring = this->getRing(queue);
+
+    if (ring.next == nullptr) {
+        return;
+    }
+
+    struct tpacket_block_desc* block = ring_block(ring);
+    __atomic_store_n(&block->hdr.bh1.block_status, TP_STATUS_KERNEL,
+                     __ATOMIC_RELEASE);
+
+    ring.current = (ring.current + 1) % ring.blocks;
+    ring.pending = 0;
+    ring.next = nullptr;
+}
+
+struct viface_ring& VIfaceImpl::getSendRing(uint queue) const
+{
+    struct viface_ring& ring = this->getQueue(queue).tx_ring;
+
+    if (ring.map == nullptr) {
+        ostringstream what;
+        what << "--- Queue " << queue << " of " << this->name;
+        what << " has no transmission ring." << endl;
+        throw invalid_argument(what.str());
+    }
+
+    return ring;
+}
+
+void VIfaceImpl::enableSendRing(uint frames, size_t frame_size, uint queue)
+{
+    ostringstream what;
+    int fd = this->getQueue(queue).tx;
+    struct viface_ring& ring = this->queues[queue].tx_ring;
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    if (!this->hooked) {
+        what << "--- Transmission rings are only supported on hooked";
+        what << " interfaces, " << this->name << " is a tun/tap device.";
+        what << endl;
+        throw invalid_argument(what.str());
+    }
+
+    if (!this->xsks.empty()) {
+        what << "--- Transmission rings are not supported by the XDP backend,";
+        what << " used by " << this->name << "." << endl;
+        throw invalid_argument(what.str());
+    }
+
+    if (this->flags & FLAG_VNET_HDR) {
+        what << "--- Transmission rings don't support virtio net headers, ";
+        what << this->name << " uses them." << endl;
+        throw invalid_argument(what.str());
+    }
+
+    if (ring.map != nullptr) {
+        what << "--- Queue " << queue << " of " << this->name;
+        what << " already has a transmission ring." << endl;
+        throw invalid_argument(what.str());
+    }
+
+    if (frames == 0 || frame_size % TPACKET_ALIGNMENT != 0 ||
+        frame_size < TPACKET2_HDRLEN + ETH_HLEN || frame_size > UINT_MAX) {
+        what << "--- Invalid transmission ring geometry (" << frames;
+        what << " frames of " << frame_size << " bytes) for ";
+        what << this->name << "." << endl;
+        what << "    Frames must be a multiple of " << TPACKET_ALIGNMENT;
+        what << " bytes, of at least " << TPACKET2_HDRLEN + ETH_HLEN;
+        what << " bytes." << endl;
+        throw invalid_argument(what.str());
+    }
+
+    // Smallest blocks holding a frame, enough of them for all the frames
+    size_t block_size = ((frame_size + page - 1) / page) * page;
+    size_t per_block = block_size / frame_size;
+    uint blocks = (frames + per_block - 1) / per_block;
+
+    // Frame-based layout, the header tells the length of each frame
+    int version = TPACKET_V2;
+    if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &version,
+                   sizeof(version)) != 0) {
+        what << "--- Unable to select TPACKET_V2 on " << this->name;
+        what << "." << endl;
+        what << "    Error: " << strerror(errno);
+        what << " (" << errno << ")." << endl;
+        throw runtime_error(what.str());
+    }
+
+    struct tpacket_req req;
+    memset(&req, 0, sizeof(struct tpacket_req));
+    req.tp_block_size = block_size;
+    req.tp_block_nr = blocks;
+    req.tp_frame_size = frame_size;
+    req.tp_frame_nr = per_block * blocks;
+
+    if (setsockopt(fd, SOL_PACKET, PACKET_TX_RING, &req,
+                   sizeof(struct tpacket_req)) != 0) {
+        what << "--- Unable to create transmission ring on " << this->name;
+        what << "." << endl;
+        what << "    Error: " << strerror(errno);
+        what << " (" << errno << ")." << endl;
+        throw runtime_error(what.str());
+    }
+
+    void* map = mmap(nullptr, blocks * block_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        what << "--- Unable to map transmission ring of " << this->name;
+        what << "." << endl;
+        what << "    Error: " << strerror(errno);
+        what << " (" << errno << ")." << endl;
+
+        // Destroy the ring, an empty request does so
+        memset(&req, 0, sizeof(struct tpacket_req));
+        setsockopt(fd, SOL_PACKET, PACKET_TX_RING, &req,
+                   sizeof(struct tpacket_req));
+        throw runtime_error(what.str());
+    }
+
+    ring.map = (uint8_t*) map;
+    ring.block_size = block_size;
+    ring.blocks = blocks;
+    ring.frame_size = frame_size;
+    ring.frames = req.tp_frame_nr;
+    ring.current = 0;
+    ring.dropped = 0;
+}
+
+size_t VIfaceImpl::acquireSlots(packet_buffer* slots, size_t count,
+                                uint queue) const
+{
+    struct viface_ring& ring = this->getSendRing(queue);
+    size_t acquired = 0;
+
+    // Free slots follow the last one sent, until one still owned by the
+    // kernel is found
+    while (acquired < count && acquired < ring.frames) {
+        struct tpacket2_hdr* frame = ring_frame(
+            ring, (ring.current + acquired) % ring.frames);
+
+        uint status = __atomic_load_n(&frame->tp_status, __ATOMIC_ACQUIRE);
+
+        // The kernel refused the frame and stopped there, so the slot is
+        // taken back. The frames after it are sent once it is sent again.
+        if (status == TP_STATUS_WRONG_FORMAT) {
+            __atomic_store_n(&frame->tp_status, TP_STATUS_AVAILABLE,
+                             __ATOMIC_RELAXED);
+            ring.dropped++;
+        } else if (status != TP_STATUS_AVAILABLE) {
+            break;
+        }
+
+        slots[acquired].data = (uint8_t*) frame + ring_frame_offset;
+        slots[acquired].size = ring.frame_size - ring_frame_offset;
+        slots[acquired].length = 0;
+        acquired++;
+    }
+
+    return acquired;
+}
+
+void VIfaceImpl::sendSlots(packet_buffer const* slots, size_t count,
+                           uint queue) const
+{
+    ostringstream what;
+    struct viface_ring& ring = this->getSendRing(queue);
+
+    // Slots must be the next ones acquired, in order
+    for (size_t i = 0; i < count; i++) {
+        struct tpacket2_hdr* frame = ring_frame(
+            ring, (ring.current + i) % ring.frames);
+
+        if (i >= ring.frames ||
+            slots[i].data != (uint8_t*) frame + ring_frame_offset ||
+            frame->tp_status != TP_STATUS_AVAILABLE) {
+            what << "--- Slot " << i << " wasn't acquired from the";
+            what << " transmission ring of " << this->name << "." << endl;
+            throw invalid_argument(what.str());
+        }
+
+        this->checkSize(slots[i].length);
+    }
+
+    if (this->flushSlots(slots, count, queue) < 0) {
+        what << "--- IO error while writting to " << this->name;
+        what << "." << endl;
+        what << "    Error: " << strerror(errno);
+        what << " (" << errno << ")." << endl;
+        throw runtime_error(what.str());
+    }
+}
+
+int VIfaceImpl::flushSlots(packet_buffer const* slots, size_t count,
+                           uint queue) const
+{
+    struct viface_queues const& selected = this->queues[queue];
+    struct viface_ring& ring = selected.tx_ring;
+
+    // Hand the frames over to the kernel
+    for (size_t i = 0; i < count; i++) {
+        struct tpacket2_hdr* frame = ring_frame(ring, ring.current);
+
+        frame->tp_len = slots[i].length;
+        __atomic_store_n(&frame->tp_status, TP_STATUS_SEND_REQUEST,
+                         __ATOMIC_RELEASE);
+        ring.current = (ring.current + 1) % ring.frames;
+    }
+
+    // A single kick sends every pending frame. Frames the device didn't
+    // take stay in the ring and are sent by the next one.
+    if (::send(selected.tx, nullptr, 0, MSG_DONTWAIT) < 0 &&
+        errno != EAGAIN && errno != ENOBUFS) {
+        return -1;
+    }
+    return 0;
+}
+
+ssize_t VIfaceImpl::writeRing(struct iovec const* iovecs, size_t count,
+                              uint queue) const
+{
+    packet_buffer slot;
+
+    if (this->acquireSlots(&slot, 1, queue) == 0) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    // Gather the segments into the slot
+    for (size_t i = 0; i < count; i++) {
+        if (iovecs[i].iov_len > slot.size - slot.length) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+        memcpy(slot.data + slot.length, iovecs[i].iov_base,
+               iovecs[i].iov_len);
+        slot.length += iovecs[i].iov_len;
+    }
+
+    if (this->flushSlots(&slot, 1, queue) < 0) {
+        return -1;
+    }
+    return slot.length;
+}
+}
@@ -0,0 +1,251 @@
+/**
+ * Copyright (C) 2015 Hewlett Packard Enterprise Development LP
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include "viface/private/viface.hpp"
+
+namespace viface
+{
+/*= eBPF Assembler ===========================================================*/
+
+int BpfProgram::load(uint32_t type)
+{
+    // Resolve jumps, offsets are relative to the next instruction
+    for (auto & fixup : this->fixups) {
+        this->insns[fixup.first].off =
+            this->labels.at(fixup.second) - fixup.first - 1;
+    }
+
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(union bpf_attr));
+    attr.prog_type = type;
+    attr.insns = (uint64_t) (uintptr_t) this->insns.data();
+    attr.insn_cnt = this->insns.size();
+    attr.license = (uint64_t) (uintptr_t) "Apache-2.0";
+
+    int fd = syscall(__NR_bpf, BPF_PROG_LOAD, &attr, sizeof(union bpf_attr));
+    if (fd >= 0) {
+        return fd;
+    }
+
+    // Load again with the verifier log to report why it was rejected
+    int error = errno;
+    vector<char> log(64 * 1024, '\0');
+    attr.log_level = 1;
+    attr.log_buf = (uint64_t) (uintptr_t) log.data();
+    attr.log_size = log.size();
+
+    fd = syscall(__NR_bpf, BPF_PROG_LOAD, &attr, sizeof(union bpf_attr));
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    ostringstream what;
+    what << "--- Unable to load eBPF program." << endl;
+    what << "    Error: " << strerror(error);
+    what << " (" << error << ")." << endl;
+    what << "    Verifier: " << log.data() << endl;
+    throw runtime_error(what.str());
+}
+
+
+/*= Steering Programs ========================================================*/
+
+// 5-tuple hash of IPv4 and IPv6 packets. See STEERING_FLOW.
+static void build_flow(BpfProgram& prog)
+{
+    const int32_t net = SKF_NET_OFF;
+
+    prog.mov(BPF_REG_6, BPF_REG_1);
+    prog.movi(BPF_REG_9, 0);
+
+    // IP version
+    prog.ldabs(BPF_B, net);
+    prog.mov(BPF_REG_7, BPF_REG_0);
+    prog.alui(BPF_RSH, BPF_REG_7, 4);
+    prog.jump(BPF_JEQ, BPF_REG_7, 4, "ipv4");
+    prog.jump(BPF_JEQ, BPF_REG_7, 6, "ipv6");
+    prog.movi(BPF_REG_0, 0);
+    prog.exit();
+
+    // Addresses and protocol, header length kept in R8
+    prog.label("ipv4");
+    prog.mov(BPF_REG_8, BPF_REG_0);
+    prog.alui(BPF_AND, BPF_REG_8, 0x0f);
+    prog.alui(BPF_LSH, BPF_REG_8, 2);
+    prog.ldabs(BPF_W, net + 12);
+    prog.alu(BPF_XOR, BPF_REG_9, BPF_REG_0);
+    prog.ldabs(BPF_W, net + 16);
+    prog.alu(BPF_XOR, BPF_REG_9, BPF_REG_0);
+    prog.ldabs(BPF_B, net + 9);
+    prog.alu(BPF_XOR, BPF_REG_9, BPF_REG_0);
+    prog.mov(BPF_REG_7, BPF_REG_0);
+
+    // Fragments don't carry ports, or not all of them
+    prog.ldabs(BPF_H, net + 6);
+    prog.jump(BPF_JSET, BPF_REG_0, 0x3fff, "fold");
+    prog.jump(BPF_JEQ, BPF_REG_7, IPPROTO_TCP, "ports4");
+    prog.jump(BPF_JEQ, BPF_REG_7, IPPROTO_UDP, "ports4");
+    prog.jump(BPF_JEQ, BPF_REG_7, IPPROTO_SCTP, "ports4");
+    prog.jump(BPF_JA, 0, 0, "fold");
+
+    prog.label("ports4");
+    prog.ldind(BPF_W, BPF_REG_8, net);
+    prog.alu(BPF_XOR, BPF_REG_9, BPF_REG_0);
+    prog.jump(BPF_JA, 0, 0, "fold");
+
+    // Addresses and next header, extension headers are not followed
+    prog.label("ipv6");
+    for (int32_t offset = 8; offset < 40; offset += 4) {
+        prog.ldabs(BPF_W, net + offset);
+        prog.alu(BPF_XOR, BPF_REG_9, BPF_REG_0);
+    }
+    prog.ldabs(BPF_B, net + 6);
+    prog.alu(BPF_XOR, BPF_REG_9, BPF_REG_0);
+    prog.mov(BPF_REG_7, BPF_REG_0);
+    prog.jump(BPF_JEQ, BPF_REG_7, IPPROTO_TCP, "ports6");
+    prog.jump(BPF_JEQ, BPF_REG_7, IPPROTO_UDP, "ports6");
+    prog.jump(BPF_JEQ, BPF_REG_7, IPPROTO_SCTP, "ports6");
+    prog.jump(BPF_JA, 0, 0, "fold");
+
+    prog.label("ports6");
+    prog.ldabs(BPF_W, net + 40);
+    prog.alu(BPF_XOR, BPF_REG_9, BPF_REG_0);
+
+    prog.label("fold");
+    prog.mov(BPF_REG_0, BPF_REG_9);
+    prog.alui(BPF_RSH, BPF_REG_0, 16);
+    prog.alu(BPF_XOR, BPF_REG_0, BPF_REG_9);
+    prog.exit();
+}
+
+// VLAN id, either offloaded or in the frame. See STEERING_VLAN.
+static void build_vlan(BpfProgram& prog)
+{
+    prog.mov(BPF_REG_6, BPF_REG_1);
+    prog.ldctx(BPF_REG_0, offsetof(struct __sk_buff, vlan_tci));
+    prog.alui(BPF_AND, BPF_REG_0, 0x0fff);
+    prog.jump(BPF_JNE, BPF_REG_0, 0, "done");
+
+    prog.ldabs(BPF_H, 12);
+    prog.mov(BPF_REG_7, BPF_REG_0);
+    prog.jump(BPF_JEQ, BPF_REG_7, ETH_P_8021Q, "tagged");
+    prog.jump(BPF_JEQ, BPF_REG_7, ETH_P_8021AD, "tagged");
+    prog.movi(BPF_REG_0, 0);
+    prog.exit();
+
+    prog.label("tagged");
+    prog.ldabs(BPF_H, 14);
+    prog.alui(BPF_AND, BPF_REG_0, 0x0fff);
+
+    prog.label("done");
+    prog.exit();
+}
+
+// Destination MAC address. See STEERING_MAC.
+static void build_mac(BpfProgram& prog)
+{
+    prog.mov(BPF_REG_6, BPF_REG_1);
+    prog.ldabs(BPF_W, 0);
+    prog.mov(BPF_REG_7, BPF_REG_0);
+    prog.ldabs(BPF_H, 4);
+    prog.alu(BPF_XOR, BPF_REG_0, BPF_REG_7);
+    prog.mov(BPF_REG_7, BPF_REG_0);
+    prog.alui(BPF_RSH, BPF_REG_7, 16);
+    prog.alu(BPF_XOR, BPF_REG_0, BPF_REG_7);
+    prog.exit();
+}
+
+
+/*= Virtual Interface Implementation =========================================*/
+
+void VIfaceImpl::setSteering(steering_mode mode)
+{
+    ostringstream what;
+    BpfProgram prog;
+
+    switch (mode) {
+        case STEERING_KERNEL:
+            this->setSteeringProgram(-1);
+            this->steering = mode;
+            return;
+        case STEERING_FLOW:
+            build_flow(prog);
+            break;
+        case STEERING_VLAN:
+        case STEERING_MAC:
+            if (!this->tap) {
+                what << "--- Steering by VLAN or MAC address requires a tap";
+                what << " device, " << this->name << " is tun." << endl;
+                throw invalid_argument(what.str());
+            }
+            if (mode == STEERING_VLAN) {
+                build_vlan(prog);
+            } else {
+                build_mac(prog);
+            }
+            break;
+        default:
+            what << "--- Invalid steering mode (" << mode << ") for ";
+            what << this->name << "." << endl;
+            throw invalid_argument(what.str());
+    }
+
+    if (this->hooked) {
+        what << "--- Steering can't be changed on hooked interface ";
+        what << this->name << "." << endl;
+        throw invalid_argument(what.str());
+    }
+
+    // The device keeps its own reference to the program
+    int program = prog.load();
+    try {
+        this->setSteeringProgram(program);
+    } catch (...) {
+        close(program);
+        throw;
+    }
+    close(program);
+    this->steering = mode;
+}
+
+void VIfaceImpl::setSteeringProgram(int program)
+{
+    ostringstream what;
+
+    if (this->hooked) {
+        what << "--- Steering can't be changed on hooked interface ";
+        what << this->name << "." << endl;
+        throw invalid_argument(what.str());
+    }
+
+#ifdef TUNSETSTEERINGEBPF
+    // Any queue of the device can be used, -1 detaches the current program
+    if (ioctl(this->queues[0].rx, TUNSETSTEERINGEBPF, &program) < 0) {
+        what << "--- Unable to attach eBPF steering program to ";
+        what << this->name << "." << endl;
+        what << "    Error: " << strerror(errno);
+        what << " (" << errno << ")." << endl;
+        throw runtime_error(what.str());
+    }
+#else
+    what << "--- eBPF steering not supported by this build." << endl;
+    throw runtime_error(what.str());
+#endif
+
+    this->steering = program < 0 ? STEERING_KERNEL : STEERING_PROGRAM;
+}
+}
@@ -0,0 +1,674 @@
+/**
+ * Copyright (C) 2015 Hewlett Packard Enterprise Development LP
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include "viface/private/viface.hpp"
+
+#ifdef VIFACE_HAVE_IO_URING
+
+namespace viface
+{
+/*= Helpers ==================================================================*/
+
+// Operation a completion belongs to, stored in the low bits of the user data
+enum uring_op
+{
+    URING_READ = 0,
+    URING_WRITE = 1,
+    URING_IGNORE = 2,
+    URING_READ_NEXT = 3
+};
+
+static const unsigned uring_op_bits = 2;
+static const unsigned uring_op_mask = (1 << uring_op_bits) - 1;
+
+// Ring sizes. The completion queue is larger than the submission queue as
+// every interface keeps a read in flight.
+static const unsigned uring_sq_entries = 256;
+static const unsigned uring_cq_entries = 16384;
+
+// Size of the sparse fixed files and fixed buffers tables. Interfaces beyond
+// this number still work, using regular files and buffers.
+static const size_t uring_table_size = 16384;
+
+static int uring_setup(unsigned entries, struct io_uring_params* params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                       unsigned flags, void* arg, size_t argsz)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                   arg, argsz);
+}
+
+static int uring_register(int fd, unsigned opcode, void* arg,
+                          unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static uint64_t uring_data(size_t index, unsigned op)
+{
+    return ((uint64_t) index << uring_op_bits) | op;
+}
+
+
+/*= io_uring Engine ==========================================================*/
+
+UringEngine::UringEngine()
+{
+    ostringstream what;
+    struct io_uring_params params;
+
+    // Create the ring, cooperative task running is optional (>= 5.19)
+    memset(&params, 0, sizeof(struct io_uring_params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN;
+    params.cq_entries = uring_cq_entries;
+
+    this->ring_fd = uring_setup(uring_sq_entries, &params);
+    if (this->ring_fd < 0 && errno == EINVAL) {
+        memset(&params, 0, sizeof(struct io_uring_params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = uring_cq_entries;
+        this->ring_fd = uring_setup(uring_sq_entries, &params);
+    }
+
+    if (this->ring_fd < 0) {
+        what << "--- Unable to create io_uring instance." << endl;
+        what << "    Error: " << strerror(errno);
+        what << " (" << errno << ")." << endl;
+        throw runtime_error(what.str());
+    }
+
+    // Waiting with a timeout and never dropping completions is required
+    unsigned required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP |
+                        IORING_FEAT_EXT_ARG;
+    if ((params.features & required) != required) {
+        close(this->ring_fd);
+        what << "--- io_uring instance lacks required features." << endl;
+        what << "    Features: 0x" << hex << params.features << dec;
+        what << "." << endl;
+        throw runtime_error(what.str());
+    }
+
+    // Map submission and completion rings, and submission entries
+    this->ring_size = max(
+        params.sq_off.array + params.sq_entries * sizeof(unsigned),
+        params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+    this->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    void* ring = mmap(NULL, this->ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, this->ring_fd,
+                      IORING_OFF_SQ_RING);
+    void* sqes = MAP_FAILED;
+    if (ring != MAP_FAILED) {
+        sqes = mmap(NULL, this->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, this->ring_fd,
+                    IORING_OFF_SQES);
+    }
+
+    if (ring == MAP_FAILED || sqes == MAP_FAILED) {
+        what << "--- Unable to map io_uring rings." << endl;
+        what << "    Error: " << strerror(errno);
+        what << " (" << errno << ")." << endl;
+
+        if (ring != MAP_FAILED) {
+            munmap(ring, this->ring_size);
+        }
+        close(this->ring_fd);
+        throw runtime_error(what.str());
+    }
+
+    this->ring = (uint8_t*) ring;
+    this->sqes = (struct io_uring_sqe*) sqes;
+
+    this->sq_head = (unsigned*) (this->ring + params.sq_off.head);
+    this->sq_tail = (unsigned*) (this->ring + params.sq_off.tail);
+    this->sq_array = (unsigned*) (this->ring + params.sq_off.array);
+    this->sq_mask = *(unsigned*) (this->ring + params.sq_off.ring_mask);
+    this->sq_entries = params.sq_entries;
+    this->sqe_tail = *this->sq_tail;
+    this->to_submit = 0;
+
+    this->cq_head = (unsigned*) (this->ring + params.cq_off.head);
+    this->cq_tail = (unsigned*) (this->ring + params.cq_off.tail);
+    this->cq_mask = *(unsigned*) (this->ring + params.cq_off.ring_mask);
+    this->cqes = (struct io_uring_cqe*) (this->ring + params.cq_off.cqes);
+
+    // Register sparse tables for fixed files and buffers (>= 5.19). If
+    // not available, regular files and buffers are used.
+    struct io_uring_rsrc_register reg;
+    memset(&reg, 0, sizeof(struct io_uring_rsrc_register));
+    reg.nr = uring_table_size;
+    reg.flags = IORING_RSRC_REGISTER_SPARSE;
+
+    this->fixed_files = uring_register(this->ring_fd, IORING_REGISTER_FILES2,
+                                       &reg, sizeof(reg)) == 0;
+    this->fixed_buffers = uring_register(this->ring_fd,
+                                         IORING_REGISTER_BUFFERS2,
+                                         &reg, sizeof(reg)) == 0;
+
+    this->inflight = 0;
+    this->send_errors = 0;
+}
+
+UringEngine::~UringEngine()
+{
+    // Cancel every pending request, the kernel must not write into the
+    // buffers once they are released
+    if (this->inflight > 0) {
+        for (auto & slot : this->slots) {
+            slot.removed = true;
+        }
+
+        struct io_uring_sqe* sqe = this->getSQE();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY | IORING_ASYNC_CANCEL_ALL;
+        sqe->user_data = uring_data(0, URING_IGNORE);
+        this->inflight++;
+    }
+
+    // Wait for every request to complete
+    while (this->inflight > 0) {
+        int error = this->submit(1, 1000);
+        if (error != 0 && error != EINTR) {
+            break;
+        }
+        this->reap();
+    }
+
+    munmap(this->sqes, this->sqes_size);
+    munmap(this->ring, this->ring_size);
+    close(this->ring_fd);
+}
+
+struct io_uring_sqe* UringEngine::getSQE(unsigned needed)
+{
+    // Make room by submitting pending entries
+    if (this->to_submit + needed > this->sq_entries) {
+        this->submit(0, -1);
+    }
+
+    unsigned index = this->sqe_tail & this->sq_mask;
+    struct io_uring_sqe* sqe = &this->sqes[index];
+
+    this->sq_array[index] = index;
+    this->sqe_tail++;
+    this->to_submit++;
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    return sqe;
+}
+
+int UringEngine::submit(unsigned min_complete, int millis)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned flags = 0;
+
+    // Publish new entries
+    __atomic_store_n(this->sq_tail, this->sqe_tail, __ATOMIC_RELEASE);
+
+    memset(&arg, 0, sizeof(struct io_uring_getevents_arg));
+    if (min_complete > 0) {
+        flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+        if (millis >= 0) {
+            ts.tv_sec = millis / 1000;
+            ts.tv_nsec = (millis % 1000) * 1000000;
+            arg.ts = (uint64_t) &ts;
+        }
+    }
+
+    int error = 0;
+    while (true) {
+        int ret = uring_enter(this->ring_fd, this->to_submit, min_complete,
+                              flags, &arg, sizeof(arg));
+        if (ret < 0) {
+            error = errno;
+        }
+
+        // Completion queue is under pressure, consume some and retry
+        if (ret < 0 && (error == EBUSY || error == EAGAIN)) {
+            this->reap();
+            continue;
+        }
+        break;
+    }
+
+    // Kernel consumes entries in order, even on partial submission
+    this->to_submit = this->sqe_tail -
+                      __atomic_load_n(this->sq_head, __ATOMIC_ACQUIRE);
+    return error;
+}
+
+void UringEngine::reap()
+{
+    unsigned head = *this->cq_head;
+    unsigned tail = __atomic_load_n(this->cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++) {
+        struct io_uring_cqe* cqe = &this->cqes[head & this->cq_mask];
+        size_t index = cqe->user_data >> uring_op_bits;
+        unsigned op = cqe->user_data & uring_op_mask;
+        int res = cqe->res;
+
+        this->inflight--;
+
+        if (op == URING_READ || op == URING_READ_NEXT) {
+            uring_slot& slot = this->slots[index];
+            slot.results[op == URING_READ ? 0 : 1] = res;
+            slot.completed++;
+
+            // Wait for the whole chain
+            if (slot.completed == slot.posted) {
+                this->complete(index);
+            }
+        } else if (op == URING_WRITE) {
+            PacketBuffer buffer(move(this->writes[index]));
+            if (res < 0 || (size_t) res != buffer.getLength()) {
+                this->send_errors++;
+            }
+            this->free_writes.push_back(index);
+        }
+    }
+
+    __atomic_store_n(this->cq_head, head, __ATOMIC_RELEASE);
+}
+
+void UringEngine::complete(size_t index)
+{
+    uring_slot& slot = this->slots[index];
+    bool queued = false;
+
+    slot.inflight = false;
+
+    // Interface is being removed, do not re-post
+    if (slot.removed) {
+        return;
+    }
+
+    // Queue what was read, in order. Reads that found no packet (they are
+    // non-blocking) or were cancelled are skipped. Errors are reported in
+    // place, but not while reading is on hold.
+    for (unsigned part = 0; part < slot.posted; part++) {
+        int res = slot.results[part];
+
+        // Reading without waiting isn't supported by the file, a single
+        // read is posted from now on
+        if (part > 0 && res == -EOPNOTSUPP) {
+            slot.reads = 1;
+            continue;
+        }
+
+        if (res == -EAGAIN || res == -EINTR || res == -ECANCELED ||
+            (slot.held && res <= 0)) {
+            continue;
+        }
+
+        if (queued) {
+            this->ready.back().last = false;
+        }
+        this->ready.push_back({index, part, true});
+        queued = true;
+    }
+
+    // Nothing read, or the poll linked to the reads failed. Wait for
+    // readiness in the kernel and read again.
+    if (!queued && !slot.held) {
+        this->post(index, true);
+    }
+}
+
+void UringEngine::post(size_t index, bool poll)
+{
+    uring_slot& slot = this->slots[index];
+    struct io_uring_sqe* sqe = nullptr;
+    unsigned reads = slot.size == 0 ? 0 : slot.reads;
+
+    // Reserve every entry so the chain isn't split between submissions.
+    // Slots without a buffer only wait for readiness.
+    poll = poll || slot.size == 0;
+    unsigned needed = reads + (poll ? 1 : 0);
+
+    slot.posted = max(reads, 1u);
+    slot.completed = 0;
+    slot.inflight = true;
+
+    if (poll) {
+        sqe = this->getSQE(needed);
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->poll32_events = slot.events;
+        if (slot.file_index >= 0) {
+            sqe->fd = slot.file_index;
+            sqe->flags = IOSQE_FIXED_FILE;
+        } else {
+            sqe->fd = slot.fd;
+        }
+        this->inflight++;
+        needed = 1;
+
+        if (slot.size == 0) {
+            sqe->user_data = uring_data(index, URING_READ);
+            return;
+        }
+        sqe->flags |= IOSQE_IO_LINK;
+        sqe->user_data = uring_data(index, URING_IGNORE);
+    }
+
+    // A packet is a short read, which fails a regular link, so the reads
+    // are hard-linked, each one running after the previous. Only the first
+    // waits for a packet, the others just take what is already queued.
+    for (unsigned part = 0; part < reads; part++) {
+        sqe = this->getSQE(needed);
+        sqe->addr = (uint64_t) (slot.buffer.get() + part * slot.size);
+        sqe->len = slot.size;
+        sqe->off = (uint64_t) -1;
+        sqe->user_data = uring_data(index, part == 0 ? URING_READ :
+                                                       URING_READ_NEXT);
+        needed = 1;
+
+        if (slot.buf_index >= 0) {
+            sqe->opcode = IORING_OP_READ_FIXED;
+            sqe->buf_index = slot.buf_index;
+        } else {
+            sqe->opcode = IORING_OP_READ;
+        }
+
+        if (slot.file_index >= 0) {
+            sqe->fd = slot.file_index;
+            sqe->flags |= IOSQE_FIXED_FILE;
+        } else {
+            sqe->fd = slot.fd;
+        }
+
+        if (part > 0) {
+            sqe->rw_flags = RWF_NOWAIT;
+        }
+        if (part + 1 < reads) {
+            sqe->flags |= IOSQE_IO_HARDLINK;
+        }
+        this->inflight++;
+    }
+}
+
+void UringEngine::updateFile(int index, int fd)
+{
+    struct io_uring_rsrc_update2 update;
+    memset(&update, 0, sizeof(struct io_uring_rsrc_update2));
+    update.offset = index;
+    update.data = (uint64_t) &fd;
+    update.nr = 1;
+
+    if (uring_register(this->ring_fd, IORING_REGISTER_FILES_UPDATE2,
+                       &update, sizeof(update)) < 0) {
+        ostringstream what;
+        what << "--- Unable to update io_uring fixed file " << index;
+        what << "." << endl;
+        what << "    Error: " << strerror(errno);
+        what << " (" << errno << ")." << endl;
+        throw runtime_error(what.str());
+    }
+}
+
+void UringEngine::updateBuffer(int index, uint8_t* buffer, size_t size)
+{
+    struct iovec iov;
+    iov.iov_base = buffer;
+    iov.iov_len = size;
+
+    struct io_uring_rsrc_update2 update;
+    memset(&update, 0, sizeof(struct io_uring_rsrc_update2));
+    update.offset = index;
+    update.data = (uint64_t) &iov;
+    update.nr = 1;
+
+    if (uring_register(this->ring_fd, IORING_REGISTER_BUFFERS_UPDATE,
+                       &update, sizeof(update)) < 0) {
+        ostringstream what;
+        what << "--- Unable to update io_uring fixed buffer " << index;
+        what << "." << endl;
+        what << "    Error: " << strerror(errno);
+        what << " (" << errno << ")." << endl;
+        throw runtime_error(what.str());
+    }
+}
+
+size_t UringEngine::add(void* owner, int fd, size_t size, short events)
+{
+    size_t index;
+
+    if (!this->free_slots.empty()) {
+        index = this->free_slots.back();
+        this->free_slots.pop_back();
+    } else {
+        index = this->slots.size();
+        this->slots.emplace_back();
+    }
+
+    uring_slot& slot = this->slots[index];
+    slot.owner = owner;
+    slot.fd = fd;
+    slot.file_index = -1;
+    slot.buf_index = -1;
+    slot.buffer.reset(size > 0 ? new uint8_t[uring_reads * size] : nullptr);
+    slot.size = size;
+    slot.events = events;
+    slot.reads = uring_reads;
+    slot.posted = 0;
+    slot.completed = 0;
+    slot.inflight = false;
+    slot.removed = false;
+    slot.held = false;
+
+    try {
+        if (this->fixed_files && index < uring_table_size) {
+            this->updateFile(index, fd);
+            slot.file_index = index;
+        }
+        if (this->fixed_buffers && index < uring_table_size && size > 0) {
+            this->updateBuffer(index, slot.buffer.get(), uring_reads * size);
+            slot.buf_index = index;
+        }
+    } catch (...) {
+        if (slot.file_index >= 0) {
+            this->updateFile(slot.file_index, -1);
+        }
+        slot.owner = nullptr;
+        slot.buffer.reset();
+        this->free_slots.push_back(index);
+        throw;
+    }
+
+    // Pre-post the first reads
+    this->post(index, false);
+    return index;
+}
+
+void UringEngine::remove(size_t index)
+{
+    uring_slot& slot = this->slots[index];
+    slot.removed = true;
+
+    // Drop undelivered packets, if any
+    for (auto it = this->ready.begin(); it != this->ready.end();) {
+        it = it->index == index ? this->ready.erase(it) : it + 1;
+    }
+
+    // Pending reads must be over, their buffer can't be released before
+    this->cancel(index);
+
+    // Release fixed resources and slot
+    uring_slot& removed = this->slots[index];
+    if (removed.file_index >= 0) {
+        this->updateFile(removed.file_index, -1);
+    }
+    if (removed.buf_index >= 0) {
+        this->updateBuffer(removed.buf_index, NULL, 0);
+    }
+    removed.owner = nullptr;
+    removed.buffer.reset();
+    this->free_slots.push_back(index);
+}
+
+void UringEngine::cancel(size_t index)
+{
+    uring_slot& slot = this->slots[index];
+
+    // Cancel pending reads and wait for them. Other completions found
+    // meanwhile are kept for dispatch.
+    if (slot.inflight) {
+        struct io_uring_sqe* sqe = this->getSQE();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = slot.fd;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+        sqe->user_data = uring_data(0, URING_IGNORE);
+        this->inflight++;
+
+        while (this->slots[index].inflight) {
+            int error = this->submit(1, -1);
+            if (error != 0 && error != EINTR) {
+                ostringstream what;
+                what << "--- Unable to cancel io_uring read." << endl;
+                what << "    Error: " << strerror(error);
+                what << " (" << error << ")." << endl;
+                throw runtime_error(what.str());
+            }
+            this->reap();
+        }
+    }
+}
+
+bool UringEngine::hold(size_t index, uint8_t** data, ssize_t* result)
+{
+    this->slots[index].held = true;
+    this->cancel(index);
+
+    // Reads may have completed before being cancelled, their packets are
+    // handed over one at a time, in order
+    auto it = this->ready.begin();
+    while (it != this->ready.end() && it->index != index) {
+        it++;
+    }
+    if (it == this->ready.end()) {
+        return false;
+    }
+
+    uring_slot& slot = this->slots[index];
+    *data = slot.buffer.get() + it->part * slot.size;
+    *result = slot.results[it->part];
+    this->ready.erase(it);
+    return true;
+}
+
+void UringEngine::send(int fd, PacketBuffer const& buffer)
+{
+    size_t index;
+
+    if (!this->free_writes.empty()) {
+        index = this->free_writes.back();
+        this->free_writes.pop_back();
+        this->writes[index] = buffer;
+    } else {
+        index = this->writes.size();
+        this->writes.push_back(buffer);
+    }
+
+    // Queue the write, the buffer is kept alive until it completes
+    struct io_uring_sqe* sqe = this->getSQE();
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) buffer.getData();
+    sqe->len = buffer.getLength();
+    sqe->off = (uint64_t) -1;
+    sqe->user_data = uring_data(index, URING_WRITE);
+    this->inflight++;
+}
+
+void UringEngine::flush()
+{
+    if (this->to_submit > 0) {
+        this->submit(0, -1);
+    }
+    this->reap();
+}
+
+ssize_t UringEngine::wait(int millis)
+{
+    this->reap();
+
+    while (this->ready.empty()) {
+        int error = this->submit(1, millis);
+
+        // Timeout reached or signal caught
+        if (error == ETIME || error == EINTR) {
+            return 0;
+        }
+
+        if (error != 0) {
+            errno = error;
+            return -1;
+        }
+
+        this->reap();
+    }
+
+    // Submit re-posted reads and queued writes
+    if (this->to_submit > 0) {
+        this->submit(0, -1);
+    }
+
+    return this->ready.size();
+}
+
+bool UringEngine::pop(size_t* index, void** owner, uint8_t** data,
+                      ssize_t* result, bool* last, bool* busy)
+{
+    if (this->ready.empty()) {
+        return false;
+    }
+
+    uring_ready item = this->ready.front();
+    this->ready.pop_front();
+
+    // The slot is posted again once its last packet is dispatched. If the
+    // last read of the chain got a packet too, more are likely queued, as
+    // always when readiness is polled.
+    uring_slot& slot = this->slots[item.index];
+    *index = item.index;
+    *owner = slot.owner;
+    *data = slot.buffer.get() + item.part * slot.size;
+    *result = slot.results[item.part];
+    *last = item.last;
+    *busy = slot.size == 0 || slot.results[slot.posted - 1] > 0;
+    return true;
+}
+
+void UringEngine::rearm(size_t index, bool poll)
+{
+    uring_slot& slot = this->slots[index];
+
+    // Interface may have been removed (or even replaced) meanwhile
+    if (slot.owner == nullptr || slot.removed || slot.inflight) {
+        return;
+    }
+    slot.held = false;
+    this->post(index, poll);
+}
+}
+
+#endif // VIFACE_HAVE_IO_URING
@@ -179,9 +179,22 @@ err:
     throw runtime_error(what.str());
 }
 
-static string alloc_viface(string name, bool tap, struct viface_queues* queues)
+static uint8_t* scratch_buffer(size_t size)
 {
-    int i = 0;
+    // Reception buffer shared by all the interfaces used from this thread,
+    // so memory does not grow with the number of interfaces
+    thread_local vector<uint8_t> scratch;
+
+    if (scratch.size() < size) {
+        scratch.resize(size);
+    }
+    return scratch.data();
+}
+
+static string alloc_viface(string name, bool tap, uint count, uint flags,
+                          vector<struct viface_queues>& queues)
+{
+    uint i = 0;
     int fd = -1;
     ostringstream what;
 
@@ -191,6 +204,7 @@ static string alloc_viface(string name, bool tap, struct viface_queues* queues)
      *        IFF_TUN   - TUN device (layer 3, IP packet)
      *        IFF_NO_PI - Do not provide packet information
      *        IFF_MULTI_QUEUE - Create a queue of multiqueue device
+     *        IFF_VNET_HDR - Prepend a virtio_net_hdr to every packet
      */
     struct ifreq ifr;
     memset(&ifr, 0, sizeof(ifr));
@@ -201,11 +215,15 @@ static string alloc_viface(string name, bool tap, struct viface_queues* queues)
     } else {
         ifr.ifr_flags |= IFF_TUN;
     }
+    if (flags & FLAG_VNET_HDR) {
+        ifr.ifr_flags |= IFF_VNET_HDR;
+    }
 
     (void) strncpy(ifr.ifr_name, name.c_str(), IFNAMSIZ - 1);
 
-    // Allocate queues
-    for (i = 0; i < 2; i++) {
+    // Allocate queues. Each file descriptor is a kernel queue on its own, used
+    // both for reading and writing.
+    for (i = 0; i < count; i++) {
         // Open TUN/TAP device
         fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK);
         if (fd < 0) {
@@ -232,15 +250,44 @@ static string alloc_viface(string name, bool tap, struct viface_queues* queues)
             goto err;
         }
 
-        ((int *)queues)[i] = fd;
+        struct viface_queues queue;
+        memset(&queue, 0, sizeof(struct viface_queues));
+        queue.rx = fd;
+        queue.tx = fd;
+        queue.attached = true;
+        queues.push_back(queue);
+    }
+
+    // Let the kernel hand over unchecksummed and unsegmented packets
+    if (flags & FLAG_VNET_HDR) {
+        unsigned long offloads = TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6 |
+                                 TUN_F_TSO_ECN;
+        int result = -1;
+
+#ifdef TUN_F_USO4
+        // UDP segmentation is only known by recent kernels
+        result = ioctl(queues[0].rx, TUNSETOFFLOAD,
+                       offloads | TUN_F_USO4 | TUN_F_USO6);
+#endif
+        if (result != 0) {
+            result = ioctl(queues[0].rx, TUNSETOFFLOAD, offloads);
+        }
+
+        if (result != 0) {
+            what << "--- Unable to set offloads of TUN/TAP device." << endl;
+            what << "    Name: " << name << endl;
+            what << "    Error: " << strerror(errno);
+            what << " (" << errno << ")." << endl;
+            goto err;
+        }
     }
 
     return string(ifr.ifr_name);
 
 err:
     // Rollback close file descriptors
-    for (--i; i >= 0; i--) {
-        if (close(((int *)queues)[i]) < 0) {
+    for (auto & queue : queues) {
+        if (close(queue.rx) < 0) {
             what << "--- Unable to close a TUN/TAP device." << endl;
             what << "    Name: " << name << " Queue: " << i << endl;
             what << "    Error: " << strerror(errno);
@@ -251,7 +298,7 @@ err:
     throw runtime_error(what.str());
 }
 
-static void hook_viface(string name, struct viface_queues* queues)
+static void hook_viface(string name, uint flags, struct viface_queues* queues)
 {
     int i = 0;
     int fd = -1;
@@ -259,8 +306,10 @@ static void hook_viface(string name, struct viface_queues* queues)
 
     // Creates Tx/Rx sockets and allocates queues
     for (i = 0; i < 2; i++) {
-        // Creates the socket
-        fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+        // Creates the socket. Reception is non-blocking, as with tun/tap
+        // queues, so the dispatcher can drain it until empty.
+        fd = socket(AF_PACKET, SOCK_RAW | (i == 0 ? SOCK_NONBLOCK : 0),
+                    htons(ETH_P_ALL));
 
         if (fd < 0) {
             what << "--- Unable to create the Tx/Rx socket channel." << endl;
@@ -270,6 +319,33 @@ static void hook_viface(string name, struct viface_queues* queues)
             goto err;
         }
 
+        // Exchange a virtio_net_hdr with every packet
+        int vnet = 1;
+        if ((flags & FLAG_VNET_HDR) &&
+            setsockopt(fd, SOL_PACKET, PACKET_VNET_HDR, &vnet,
+                       sizeof(vnet)) != 0) {
+            what << "--- Unable to enable virtio net headers." << endl;
+            what << "    Name: " << name << " Queue: " << i << endl;
+            what << "    Error: " << strerror(errno);
+            what << " (" << errno << ")." << endl;
+            close(fd);
+            goto err;
+        }
+
+        // Reception skips outgoing frames, transmission skips the qdisc
+        int option = i == 0 ? PACKET_IGNORE_OUTGOING : PACKET_QDISC_BYPASS;
+        uint enabled = i == 0 ? FLAG_IGNORE_OUTGOING : FLAG_QDISC_BYPASS;
+        int value = 1;
+        if ((flags & enabled) &&
+            setsockopt(fd, SOL_PACKET, option, &value, sizeof(value)) != 0) {
+            what << "--- Unable to set the packet socket options." << endl;
+            what << "    Name: " << name << " Queue: " << i << endl;
+            what << "    Error: " << strerror(errno);
+            what << " (" << errno << ")." << endl;
+            close(fd);
+            goto err;
+        }
+
         struct ifreq ifr;
         memset(&ifr, 0, sizeof(ifr));
 
@@ -321,40 +397,213 @@ err:
     throw runtime_error(what.str());
 }
 
+static void fanout_viface(string name, uint flags, uint count,
+                          vector<struct viface_queues>& queues)
+{
+    ostringstream what;
+    int mode = PACKET_FANOUT_HASH;
+
+    /* Select how frames are spread across the sockets of the group
+     *
+     * Modes: PACKET_FANOUT_HASH - By flow hash (default)
+     *        PACKET_FANOUT_CPU - By CPU the frame was received on
+     *        PACKET_FANOUT_LB - Round-robin
+     *        PACKET_FANOUT_ROLLOVER - Fill a socket before moving to the next
+     */
+    if (flags & FLAG_FANOUT_CPU) {
+        mode = PACKET_FANOUT_CPU;
+    } else if (flags & FLAG_FANOUT_LB) {
+        mode = PACKET_FANOUT_LB;
+    } else if (flags & FLAG_FANOUT_ROLLOVER) {
+        mode = PACKET_FANOUT_ROLLOVER;
+    }
+
+    // The first socket creates a group with an unused id, the others join it
+    int fanout = (mode | PACKET_FANOUT_FLAG_UNIQUEID) << 16;
+
+    for (uint i = 0; i < count; i++) {
+        struct viface_queues queue;
+        memset(&queue, 0, sizeof(struct viface_queues));
+
+        try {
+            hook_viface(name, flags, &queue);
+        } catch (runtime_error const& ex) {
+            what << ex.what();
+            goto err;
+        }
+        queue.attached = true;
+        queues.push_back(queue);
+
+        if (setsockopt(queue.rx, SOL_PACKET, PACKET_FANOUT, &fanout,
+                       sizeof(fanout)) != 0) {
+            what << "--- Unable to join the fanout group of " << name;
+            what << "." << endl;
+            what << "    Queue: " << i << "." << endl;
+            what << "    Error: " << strerror(errno);
+            what << " (" << errno << ")." << endl;
+            goto err;
+        }
+
+        if (i == 0) {
+            socklen_t optlen = sizeof(fanout);
+            if (getsockopt(queue.rx, SOL_PACKET, PACKET_FANOUT, &fanout,
+                           &optlen) != 0) {
+                what << "--- Unable to get the fanout group of " << name;
+                what << "." << endl;
+                what << "    Error: " << strerror(errno);
+                what << " (" << errno << ")." << endl;
+                goto err;
+            }
+        }
+    }
+
+    return;
+
+err:
+    // Rollback close file descriptors
+    for (auto & queue : queues) {
+        close(queue.rx);
+        close(queue.tx);
+    }
+    queues.clear();
+
+    throw runtime_error(what.str());
+}
+
 
 /*= Virtual Interface Implementation =========================================*/
 
 uint VIfaceImpl::idseq = 0;
 
-VIfaceImpl::VIfaceImpl(string name, bool tap, int id)
+VIfaceImpl::VIfaceImpl(string name, bool tap, int id, uint queues,
+                       uint flags)
 {
     // Check name length
     if (name.length() >= IFNAMSIZ) {
         throw invalid_argument("--- Virtual interface name too long.");
     }
 
-    // Create queues
-    struct viface_queues queues;
-    memset(&queues, 0, sizeof(struct viface_queues));
+    // Check number of queues
+    if (queues == 0) {
+        throw invalid_argument("--- Virtual interface needs a queue.");
+    }
 
     /* Checks if the path name can be accessed. If so,
      * it means that the network interface is already defined.
      */
     if (access(("/sys/class/net/" + name).c_str(), F_OK) == 0) {
-        hook_viface(name, &queues);
+        if ((flags & FLAG_XDP) && (flags & fanout_flags)) {
+            ostringstream what;
+            what << "--- Fanout modes are not supported by the XDP backend,";
+            what << " hooking " << name << "." << endl;
+            throw invalid_argument(what.str());
+        }
+
+        // Frames are redirected by the device queue they were received on,
+        // so every one of them needs its socket
+        if (flags & FLAG_XDP) {
+            uint device = XdpRedirect::getQueues(name);
+            if (queues != device) {
+                ostringstream what;
+                what << "--- The XDP backend needs a queue for each receive";
+                what << " queue of the device, hooking " << name << ".";
+                what << endl;
+                what << "    Queues: " << queues << ", device has ";
+                what << device << "." << endl;
+                throw invalid_argument(what.str());
+            }
+        }
+
+        uint fanout = flags & fanout_flags;
+        if (fanout & (fanout - 1)) {
+            ostringstream what;
+            what << "--- Only one fanout mode can be selected, hooking ";
+            what << name << "." << endl;
+            throw invalid_argument(what.str());
+        }
+
+        if ((flags & FLAG_XDP) && (flags & FLAG_VNET_HDR)) {
+            ostringstream what;
+            what << "--- Virtio net headers are not supported by the XDP";
+            what << " backend, hooking " << name << "." << endl;
+            throw invalid_argument(what.str());
+        }
+
+        if ((flags & FLAG_XDP) && (flags & socket_flags)) {
+            ostringstream what;
+            what << "--- Packet socket options are not supported by the XDP";
+            what << " backend, hooking " << name << "." << endl;
+            throw invalid_argument(what.str());
+        }
+
+        // Multiple queues share the received frames through a fanout group,
+        // XDP sockets get those of their device queue
+        if (flags & FLAG_XDP) {
+            for (uint i = 0; i < queues; i++) {
+                this->xsks.emplace_back(new XdpSocket(name, i));
+
+                struct viface_queues queue;
+                memset(&queue, 0, sizeof(struct viface_queues));
+                queue.rx = this->xsks[i]->getFD();
+                queue.tx = queue.rx;
+                queue.attached = true;
+                this->queues.push_back(queue);
+            }
+            this->xdp.reset(new XdpRedirect(name, this->xsks));
+        } else if (queues > 1 || fanout != 0) {
+            fanout_viface(name, flags, queues, this->queues);
+        } else {
+            struct viface_queues queue;
+            memset(&queue, 0, sizeof(struct viface_queues));
+            hook_viface(name, flags, &queue);
+            queue.attached = true;
+            this->queues.push_back(queue);
+        }
         this->name = name;
+        this->hooked = true;
 
-        // Read MTU value and resize buffer
+        // Read MTU value
         this->mtu = read_mtu(name, sizeof(this->mtu));
-        this->pktbuff.resize(this->mtu);
+
+        // Frames transmitted from now on are ignored
+        this->outgoing_base = 0;
+        if (flags & FLAG_IGNORE_OUTGOING) {
+            this->outgoing_base = this->readStatFile("tx_packets");
+        }
     } else {
-        this->name = alloc_viface(name, tap, &queues);
+        if (flags & FLAG_XDP) {
+            ostringstream what;
+            what << "--- The XDP backend can only hook existing interfaces,";
+            what << " " << name << " doesn't exist." << endl;
+            throw invalid_argument(what.str());
+        }
+
+        if (flags & fanout_flags) {
+            ostringstream what;
+            what << "--- Fanout modes can only be used when hooking existing";
+            what << " interfaces, " << name << " doesn't exist." << endl;
+            throw invalid_argument(what.str());
+        }
+
+        if (flags & socket_flags) {
+            ostringstream what;
+            what << "--- Packet socket options can only be used when hooking";
+            what << " existing interfaces, " << name << " doesn't exist.";
+            what << endl;
+            throw invalid_argument(what.str());
+        }
+
+        this->name = alloc_viface(name, tap, queues, flags, this->queues);
+        this->hooked = false;
 
         // Other defaults
         this->mtu = 1500;
+        this->outgoing_base = 0;
     }
 
-    this->queues = queues;
+    this->tap = tap;
+    this->flags = flags;
+    this->steering = STEERING_KERNEL;
 
     // Create socket channels to the NET kernel for later ioctl
     this->kernel_socket = -1;
@@ -390,8 +639,31 @@ VIfaceImpl::VIfaceImpl(string name, bool tap, int id)
 
 VIfaceImpl::~VIfaceImpl()
 {
-    if (close(this->queues.rx) ||
-        close(this->queues.tx) ||
+    bool failed = false;
+
+    // XDP sockets are released along with the rest of their backend, once
+    // the program redirecting to them is detached
+    if (!this->xsks.empty()) {
+        this->xdp.reset();
+        this->xsks.clear();
+        this->queues.clear();
+    }
+
+    // Hooked interfaces use different sockets for each direction
+    for (auto & queue : this->queues) {
+        for (auto ring : {&queue.rx_ring, &queue.tx_ring}) {
+            if (ring->map != nullptr) {
+                failed |= munmap(ring->map,
+                                 ring->blocks * ring->block_size) != 0;
+            }
+        }
+        failed |= close(queue.rx) != 0;
+        if (queue.tx != queue.rx) {
+            failed |= close(queue.tx) != 0;
+        }
+    }
+
+    if (failed ||
         close(this->kernel_socket) ||
         close(this->kernel_socket_ipv6)) {
         ostringstream what;
@@ -643,6 +915,25 @@ uint VIfaceImpl::getMTU() const
     return ifr.ifr_mtu;
 }
 
+uint VIfaceImpl::getIndex() const
+{
+    struct ifreq ifr;
+
+    memset(&ifr, 0, sizeof(struct ifreq));
+    (void) strncpy(ifr.ifr_name, this->name.c_str(), IFNAMSIZ - 1);
+
+    if (ioctl(this->kernel_socket, SIOCGIFINDEX, &ifr) != 0) {
+        ostringstream what;
+        what << "--- Unable to get network index number of ";
+        what << this->name << "." << endl;
+        what << "    Error: " << strerror(errno);
+        what << " (" << errno << ")." << endl;
+        throw runtime_error(what.str());
+    }
+
+    return ifr.ifr_ifindex;
+}
+
 void VIfaceImpl::up()
 {
     ostringstream what;
@@ -779,7 +1070,6 @@ void VIfaceImpl::up()
         what << " (" << errno << ")." << endl;
         throw runtime_error(what.str());
     }
-    this->pktbuff.resize(this->mtu);
 
     // Bring-up interface
     ifr.ifr_flags |= IFF_UP;
@@ -823,10 +1113,189 @@ bool VIfaceImpl::isUp() const
     return (ifr.ifr_flags & IFF_UP) != 0;
 }
 
-vector<uint8_t> VIfaceImpl::receive()
+struct viface_queues const& VIfaceImpl::getQueue(uint queue) const
+{
+    if (queue >= this->queues.size()) {
+        ostringstream what;
+        what << "--- Invalid queue " << queue << " for " << this->name;
+        what << " (" << this->queues.size() << " queues)." << endl;
+        throw invalid_argument(what.str());
+    }
+
+    return this->queues[queue];
+}
+
+void VIfaceImpl::setAttached(uint queue, bool attached)
+{
+    ostringstream what;
+    struct viface_queues const& selected = this->getQueue(queue);
+
+    if (this->hooked) {
+        what << "--- Queues of hooked interface " << this->name;
+        what << " can't be attached or detached." << endl;
+        throw invalid_argument(what.str());
+    }
+
+    if (selected.attached == attached) {
+        return;
+    }
+
+    /* Attach or detach the queue from the device
+     *
+     * Flags: IFF_ATTACH_QUEUE - Resume receiving flows on this queue
+     *        IFF_DETACH_QUEUE - Stop receiving flows on this queue
+     */
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    ifr.ifr_flags = attached ? IFF_ATTACH_QUEUE : IFF_DETACH_QUEUE;
+
+    if (ioctl(selected.rx, TUNSETQUEUE, (void *)&ifr) != 0) {
+        what << "--- Unable to " << (attached ? "attach" : "detach");
+        what << " queue " << queue << " of " << this->name << "." << endl;
+        what << "    Error: " << strerror(errno);
+        what << " (" << errno << ")." << endl;
+        throw runtime_error(what.str());
+    }
+
+    this->queues[queue].attached = attached;
+}
+
+bool VIfaceImpl::isAttached(uint queue) const
+{
+    return this->getQueue(queue).attached;
+}
+
+ssize_t VIfaceImpl::readPacket(int fd, uint8_t* buffer, size_t size,
+                               vnet_header* header) const
+{
+    if (this->getHeaderSize() == 0) {
+        if (header != nullptr) {
+            memset(header, 0, sizeof(vnet_header));
+        }
+        return read(fd, buffer, size);
+    }
+
+    // Header comes first, keep it apart from the packet
+    vnet_header discarded;
+    struct iovec iovecs[2];
+    iovecs[0].iov_base = header != nullptr ? header : &discarded;
+    iovecs[0].iov_len = sizeof(vnet_header);
+    iovecs[1].iov_base = buffer;
+    iovecs[1].iov_len = size;
+
+    ssize_t nread = readv(fd, iovecs, 2);
+    if (nread < (ssize_t) sizeof(vnet_header)) {
+        return nread < 0 ? nread : 0;
+    }
+    return nread - sizeof(vnet_header);
+}
+
+ssize_t VIfaceImpl::writePacket(int fd, struct iovec* iovecs, size_t count,
+                                vnet_header const* header) const
+{
+    // The first iovec is reserved for the header
+    vnet_header none;
+    if (this->getHeaderSize() == 0) {
+        iovecs++;
+        count--;
+    } else {
+        if (header == nullptr) {
+            memset(&none, 0, sizeof(vnet_header));
+            header = &none;
+        }
+        iovecs[0].iov_base = const_cast<vnet_header*>(header);
+        iovecs[0].iov_len = sizeof(vnet_header);
+    }
+
+    ssize_t written;
+    if (this->hooked) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(struct msghdr));
+        msg.msg_iov = iovecs;
+        msg.msg_iovlen = count;
+
+        written = sendmsg(fd, &msg, 0);
+    } else {
+        written = writev(fd, iovecs, count);
+    }
+
+    if (this->getHeaderSize() == 0) {
+        return written;
+    }
+    if (written < (ssize_t) sizeof(vnet_header)) {
+        return written < 0 ? written : 0;
+    }
+    return written - sizeof(vnet_header);
+}
+
+vector<uint8_t> VIfaceImpl::receive(uint queue)
+{
+    // Read packet into the per-thread buffer
+    size_t size = this->getFrameSize();
+    uint8_t* buffer = scratch_buffer(size);
+    size_t nread = this->receive(buffer, size, nullptr, queue);
+
+    // Copy packet from buffer and return
+    vector<uint8_t> packet(nread);
+    packet.assign(buffer, buffer + nread);
+    return packet;
+}
+
+size_t VIfaceImpl::receive(uint8_t* buffer, size_t size, uint queue)
+{
+    return this->receive(buffer, size, nullptr, queue);
+}
+
+size_t VIfaceImpl::receive(uint8_t* buffer, size_t size, vnet_header* header,
+                           uint queue)
 {
-    // Read packet into our buffer
-    int nread = read(this->queues.rx, &(this->pktbuff[0]), this->mtu);
+    size_t length;
+    io_status status = this->tryReceive(buffer, size, header, &length, queue);
+
+    if (status == IO_OK || status == IO_AGAIN) {
+        return length;
+    }
+
+    // Tell why the request is invalid
+    if (status == IO_INVALID) {
+        this->checkRead(queue);
+    }
+
+    // Something bad happened
+    ostringstream what;
+    what << "--- IO error while reading from " << this->name;
+    what << "." << endl;
+    what << "    Error: " << strerror(errno);
+    what << " (" << errno << ")." << endl;
+    throw runtime_error(what.str());
+}
+
+io_status VIfaceImpl::tryReceive(uint8_t* buffer, size_t size,
+                                 vnet_header* header, size_t* length,
+                                 uint queue) noexcept
+{
+    *length = 0;
+
+    // Queues with a reception ring deliver their frames through it
+    if (!this->isValidQueue(queue) ||
+        this->queues[queue].rx_ring.map != nullptr) {
+        errno = EINVAL;
+        return IO_INVALID;
+    }
+
+    int fd = this->queues[queue].rx;
+    XdpSocket* xsk = this->getXdp(queue);
+
+    // Read packet directly into caller's buffer
+    ssize_t nread;
+    if (xsk != nullptr) {
+        if (header != nullptr) {
+            memset(header, 0, sizeof(vnet_header));
+        }
+        nread = xsk->receive(buffer, size);
+    } else {
+        nread = this->readPacket(fd, buffer, size, header);
+    }
 
     // Handle errors
     if (nread == -1) {
@@ -846,29 +1315,151 @@ vector<uint8_t> VIfaceImpl::receive()
         // as ready" warns it, and so, it better to do this that to have
         // an application that frozes for no apparent reason.
         //
-        if (errno == EAGAIN) {
-            return vector<uint8_t>(0);
+        return errno == EAGAIN ? IO_AGAIN : IO_ERROR;
+    }
+
+    *length = nread;
+    return IO_OK;
+}
+
+size_t VIfaceImpl::receiveBatch(packet_buffer* buffers, size_t count,
+                                uint queue)
+{
+    size_t received;
+    io_status status = this->tryReceiveBatch(buffers, count, &received,
+                                             queue);
+
+    if (status == IO_OK || status == IO_AGAIN) {
+        return received;
+    }
+
+    // Tell why the request is invalid
+    if (status == IO_INVALID) {
+        this->checkRead(queue);
+    }
+
+    ostringstream what;
+    what << "--- IO error while reading from " << this->name;
+    what << "." << endl;
+    what << "    Error: " << strerror(errno);
+    what << " (" << errno << ")." << endl;
+    throw runtime_error(what.str());
+}
+
+io_status VIfaceImpl::tryReceiveBatch(packet_buffer* buffers, size_t count,
+                                      size_t* nreceived, uint queue) noexcept
+{
+    *nreceived = 0;
+
+    // Queues with a reception ring deliver their frames through it
+    if (!this->isValidQueue(queue) ||
+        this->queues[queue].rx_ring.map != nullptr) {
+        errno = EINVAL;
+        return IO_INVALID;
+    }
+
+    int fd = this->queues[queue].rx;
+    XdpSocket* xsk = this->getXdp(queue);
+    size_t received = 0;
+
+    if (xsk != nullptr) {
+        // Frames are copied out of the UMEM
+        received = xsk->receiveBatch(buffers, count);
+    } else if (this->hooked) {
+        // Drain the socket with as few recvmmsg() calls as possible. Virtio
+        // net headers, if any, are received apart and discarded.
+        struct mmsghdr msgs[batch_max];
+        struct iovec iovecs[batch_max][2];
+        vnet_header headers[batch_max];
+        size_t skip = this->getHeaderSize();
+        size_t first = skip > 0 ? 0 : 1;
+
+        while (received < count) {
+            size_t chunk = min(count - received, batch_max);
+
+            memset(msgs, 0, sizeof(struct mmsghdr) * chunk);
+            for (size_t i = 0; i < chunk; i++) {
+                iovecs[i][0].iov_base = &headers[i];
+                iovecs[i][0].iov_len = sizeof(vnet_header);
+                iovecs[i][1].iov_base = buffers[received + i].data;
+                iovecs[i][1].iov_len = buffers[received + i].size;
+                msgs[i].msg_hdr.msg_iov = &iovecs[i][first];
+                msgs[i].msg_hdr.msg_iovlen = 2 - first;
+            }
+
+            int nmsgs = recvmmsg(fd, msgs, chunk,
+                                 MSG_DONTWAIT, NULL);
+            if (nmsgs == -1) {
+                break;
+            }
+
+            for (int i = 0; i < nmsgs; i++) {
+                buffers[received + i].length =
+                    msgs[i].msg_len - min((size_t) msgs[i].msg_len, skip);
+            }
+            received += nmsgs;
+
+            // Socket is empty
+            if ((size_t) nmsgs < chunk) {
+                *nreceived = received;
+                return IO_OK;
+            }
+        }
+    } else {
+        // Read until the queue is empty or there are no more buffers
+        while (received < count) {
+            ssize_t nread = this->readPacket(fd, buffers[received].data,
+                                             buffers[received].size,
+                                             nullptr);
+            if (nread == -1) {
+                break;
+            }
+            buffers[received].length = nread;
+            received++;
         }
+    }
 
-        // Something bad happened
-        ostringstream what;
-        what << "--- IO error while reading from " << this->name;
-        what << "." << endl;
-        what << "    Error: " << strerror(errno);
-        what << " (" << errno << ")." << endl;
-        throw runtime_error(what.str());
+    // Nothing else pending (non-blocking). See receive() comments about this.
+    // Errors are reported only if nothing was received, otherwise the next
+    // call will find them again.
+    *nreceived = received;
+    if (received > 0 || count == 0) {
+        return IO_OK;
     }
+    return errno == EAGAIN ? IO_AGAIN : IO_ERROR;
+}
 
-    // Copy packet from buffer and return
-    vector<uint8_t> packet(nread);
-    packet.assign(&(this->pktbuff[0]), &(this->pktbuff[nread]));
-    return packet;
+size_t VIfaceImpl::receive(PacketBuffer& buffer, vnet_header* header,
+                           uint queue)
+{
+    buffer.reset();
+
+    size_t nread = this->receive(buffer.getData(), buffer.getCapacity(),
+                                 header, queue);
+    buffer.setLength(nread);
+    return nread;
 }
 
-void VIfaceImpl::send(vector<uint8_t>& packet) const
+bool VIfaceImpl::isValidSize(size_t size, bool gso) const
+{
+    if (size < ETH_HLEN) {
+        return false;
+    }
+
+    // Super-frames are segmented by the kernel
+    if (gso && this->getHeaderSize() > 0) {
+        return size <= gso_frame_max;
+    }
+    return size <= this->mtu;
+}
+
+void VIfaceImpl::checkSize(size_t size, bool gso) const
 {
     ostringstream what;
-    int size = packet.size();
+
+    if (this->isValidSize(size, gso)) {
+        return;
+    }
 
     if (size < ETH_HLEN) {
         what << "--- Packet too small (" << size << ") ";
@@ -876,23 +1467,266 @@ void VIfaceImpl::send(vector<uint8_t>& packet) const
         throw invalid_argument(what.str());
     }
 
+    // Super-frames are segmented by the kernel
+    if (gso && this->getHeaderSize() > 0) {
+        if (size > gso_frame_max) {
+            what << "--- Packet too large (" << size << ") ";
+            what << "for segmentation offload (> " << gso_frame_max;
+            what << ")." << endl;
+            throw invalid_argument(what.str());
+        }
+        return;
+    }
+
     if (size > this->mtu) {
         what << "--- Packet too large (" << size << ") ";
         what << "for current MTU (> " << this->mtu << ")." << endl;
         throw invalid_argument(what.str());
     }
+}
+
+void VIfaceImpl::send(vector<uint8_t>& packet, uint queue) const
+{
+    packet_segment segment = {packet.data(), packet.size()};
+    this->send(&segment, 1, nullptr, queue);
+}
 
-    // Write packet to TX queue
-    int written = write(this->queues.tx, &packet[0], size);
+size_t VIfaceImpl::sendBatch(packet_buffer const* buffers, size_t count,
+                             uint queue) const
+{
+    size_t sent;
+    io_status status = this->trySendBatch(buffers, count, &sent, queue);
 
-    if (written != size) {
-        what << "--- IO error while writting to " << this->name;
-        what << "." << endl;
-        what << "    Error: " << strerror(errno);
-        what << " (" << errno << ")." << endl;
-        throw runtime_error(what.str());
+    if (status == IO_OK || status == IO_AGAIN) {
+        return sent;
     }
-    return;
+
+    // Tell why the request is invalid
+    if (status == IO_INVALID) {
+        this->getQueue(queue);
+        for (size_t i = 0; i < count; i++) {
+            this->checkSize(buffers[i].length);
+        }
+    }
+
+    ostringstream what;
+    what << "--- IO error while writting to " << this->name;
+    what << "." << endl;
+    what << "    Error: " << strerror(errno);
+    what << " (" << errno << ")." << endl;
+    throw runtime_error(what.str());
+}
+
+io_status VIfaceImpl::trySendBatch(packet_buffer const* buffers, size_t count,
+                                   size_t* nsent, uint queue) const noexcept
+{
+    *nsent = 0;
+
+    // Validate all packets before sending any of them
+    if (!this->isValidQueue(queue)) {
+        errno = EINVAL;
+        return IO_INVALID;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (!this->isValidSize(buffers[i].length)) {
+            errno = EMSGSIZE;
+            return IO_INVALID;
+        }
+    }
+
+    int fd = this->queues[queue].tx;
+    size_t sent = 0;
+
+    if (this->getXdp(queue) != nullptr) {
+        // Frames are copied into the UMEM and sent at once
+        sent = this->getXdp(queue)->sendBatch(buffers, count);
+    } else if (this->queues[queue].tx_ring.map != nullptr) {
+        // Copy the packets into the transmission ring, one kick per chunk
+        packet_buffer slots[batch_max];
+
+        while (sent < count) {
+            size_t chunk = min(count - sent, batch_max);
+            size_t acquired = this->acquireSlots(slots, chunk, queue);
+            size_t filled = 0;
+
+            while (filled < acquired &&
+                   buffers[sent + filled].length <= slots[filled].size) {
+                memcpy(slots[filled].data, buffers[sent + filled].data,
+                       buffers[sent + filled].length);
+                slots[filled].length = buffers[sent + filled].length;
+                filled++;
+            }
+            // Frames are handed over even if the kick fails
+            int kicked = this->flushSlots(slots, filled, queue);
+            sent += filled;
+            if (kicked < 0) {
+                break;
+            }
+
+            // Ring is full, or a packet doesn't fit in a slot
+            if (filled < chunk) {
+                errno = filled < acquired ? EMSGSIZE : ENOBUFS;
+                break;
+            }
+        }
+    } else if (this->hooked) {
+        // Push the packets with as few sendmmsg() calls as possible. Virtio
+        // net headers, if any, are empty.
+        struct mmsghdr msgs[batch_max];
+        struct iovec iovecs[batch_max][2];
+        vnet_header none;
+        size_t first = this->getHeaderSize() > 0 ? 0 : 1;
+
+        memset(&none, 0, sizeof(vnet_header));
+
+        while (sent < count) {
+            size_t chunk = min(count - sent, batch_max);
+
+            memset(msgs, 0, sizeof(struct mmsghdr) * chunk);
+            for (size_t i = 0; i < chunk; i++) {
+                iovecs[i][0].iov_base = &none;
+                iovecs[i][0].iov_len = sizeof(vnet_header);
+                iovecs[i][1].iov_base = buffers[sent + i].data;
+                iovecs[i][1].iov_len = buffers[sent + i].length;
+                msgs[i].msg_hdr.msg_iov = &iovecs[i][first];
+                msgs[i].msg_hdr.msg_iovlen = 2 - first;
+            }
+
+            int nmsgs = sendmmsg(fd, msgs, chunk, MSG_DONTWAIT);
+            if (nmsgs == -1) {
+                break;
+            }
+            sent += nmsgs;
+
+            // Socket is full
+            if ((size_t) nmsgs < chunk) {
+                *nsent = sent;
+                return IO_OK;
+            }
+        }
+    } else {
+        // Write until the queue is full or there are no more packets
+        struct iovec iovecs[2];
+
+        while (sent < count) {
+            iovecs[1].iov_base = buffers[sent].data;
+            iovecs[1].iov_len = buffers[sent].length;
+
+            ssize_t written = this->writePacket(fd, iovecs, 2, nullptr);
+            if (written != (ssize_t) buffers[sent].length) {
+                // Packets are never split, a short write is an error
+                if (written >= 0) {
+                    errno = EIO;
+                }
+                break;
+            }
+            sent++;
+        }
+    }
+
+    // Kernel queue is full (non-blocking). Errors are reported only if
+    // nothing was sent, otherwise the next call will find them again.
+    *nsent = sent;
+    if (sent > 0 || count == 0) {
+        return IO_OK;
+    }
+    return errno == EAGAIN || errno == ENOBUFS ? IO_AGAIN : IO_ERROR;
+}
+
+void VIfaceImpl::send(packet_segment const* segments, size_t count,
+                      uint queue) const
+{
+    this->send(segments, count, nullptr, queue);
+}
+
+void VIfaceImpl::send(packet_segment const* segments, size_t count,
+                      vnet_header const* header, uint queue) const
+{
+    ostringstream what;
+    io_status status = this->trySend(segments, count, header, queue);
+
+    if (status == IO_OK) {
+        return;
+    }
+
+    // Tell why the request is invalid
+    if (status == IO_INVALID) {
+        this->getQueue(queue);
+
+        size_t limit = this->getSegmentLimit();
+        if (count > limit) {
+            what << "--- Too many segments (" << count << ") ";
+            what << "for a single packet (> " << limit << ")." << endl;
+            throw invalid_argument(what.str());
+        }
+
+        size_t size = 0;
+        for (size_t i = 0; i < count; i++) {
+            size += segments[i].length;
+        }
+        this->checkSize(size, header != nullptr &&
+                        header->gso_type != VNET_HDR_GSO_NONE);
+    }
+
+    what << "--- IO error while writting to " << this->name;
+    what << "." << endl;
+    what << "    Error: " << strerror(errno);
+    what << " (" << errno << ")." << endl;
+    throw runtime_error(what.str());
+}
+
+io_status VIfaceImpl::trySend(packet_segment const* segments, size_t count,
+                              vnet_header const* header,
+                              uint queue) const noexcept
+{
+    if (!this->isValidQueue(queue) || count > this->getSegmentLimit()) {
+        errno = EINVAL;
+        return IO_INVALID;
+    }
+
+    int fd = this->queues[queue].tx;
+    ssize_t size = 0;
+
+    // Gather segments, leaving room for the header
+    struct iovec iovecs[count + 1];
+    for (size_t i = 0; i < count; i++) {
+        iovecs[i + 1].iov_base = const_cast<uint8_t*>(segments[i].data);
+        iovecs[i + 1].iov_len = segments[i].length;
+        size += segments[i].length;
+    }
+
+    if (!this->isValidSize(size, header != nullptr &&
+                           header->gso_type != VNET_HDR_GSO_NONE)) {
+        errno = EMSGSIZE;
+        return IO_INVALID;
+    }
+
+    // Write packet to TX queue, or its transmission ring
+    ssize_t written;
+    if (this->getXdp(queue) != nullptr) {
+        written = this->getXdp(queue)->send(&iovecs[1], count);
+    } else if (this->queues[queue].tx_ring.map != nullptr) {
+        written = this->writeRing(&iovecs[1], count, queue);
+    } else {
+        written = this->writePacket(fd, iovecs, count + 1, header);
+    }
+
+    if (written == size) {
+        return IO_OK;
+    }
+
+    // Packets are never split, a short write is an error
+    if (written >= 0) {
+        errno = EIO;
+    }
+    return errno == EAGAIN || errno == ENOBUFS ? IO_AGAIN : IO_ERROR;
+}
+
+void VIfaceImpl::send(PacketBuffer const& buffer, vnet_header const* header,
+                      uint queue) const
+{
+    packet_segment segment = {buffer.getData(), buffer.getLength()};
+    this->send(&segment, 1, header, queue);
 }
 
 std::set<std::string> VIfaceImpl::listStats()
@@ -999,112 +1833,52 @@ void VIfaceImpl::clearStat(std::string const& stat)
     return;
 }
 
-
-void dispatch(set<VIface*>& ifaces, dispatcher_cb callback, int millis)
+uint64_t VIfaceImpl::getIgnoredOutgoing()
 {
-    int fd = -1;
-    int fdsread = -1;
-    int nfds = -1;
-    struct timeval tv;
-    struct timeval* tvp = NULL;
-
-    // Check non-empty set
-    if (ifaces.empty()) {
-        ostringstream what;
-        what << "--- Empty virtual interfaces set" << endl;
-        throw invalid_argument(what.str());
-    }
-
-    // Setup timeout
-    if (millis >= 0) {
-        tvp = &tv;
-    }
-
-    // Store mapping between file descriptors and interface it belongs
-    map<int,VIface*> reverse_id;
-
-    // Create and clear set of file descriptors
-    fd_set rfds;
-
-    // Create map of file descriptors and get maximum file descriptor for
-    // select call
-    for (auto iface : ifaces) {
-        // Store identity
-        fd = iface->pimpl->getRX();
-        reverse_id[fd] = iface;
-
-        // Get maximum file descriptor
-        if (fd > nfds) {
-            nfds = fd;
-        }
+    if (!(this->flags & FLAG_IGNORE_OUTGOING)) {
+        return 0;
     }
-    nfds++;
 
-    // Perform select system call
-    while (true) {
-        // Re-create set
-        FD_ZERO(&rfds);
-        for (auto iface : ifaces) {
-            fd = iface->pimpl->getRX();
-            FD_SET(fd, &rfds);
-        }
-
-        // Re-set timeout
-        if (tvp != NULL) {
-            tv.tv_sec = millis / 1000;
-            tv.tv_usec = (millis % 1000) * 1000;
-        }
+    return this->readStatFile("tx_packets") - this->outgoing_base;
+}
 
-        fdsread = select(nfds, &rfds, NULL, NULL, tvp);
+size_t VIfaceImpl::getMemoryFootprint() const
+{
+    // Approximate overhead of a tree node (colour, parent, left and right)
+    const size_t node = 4 * sizeof(void*);
 
-        // Check if select error
-        if (fdsread == -1) {
-            // A signal was caught. Return.
-            if (errno == EINTR) {
-                return;
-            }
+    size_t bytes = sizeof(VIface) + sizeof(VIfaceImpl);
 
-            // Something bad happened
-            ostringstream what;
-            what << "--- Unknown error in select() system call: ";
-            what << fdsread << "." << endl;
-            what << "    Error: " << strerror(errno);
-            what << " (" << errno << ")." << endl;
-            throw runtime_error(what.str());
+    bytes += this->queues.capacity() * sizeof(struct viface_queues);
+    for (auto & queue : this->queues) {
+        // Packet rings are mapped in the process address space
+        if (queue.rx_ring.map != nullptr) {
+            bytes += queue.rx_ring.blocks * queue.rx_ring.block_size;
         }
-
-        // Check if timeout
-        if (tvp != NULL && fdsread == 0) {
-            return;
+        if (queue.tx_ring.map != nullptr) {
+            bytes += queue.tx_ring.blocks * queue.tx_ring.block_size;
         }
+    }
+    for (auto & xsk : this->xsks) {
+        bytes += xsk->getMemoryFootprint();
+    }
 
-        // Iterate all active file descriptors for reading
-        for (auto &pair : reverse_id) {
-            // Check if fd wasn't marked in select as available
-            if (!FD_ISSET(pair.first, &rfds)) {
-                continue;
-            }
-
-            // File descriptor is ready, perform read and dispatch
-            vector<uint8_t> packet = pair.second->receive();
-            if (packet.size() == 0) {
-                // Even if this is very unlikely, supposedly it can happen.
-                // See receive() comments about this.
-                continue;
-            }
+    bytes += this->name.capacity() + this->mac.capacity();
+    bytes += this->ipv4.capacity() + this->netmask.capacity();
+    bytes += this->broadcast.capacity();
 
-            // Dispatch packet
-            if (!callback(
-                    pair.second->getName(),
-                    pair.second->getID(),
-                    packet)) {
-                return;
-            }
-        }
+    for (auto & ipv6 : this->ipv6s) {
+        bytes += node + sizeof(string) + ipv6.capacity();
+    }
+    for (auto & key : this->stats_keys_cache) {
+        bytes += node + sizeof(string) + key.capacity();
+    }
+    for (auto & pair : this->stats_cache) {
+        bytes += node + sizeof(pair) + pair.first.capacity();
     }
-}
-
 
+    return bytes;
+}
 
 
 /*============================================================================
@@ -1114,8 +1888,8 @@ void dispatch(set<VIface*>& ifaces, dispatcher_cb callback, int millis)
    =   Stop scrolling...
  *============================================================================*/
 
-VIface::VIface(string name, bool tap, int id) :
-    pimpl(new VIfaceImpl(name, tap, id))
+VIface::VIface(string name, bool tap, int id, uint queues, uint flags) :
+    pimpl(new VIfaceImpl(name, tap, id, queues, flags))
 {}
 VIface::~VIface() = default;
 
@@ -1127,6 +1901,51 @@ uint VIface::getID() const {
     return this->pimpl->getID();
 }
 
+uint VIface::getQueues() const
+{
+    return this->pimpl->getQueues();
+}
+
+uint VIface::getFlags() const
+{
+    return this->pimpl->getFlags();
+}
+
+uint64_t VIface::getIgnoredOutgoing()
+{
+    return this->pimpl->getIgnoredOutgoing();
+}
+
+void VIface::attachQueue(uint queue)
+{
+    return this->pimpl->setAttached(queue, true);
+}
+
+void VIface::detachQueue(uint queue)
+{
+    return this->pimpl->setAttached(queue, false);
+}
+
+bool VIface::isAttached(uint queue) const
+{
+    return this->pimpl->isAttached(queue);
+}
+
+void VIface::setSteering(steering_mode mode)
+{
+    return this->pimpl->setSteering(mode);
+}
+
+void VIface::setSteeringProgram(int program)
+{
+    return this->pimpl->setSteeringProgram(program);
+}
+
+steering_mode VIface::getSteering() const
+{
+    return this->pimpl->getSteering();
+}
+
 void VIface::setMAC(string mac)
 {
     return this->pimpl->setMAC(mac);
@@ -1187,6 +2006,11 @@ uint VIface::getMTU() const
     return this->pimpl->getMTU();
 }
 
+uint VIface::getIndex() const
+{
+    return this->pimpl->getIndex();
+}
+
 void VIface::up()
 {
     return this->pimpl->up();
@@ -1202,14 +2026,133 @@ bool VIface::isUp() const
     return this->pimpl->isUp();
 }
 
-vector<uint8_t> VIface::receive()
+vector<uint8_t> VIface::receive(uint queue)
+{
+    return this->pimpl->receive(queue);
+}
+
+size_t VIface::receive(uint8_t* buffer, size_t size, uint queue)
+{
+    return this->pimpl->receive(buffer, size, queue);
+}
+
+size_t VIface::receiveBatch(packet_buffer* buffers, size_t count, uint queue)
+{
+    return this->pimpl->receiveBatch(buffers, count, queue);
+}
+
+void VIface::send(vector<uint8_t>& packet, uint queue) const
 {
-    return this->pimpl->receive();
+    return this->pimpl->send(packet, queue);
 }
 
-void VIface::send(vector<uint8_t>& packet) const
+size_t VIface::sendBatch(packet_buffer const* buffers, size_t count,
+                         uint queue) const
 {
-    return this->pimpl->send(packet);
+    return this->pimpl->sendBatch(buffers, count, queue);
+}
+
+void VIface::send(packet_segment const* segments, size_t count,
+                  uint queue) const
+{
+    return this->pimpl->send(segments, count, queue);
+}
+
+size_t VIface::receive(PacketBuffer& buffer, uint queue)
+{
+    return this->pimpl->receive(buffer, nullptr, queue);
+}
+
+void VIface::send(PacketBuffer const& buffer, uint queue) const
+{
+    return this->pimpl->send(buffer, nullptr, queue);
+}
+
+io_status VIface::tryReceive(packet_buffer& packet, uint queue) noexcept
+{
+    return this->pimpl->tryReceive(packet.data, packet.size, nullptr,
+                                   &packet.length, queue);
+}
+
+io_status VIface::tryReceiveBatch(packet_buffer* buffers, size_t count,
+                                  size_t& received, uint queue) noexcept
+{
+    return this->pimpl->tryReceiveBatch(buffers, count, &received, queue);
+}
+
+io_status VIface::trySend(packet_buffer const& packet,
+                          uint queue) const noexcept
+{
+    packet_segment segment = {packet.data, packet.length};
+    return this->pimpl->trySend(&segment, 1, nullptr, queue);
+}
+
+io_status VIface::trySendBatch(packet_buffer const* buffers, size_t count,
+                               size_t& sent, uint queue) const noexcept
+{
+    return this->pimpl->trySendBatch(buffers, count, &sent, queue);
+}
+
+size_t VIface::receive(uint8_t* buffer, size_t size, vnet_header& header,
+                       uint queue)
+{
+    return this->pimpl->receive(buffer, size, &header, queue);
+}
+
+size_t VIface::receive(PacketBuffer& buffer, vnet_header& header, uint queue)
+{
+    return this->pimpl->receive(buffer, &header, queue);
+}
+
+void VIface::send(packet_segment const* segments, size_t count,
+                  vnet_header const& header, uint queue) const
+{
+    return this->pimpl->send(segments, count, &header, queue);
+}
+
+void VIface::send(PacketBuffer const& buffer, vnet_header const& header,
+                  uint queue) const
+{
+    return this->pimpl->send(buffer, &header, queue);
+}
+
+void VIface::enableRing(uint blocks, size_t block_size, uint millis,
+                        uint queue)
+{
+    return this->pimpl->enableRing(blocks, block_size, millis, queue);
+}
+
+size_t VIface::receiveRing(packet_view* views, size_t count, int millis,
+                           uint queue)
+{
+    return this->pimpl->receiveRing(views, count, millis, queue);
+}
+
+void VIface::releaseBlock(uint queue)
+{
+    return this->pimpl->releaseBlock(queue);
+}
+
+void VIface::enableSendRing(uint frames, size_t frame_size, uint queue)
+{
+    return this->pimpl->enableSendRing(frames, frame_size, queue);
+}
+
+size_t VIface::acquireSlots(packet_buffer* slots, size_t count,
+                            uint queue) const
+{
+    return this->pimpl->acquireSlots(slots, count, queue);
+}
+
+void VIface::sendSlots(packet_buffer const* slots, size_t count,
+                       uint queue) const
+{
+    return this->pimpl->sendSlots(slots, count, queue);
+}
+
+uint64_t VIface::getDroppedSlots(uint queue) const
+{
+    return this->pimpl->getDroppedSlots(queue);
 }
 
 std::set<std::string> VIface::listStats()
@@ -1226,4 +2169,9 @@ void VIface::clearStat(std::string const& stat)
 {
     return this->pimpl->clearStat(stat);
 }
+
+size_t VIface::getMemoryFootprint() const
+{
+    return this->pimpl->getMemoryFootprint();
+}
 }
\ No newline at end of file
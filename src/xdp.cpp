@@ -0,0 +1,484 @@
+/**
+ * Copyright (C) 2015 Hewlett Packard Enterprise Development LP
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include "viface/private/viface.hpp"
+
+namespace viface
+{
+/*= Helpers ==================================================================*/
+
+static int bpf(int cmd, union bpf_attr* attr)
+{
+    return syscall(__NR_bpf, cmd, attr, sizeof(union bpf_attr));
+}
+
+static int read_ifindex(string const& name)
+{
+    int ifindex = -1;
+    ifstream file("/sys/class/net/" + name + "/ifindex");
+
+    if (!(file >> ifindex)) {
+        ostringstream what;
+        what << "--- Unable to read network index number of '";
+        what << name << "' network interface." << endl;
+        throw runtime_error(what.str());
+    }
+
+    return ifindex;
+}
+
+
+/*= XDP Socket Implementation ================================================*/
+
+XdpSocket::XdpSocket(string const& name, uint queue) :
+    name(name), fd(-1), umem(nullptr)
+{
+    ostringstream what;
+
+    memset(&this->fill, 0, sizeof(struct xdp_queue));
+    memset(&this->completion, 0, sizeof(struct xdp_queue));
+    memset(&this->rx, 0, sizeof(struct xdp_queue));
+    memset(&this->tx, 0, sizeof(struct xdp_queue));
+
+    try {
+        int ifindex = read_ifindex(name);
+
+        this->fd = socket(AF_XDP, SOCK_RAW, 0);
+        if (this->fd < 0) {
+            what << "--- Unable to create AF_XDP socket for " << name;
+            what << "." << endl;
+            what << "    Error: " << strerror(errno);
+            what << " (" << errno << ")." << endl;
+            throw runtime_error(what.str());
+        }
+
+        // Register the UMEM, first half of the frames for reception and
+        // second half for transmission
+        size_t umem_size = 2 * xdp_ring_size * xdp_frame_size;
+        void* umem = mmap(nullptr, umem_size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (umem == MAP_FAILED) {
+            what << "--- Unable to allocate UMEM for " << name << "." << endl;
+            what << "    Error: " << strerror(errno);
+            what << " (" << errno << ")." << endl;
+            throw runtime_error(what.str());
+        }
+        this->umem = (uint8_t*) umem;
+
+        struct xdp_umem_reg reg;
+        memset(&reg, 0, sizeof(struct xdp_umem_reg));
+        reg.addr = (uint64_t) (uintptr_t) this->umem;
+        reg.len = umem_size;
+        reg.chunk_size = xdp_frame_size;
+
+        uint32_t size = xdp_ring_size;
+        if (setsockopt(this->fd, SOL_XDP, XDP_UMEM_REG, &reg,
+                       sizeof(struct xdp_umem_reg)) != 0 ||
+            setsockopt(this->fd, SOL_XDP, XDP_UMEM_FILL_RING, &size,
+                       sizeof(size)) != 0 ||
+            setsockopt(this->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &size,
+                       sizeof(size)) != 0 ||
+            setsockopt(this->fd, SOL_XDP, XDP_RX_RING, &size,
+                       sizeof(size)) != 0 ||
+            setsockopt(this->fd, SOL_XDP, XDP_TX_RING, &size,
+                       sizeof(size)) != 0) {
+            what << "--- Unable to set up AF_XDP rings for " << name;
+            what << "." << endl;
+            what << "    Error: " << strerror(errno);
+            what << " (" << errno << ")." << endl;
+            throw runtime_error(what.str());
+        }
+
+        struct xdp_mmap_offsets offsets;
+        socklen_t optlen = sizeof(struct xdp_mmap_offsets);
+        if (getsockopt(this->fd, SOL_XDP, XDP_MMAP_OFFSETS, &offsets,
+                       &optlen) != 0) {
+            what << "--- Unable to get AF_XDP ring offsets for " << name;
+            what << "." << endl;
+            what << "    Error: " << strerror(errno);
+            what << " (" << errno << ")." << endl;
+            throw runtime_error(what.str());
+        }
+
+        this->mapQueue(this->fill, offsets.fr, XDP_UMEM_PGOFF_FILL_RING,
+                       sizeof(uint64_t));
+        this->mapQueue(this->completion, offsets.cr,
+                       XDP_UMEM_PGOFF_COMPLETION_RING, sizeof(uint64_t));
+        this->mapQueue(this->rx, offsets.rx, XDP_PGOFF_RX_RING,
+                       sizeof(struct xdp_desc));
+        this->mapQueue(this->tx, offsets.tx, XDP_PGOFF_TX_RING,
+                       sizeof(struct xdp_desc));
+
+        // Hand all reception frames to the kernel
+        uint64_t* addrs = (uint64_t*) this->fill.descs;
+        for (uint32_t i = 0; i < xdp_ring_size; i++) {
+            addrs[i] = (uint64_t) i * xdp_frame_size;
+        }
+        __atomic_store_n(this->fill.producer, xdp_ring_size,
+                         __ATOMIC_RELEASE);
+
+        for (uint32_t i = 0; i < xdp_ring_size; i++) {
+            this->frames.push_back(
+                (uint64_t) (xdp_ring_size + i) * xdp_frame_size);
+        }
+
+        // Zero-copy is used if the driver supports it, copy mode otherwise
+        struct sockaddr_xdp addr;
+        memset(&addr, 0, sizeof(struct sockaddr_xdp));
+        addr.sxdp_family = AF_XDP;
+        addr.sxdp_ifindex = ifindex;
+        addr.sxdp_queue_id = queue;
+
+        if (bind(this->fd, (struct sockaddr*) &addr,
+                 sizeof(struct sockaddr_xdp)) != 0) {
+            what << "--- Unable to bind AF_XDP socket to '" << name;
+            what << "' network interface." << endl;
+            what << "    Queue: " << queue << "." << endl;
+            what << "    Error: " << strerror(errno);
+            what << " (" << errno << ")." << endl;
+            throw runtime_error(what.str());
+        }
+    } catch (...) {
+        this->release();
+        throw;
+    }
+}
+
+XdpSocket::~XdpSocket()
+{
+    this->release();
+}
+
+void XdpSocket::mapQueue(struct xdp_queue& queue,
+                         struct xdp_ring_offset const& offsets,
+                         uint64_t page, size_t desc_size)
+{
+    size_t map_size = offsets.desc + xdp_ring_size * desc_size;
+    void* map = mmap(nullptr, map_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, this->fd, page);
+
+    if (map == MAP_FAILED) {
+        ostringstream what;
+        what << "--- Unable to map AF_XDP ring of " << this->name << ".";
+        what << endl;
+        what << "    Error: " << strerror(errno);
+        what << " (" << errno << ")." << endl;
+        throw runtime_error(what.str());
+    }
+
+    queue.map = map;
+    queue.map_size = map_size;
+    queue.producer = (uint32_t*) ((uint8_t*) map + offsets.producer);
+    queue.consumer = (uint32_t*) ((uint8_t*) map + offsets.consumer);
+    queue.descs = (uint8_t*) map + offsets.desc;
+}
+
+void XdpSocket::release()
+{
+    for (auto queue : {&this->fill, &this->completion, &this->rx,
+                       &this->tx}) {
+        if (queue->map != nullptr) {
+            munmap(queue->map, queue->map_size);
+            queue->map = nullptr;
+        }
+    }
+
+    if (this->fd >= 0) {
+        close(this->fd);
+        this->fd = -1;
+    }
+
+    if (this->umem != nullptr) {
+        munmap(this->umem, 2 * xdp_ring_size * xdp_frame_size);
+        this->umem = nullptr;
+    }
+}
+
+size_t XdpSocket::getMemoryFootprint() const
+{
+    return sizeof(XdpSocket) + 2 * xdp_ring_size * xdp_frame_size +
+           this->frames.capacity() * sizeof(uint64_t);
+}
+
+ssize_t XdpSocket::receive(uint8_t* buffer, size_t size)
+{
+    packet_buffer packet = {buffer, size, 0};
+
+    if (this->receiveBatch(&packet, 1) == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    return packet.length;
+}
+
+size_t XdpSocket::receiveBatch(packet_buffer* buffers, size_t count)
+{
+    uint32_t consumer = *this->rx.consumer;
+    uint32_t producer = __atomic_load_n(this->rx.producer, __ATOMIC_ACQUIRE);
+    uint32_t fill = *this->fill.producer;
+    struct xdp_desc* descs = (struct xdp_desc*) this->rx.descs;
+    uint64_t* addrs = (uint64_t*) this->fill.descs;
+    size_t received = 0;
+
+    // Copy the frames out and give them back to the kernel right away, so
+    // the fill ring never runs dry
+    for (; received < count && consumer != producer; received++) {
+        struct xdp_desc* desc = &descs[consumer++ & (xdp_ring_size - 1)];
+        size_t length = min((size_t) desc->len, buffers[received].size);
+
+        memcpy(buffers[received].data, this->umem + desc->addr, length);
+        buffers[received].length = length;
+
+        addrs[fill++ & (xdp_ring_size - 1)] =
+            desc->addr & ~((uint64_t) xdp_frame_size - 1);
+    }
+
+    if (received > 0) {
+        __atomic_store_n(this->rx.consumer, consumer, __ATOMIC_RELEASE);
+        __atomic_store_n(this->fill.producer, fill, __ATOMIC_RELEASE);
+    } else {
+        errno = EAGAIN;
+    }
+
+    return received;
+}
+
+void XdpSocket::reclaim()
+{
+    uint32_t consumer = *this->completion.consumer;
+    uint32_t producer = __atomic_load_n(this->completion.producer,
+                                        __ATOMIC_ACQUIRE);
+    uint64_t* addrs = (uint64_t*) this->completion.descs;
+
+    // Frames are sent, reuse them
+    for (; consumer != producer; consumer++) {
+        this->frames.push_back(addrs[consumer & (xdp_ring_size - 1)]);
+    }
+    __atomic_store_n(this->completion.consumer, consumer, __ATOMIC_RELEASE);
+}
+
+bool XdpSocket::kick()
+{
+    // Frames the device doesn't take now stay in the ring for the next kick
+    if (sendto(this->fd, nullptr, 0, MSG_DONTWAIT, nullptr, 0) < 0 &&
+        errno != EAGAIN && errno != EBUSY && errno != ENOBUFS) {
+        return false;
+    }
+    return true;
+}
+
+ssize_t XdpSocket::enqueue(struct iovec const* iovecs, size_t count)
+{
+    uint32_t producer = *this->tx.producer;
+    uint32_t consumer = __atomic_load_n(this->tx.consumer, __ATOMIC_ACQUIRE);
+    size_t length = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        length += iovecs[i].iov_len;
+    }
+    if (length > xdp_frame_size) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    // Out of frames or ring entries
+    if (this->frames.empty() || producer - consumer >= xdp_ring_size) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    // Gather the segments into a frame
+    uint64_t addr = this->frames.back();
+    this->frames.pop_back();
+
+    uint8_t* frame = this->umem + addr;
+    for (size_t i = 0; i < count; i++) {
+        memcpy(frame, iovecs[i].iov_base, iovecs[i].iov_len);
+        frame += iovecs[i].iov_len;
+    }
+
+    struct xdp_desc* desc =
+        &((struct xdp_desc*) this->tx.descs)[producer & (xdp_ring_size - 1)];
+    desc->addr = addr;
+    desc->len = length;
+    desc->options = 0;
+
+    __atomic_store_n(this->tx.producer, producer + 1, __ATOMIC_RELEASE);
+    return length;
+}
+
+ssize_t XdpSocket::send(struct iovec const* iovecs, size_t count)
+{
+    this->reclaim();
+
+    ssize_t length = this->enqueue(iovecs, count);
+    if (length < 0 || !this->kick()) {
+        return -1;
+    }
+    return length;
+}
+
+size_t XdpSocket::sendBatch(packet_buffer const* buffers, size_t count)
+{
+    size_t sent = 0;
+
+    this->reclaim();
+
+    // Queue as many packets as possible, then send them at once
+    for (; sent < count; sent++) {
+        struct iovec iov;
+        iov.iov_base = buffers[sent].data;
+        iov.iov_len = buffers[sent].length;
+
+        if (this->enqueue(&iov, 1) < 0) {
+            break;
+        }
+    }
+
+    int error = errno;
+    if (this->kick()) {
+        errno = error;
+    }
+    return sent;
+}
+
+
+/*= XDP Redirect Implementation =============================================*/
+
+XdpRedirect::XdpRedirect(string const& name,
+                         vector<unique_ptr<XdpSocket> > const& sockets) :
+    name(name), map_fd(-1), prog_fd(-1), link_fd(-1)
+{
+    ostringstream what;
+    union bpf_attr attr;
+
+    try {
+        int ifindex = read_ifindex(name);
+
+        // Sockets by device queue
+        memset(&attr, 0, sizeof(union bpf_attr));
+        attr.map_type = BPF_MAP_TYPE_XSKMAP;
+        attr.key_size = sizeof(uint32_t);
+        attr.value_size = sizeof(uint32_t);
+        attr.max_entries = sockets.size();
+
+        this->map_fd = bpf(BPF_MAP_CREATE, &attr);
+        if (this->map_fd < 0) {
+            what << "--- Unable to create XSKMAP for " << name << ".";
+            what << endl;
+            what << "    Error: " << strerror(errno);
+            what << " (" << errno << ")." << endl;
+            throw runtime_error(what.str());
+        }
+
+        for (uint32_t key = 0; key < sockets.size(); key++) {
+            int fd = sockets[key]->getFD();
+
+            memset(&attr, 0, sizeof(union bpf_attr));
+            attr.map_fd = this->map_fd;
+            attr.key = (uint64_t) (uintptr_t) &key;
+            attr.value = (uint64_t) (uintptr_t) &fd;
+            attr.flags = BPF_ANY;
+
+            if (bpf(BPF_MAP_UPDATE_ELEM, &attr) != 0) {
+                what << "--- Unable to register AF_XDP socket of " << name;
+                what << "." << endl;
+                what << "    Queue: " << key << "." << endl;
+                what << "    Error: " << strerror(errno);
+                what << " (" << errno << ")." << endl;
+                throw runtime_error(what.str());
+            }
+        }
+
+        // Redirect the frames received on each queue to its socket, and let
+        // the rest through to the kernel
+        BpfProgram prog;
+        prog.ldctx(BPF_REG_2, offsetof(struct xdp_md, rx_queue_index));
+        prog.ldmap(BPF_REG_1, this->map_fd);
+        prog.movi(BPF_REG_3, XDP_PASS);
+        prog.call(BPF_FUNC_redirect_map);
+        prog.exit();
+        this->prog_fd = prog.load(BPF_PROG_TYPE_XDP);
+
+        // Prefer the driver hook, generic XDP works on any device. The
+        // program is detached when the link is closed.
+        uint32_t modes[] = {XDP_FLAGS_DRV_MODE, XDP_FLAGS_SKB_MODE};
+        for (uint32_t mode : modes) {
+            memset(&attr, 0, sizeof(union bpf_attr));
+            attr.link_create.prog_fd = this->prog_fd;
+            attr.link_create.target_ifindex = ifindex;
+            attr.link_create.attach_type = BPF_XDP;
+            attr.link_create.flags = mode;
+
+            this->link_fd = bpf(BPF_LINK_CREATE, &attr);
+            if (this->link_fd >= 0) {
+                return;
+            }
+        }
+
+        what << "--- Unable to attach XDP program to " << name << ".";
+        what << endl;
+        what << "    Error: " << strerror(errno);
+        what << " (" << errno << ")." << endl;
+        throw runtime_error(what.str());
+    } catch (...) {
+        this->release();
+        throw;
+    }
+}
+
+XdpRedirect::~XdpRedirect()
+{
+    this->release();
+}
+
+void XdpRedirect::release()
+{
+    for (int* fd : {&this->link_fd, &this->prog_fd, &this->map_fd}) {
+        if (*fd >= 0) {
+            close(*fd);
+            *fd = -1;
+        }
+    }
+}
+
+uint XdpRedirect::getQueues(string const& name)
+{
+    DIR* dir;
+    struct dirent* ent;
+    uint queues = 0;
+    string path = "/sys/class/net/" + name + "/queues/";
+
+    // One rx-<n> entry per receive queue in use
+    if ((dir = opendir(path.c_str())) == NULL) {
+        ostringstream what;
+        what << "--- Unable to open queues folder for interface ";
+        what << name << ":" << endl;
+        what << "    " << path << endl;
+        what << "    Error: " << strerror(errno);
+        what << " (" << errno << ")." << endl;
+        throw runtime_error(what.str());
+    }
+
+    while ((ent = readdir(dir)) != NULL) {
+        queues += strncmp(ent->d_name, "rx-", 3) == 0;
+    }
+    closedir(dir);
+
+    return queues;
+}
+}
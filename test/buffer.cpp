@@ -0,0 +1,55 @@
+#include "catch.hpp"
+#include <viface/buffer.hpp>
+
+using namespace std;
+
+TEST_CASE("Packet pool")
+{
+    viface::PacketPool pool(2, 2000, 64, 16);
+
+    // Buffer size is rounded up to keep buffers cache-line aligned
+    REQUIRE(pool.getCount() == 2);
+    REQUIRE(pool.getBufferSize() == 2048);
+
+    viface::PacketBuffer first = pool.alloc();
+    REQUIRE(first);
+    REQUIRE(first.getHeadroom() == 64);
+    REQUIRE(first.getCapacity() == 2048 - 64 - 16);
+    REQUIRE(((uintptr_t) first.getData() - 64) % 64 == 0);
+
+    // Handles share the buffer
+    {
+        viface::PacketBuffer copy = first;
+        REQUIRE(first.getRefs() == 2);
+        REQUIRE(copy.setLength(100));
+        REQUIRE(first.getLength() == 100);
+    }
+    REQUIRE(first.getRefs() == 1);
+
+    // Exhaustion is reported
+    viface::PacketBuffer second = pool.alloc();
+    REQUIRE(second);
+    REQUIRE(pool.getInUse() == 2);
+    REQUIRE_FALSE(pool.alloc());
+    REQUIRE(pool.getExhausted() == 1);
+
+    // Released buffers return to the pool
+    second = viface::PacketBuffer();
+    REQUIRE(pool.getInUse() == 1);
+    REQUIRE(pool.getPeak() == 2);
+    REQUIRE(pool.alloc());
+}
+
+TEST_CASE("Packet buffer outliving its pool")
+{
+    viface::PacketBuffer buffer(64, 0, 0);
+
+    {
+        viface::PacketPool pool(1);
+        buffer = pool.alloc();
+    }
+
+    REQUIRE(buffer);
+    REQUIRE(buffer.put(10) != nullptr);
+    REQUIRE(buffer.getLength() == 10);
+}
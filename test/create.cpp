@@ -36,6 +36,7 @@ TEST_CASE("Create")
 
     // Check parameters
     REQUIRE(iface.getMTU() == 1500);
+    REQUIRE(iface.getIndex() > 0);
     REQUIRE(iface.getMAC() == mac);
     REQUIRE(iface.getIPv4() == ipv4);
     REQUIRE(iface.getIPv4Netmask() == netmask);
@@ -48,6 +49,12 @@ TEST_CASE("Create")
         cout << "    " << ipv6_addr << endl;
     }
 
+    // Memory held by the interface does not depend on its MTU
+    size_t footprint = iface.getMemoryFootprint();
+    REQUIRE_NOTHROW(iface.setMTU(9000));
+    REQUIRE(iface.getMemoryFootprint() == footprint);
+    REQUIRE(footprint < 4096);
+
     // List statistics keys
     set<string> stats = iface.listStats();
     cout << "Statistics found:" << endl;
@@ -0,0 +1,658 @@
+#include "catch.hpp"
+#include <viface/viface.hpp>
+
+#include <thread>
+#include <chrono>
+
+using namespace std;
+
+// Ethernet 2 frame with a local experimental EtherType (0x88B5)
+static vector<uint8_t> frame = {
+    0x66, 0x23, 0x2d, 0x28, 0xc6, 0x84, 0x66, 0x23, 0x2d, 0x28, 0xc6, 0x85,
+    0x88, 0xb5, 0x64, 0x69, 0x73, 0x70, 0x61, 0x74, 0x63, 0x68, 0x00, 0x00,
+    0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c,
+    0x0d, 0x0e, 0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18,
+    0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20
+};
+
+static void check_dispatcher(viface::dispatcher_engine engine)
+{
+    viface::VIface tap1("vifdp%d");
+    viface::VIface tap2("vifdp%d");
+    tap1.up();
+    tap2.up();
+    viface::VIface hook1(tap1.getName());
+    viface::VIface hook2(tap2.getName());
+
+    viface::Dispatcher dispatcher(engine);
+    REQUIRE(dispatcher.getPoolStats().count == 0);
+    REQUIRE_THROWS(dispatcher.dispatch(nullptr, 0));
+    REQUIRE(dispatcher.tryDispatch(nullptr, 0) == viface::IO_INVALID);
+
+    dispatcher.add(&tap1);
+    dispatcher.add(&tap2);
+    REQUIRE(dispatcher.getSize() == 2);
+    REQUIRE_THROWS(dispatcher.add(&tap1));
+
+    // Stop once a frame was received from each interface
+    set<uint> seen;
+    viface::dispatcher_cb collect = [&](string const&, uint id,
+                                        vector<uint8_t>& packet) {
+        if (packet == frame) {
+            seen.insert(id);
+        }
+        return seen.size() < 2;
+    };
+
+    hook1.send(frame);
+    hook2.send(frame);
+    dispatcher.dispatch(collect, 1000);
+    REQUIRE(seen.size() == 2);
+    REQUIRE(seen.count(tap1.getID()) == 1);
+    REQUIRE(seen.count(tap2.getID()) == 1);
+
+    // Ready interfaces are drained up to their budget on each wakeup
+    REQUIRE(dispatcher.getBudget(&tap1) == 64);
+    REQUIRE_THROWS(dispatcher.setBudget(&tap1, 0));
+    REQUIRE_THROWS(dispatcher.getStats(&hook1));
+    dispatcher.setBudget(&tap1, 2);
+    REQUIRE(dispatcher.getBudget(&tap1) == 2);
+
+    viface::dispatcher_stats before = dispatcher.getStats(&tap1);
+    int count = 0;
+    for (int i = 0; i < 5; i++) {
+        hook1.send(frame);
+    }
+    dispatcher.dispatch([&](string const&, uint,
+                            vector<uint8_t>& packet) {
+            count += packet == frame;
+            return count < 5;
+        }, 1000);
+    REQUIRE(count == 5);
+
+    viface::dispatcher_stats after = dispatcher.getStats(&tap1);
+    REQUIRE(after.packets - before.packets >= 5);
+    REQUIRE(after.polls - before.polls >= 3);
+
+    // Reads posted by io_uring may take the first frame as soon as it's sent
+    if (dispatcher.getEngine() == viface::ENGINE_IO_URING) {
+        REQUIRE(after.exhausted - before.exhausted >= 1);
+    } else {
+        REQUIRE(after.exhausted - before.exhausted >= 2);
+    }
+
+    // Removed interfaces are not monitored anymore
+    dispatcher.remove(&tap2);
+    REQUIRE(dispatcher.getSize() == 1);
+    REQUIRE_THROWS(dispatcher.remove(&tap2));
+
+    seen.clear();
+    hook2.send(frame);
+    dispatcher.dispatch(collect, 100);
+    REQUIRE(seen.empty());
+
+    // Same loop reporting failures as status codes
+    REQUIRE(dispatcher.tryDispatch(collect, 10) == viface::IO_OK);
+    hook1.send(frame);
+    REQUIRE(dispatcher.tryDispatch(collect, 1000) == viface::IO_OK);
+    REQUIRE(seen.count(tap1.getID()) == 1);
+
+    // Packets handed with their metadata
+    viface::packet_info info = {};
+    hook1.send(frame);
+    dispatcher.dispatchPackets([&](viface::packet_info const& packet) {
+            if (vector<uint8_t>(packet.data, packet.data + packet.length) !=
+                frame) {
+                return true;
+            }
+            info = packet;
+            return false;
+        }, 1000);
+    REQUIRE(info.iface == &tap1);
+    REQUIRE(info.id == tap1.getID());
+    REQUIRE(info.queue == 0);
+    REQUIRE(info.ifindex == tap1.getIndex());
+    REQUIRE(info.length == frame.size());
+    REQUIRE(info.timestamp > 0);
+
+    // Packets kept past the handler through their pooled buffer, the next
+    // ones are read into other buffers
+    viface::PacketBuffer kept;
+    auto keep = [&](viface::packet_info const& packet) {
+        uint8_t const* data = packet.data;
+        if (vector<uint8_t>(data, data + packet.length) != frame) {
+            return true;
+        }
+        REQUIRE(packet.buffer != nullptr);
+        kept = *packet.buffer;
+        return false;
+    };
+    hook1.send(frame);
+    dispatcher.dispatchPackets(keep, 1000);
+    hook1.send(frame);
+    dispatcher.dispatchPackets([&](viface::packet_info const& packet) {
+            return packet.length != frame.size();
+        }, 1000);
+    REQUIRE(kept.getHeadroom() == 128);
+    REQUIRE(vector<uint8_t>(kept.getData(),
+                            kept.getData() + kept.getLength()) == frame);
+
+    viface::pool_stats pool = dispatcher.getPoolStats();
+    REQUIRE(pool.count >= 256);
+    REQUIRE(pool.size >= 128 + tap1.getMTU());
+    REQUIRE(pool.in_use >= 2);
+    REQUIRE(pool.exhausted == 0);
+
+    // Queues drained on demand, including a read already posted
+    for (int i = 0; i < 3; i++) {
+        hook1.send(frame);
+    }
+    this_thread::sleep_for(chrono::milliseconds(50));
+    size_t drained = 0;
+    auto drain = [&](viface::packet_info const& packet) {
+        uint8_t const* data = packet.data;
+        drained += vector<uint8_t>(data, data + packet.length) == frame;
+        return false;
+    };
+    REQUIRE(dispatcher.drainQueue(&tap1, drain) >= 3);
+    REQUIRE(drained == 3);
+    REQUIRE_THROWS(dispatcher.drainQueue(&hook1, nullptr));
+
+    // Packets handed in batches, gathered from every ready interface
+    dispatcher.add(&tap2);
+    REQUIRE_THROWS(dispatcher.dispatchBatch(nullptr, 0, 0));
+    REQUIRE(dispatcher.tryDispatchBatch(nullptr, 0, 0) == viface::IO_INVALID);
+
+    for (int i = 0; i < 3; i++) {
+        hook1.send(frame);
+        hook2.send(frame);
+    }
+    size_t frames = 0;
+    size_t largest = 0;
+    seen.clear();
+    dispatcher.dispatchBatch([&](viface::packet_info const* packets,
+                                 size_t count) {
+            largest = max(largest, count);
+            for (size_t i = 0; i < count; i++) {
+                uint8_t const* data = packets[i].data;
+                if (vector<uint8_t>(data, data + packets[i].length) ==
+                    frame) {
+                    frames++;
+                    seen.insert(packets[i].id);
+                }
+            }
+            return frames < 6;
+        }, 1000, 4);
+    REQUIRE(frames >= 6);
+    REQUIRE(seen.size() == 2);
+    REQUIRE(largest > 0);
+    REQUIRE(largest <= 4);
+
+    // Handlers taken by type. Packets not handled yet when the handler
+    // stops are left for the next dispatch.
+    dispatcher.setBudget(&tap1, 64);
+    for (int i = 0; i < 4; i++) {
+        hook1.send(frame);
+    }
+    this_thread::sleep_for(chrono::milliseconds(50));
+
+    size_t handled = 0;
+    auto handle = [&](viface::packet_info const& packet) {
+        uint8_t const* data = packet.data;
+        handled += vector<uint8_t>(data, data + packet.length) == frame;
+        return handled % 2 != 0;
+    };
+    dispatcher.dispatch(handle, 1000);
+    REQUIRE(handled == 2);
+    REQUIRE(dispatcher.tryDispatch(handle, 1000) == viface::IO_OK);
+    REQUIRE(handled == 4);
+
+    // Packets gathered before an error are handed over, and none is left
+    // for the next dispatch, even with smaller batches. Frames left by the
+    // previous checks are drained first.
+    dispatcher.drainQueue(&tap1, drain);
+    viface::VIface tap3("vifdp%d");
+    tap3.up();
+    viface::VIface hook3(tap3.getName());
+    dispatcher.add(&hook3);
+    for (int i = 0; i < 3; i++) {
+        hook1.send(frame);
+    }
+    this_thread::sleep_for(chrono::milliseconds(50));
+    tap3.down();
+
+    frames = 0;
+    viface::batch_cb gather = [&](viface::packet_info const* packets,
+                                  size_t count) {
+        for (size_t i = 0; i < count; i++) {
+            uint8_t const* data = packets[i].data;
+            frames += vector<uint8_t>(data, data + packets[i].length) ==
+                      frame;
+        }
+        return true;
+    };
+    REQUIRE(dispatcher.tryDispatchBatch(gather, 1000) == viface::IO_ERROR);
+    dispatcher.remove(&hook3);
+
+    // With io_uring the error may be found before the frames are read, they
+    // are then left in their queue. Either way, none is handed over twice.
+    if (engine == viface::ENGINE_IO_URING) {
+        REQUIRE(dispatcher.tryDispatchBatch(gather, 100) == viface::IO_OK);
+    }
+    REQUIRE(frames == 3);
+
+    handled = 0;
+    REQUIRE(dispatcher.tryDispatch(handle, 100) == viface::IO_OK);
+    REQUIRE(handled == 0);
+}
+
+TEST_CASE("Dispatcher")
+{
+    check_dispatcher(viface::ENGINE_EPOLL);
+}
+
+TEST_CASE("Dispatcher stopping early")
+{
+    viface::VIface tap("vifdp%d");
+    tap.up();
+    viface::VIface hook(tap.getName());
+    set<viface::VIface*> ifaces = {&tap};
+    uint8_t buffer[2048];
+
+    // Count the test frames still queued in the kernel
+    auto remaining = [&]() {
+        size_t frames = 0;
+        size_t size;
+        while ((size = tap.receive(buffer, sizeof(buffer))) > 0) {
+            frames += vector<uint8_t>(buffer, buffer + size) == frame;
+        }
+        return frames;
+    };
+
+    // Packets after the one the callback stopped on are not read, even if
+    // the dispatcher goes away right after
+    for (int i = 0; i < 5; i++) {
+        hook.send(frame);
+    }
+    this_thread::sleep_for(chrono::milliseconds(50));
+    viface::dispatch(ifaces, [&](string const&, uint,
+                                 vector<uint8_t>& packet) {
+            return packet != frame;
+        }, 1000);
+    REQUIRE(remaining() == 4);
+
+    // Same with handlers taken by type and packet_cb callbacks
+    viface::Dispatcher dispatcher;
+    dispatcher.add(&tap);
+    auto stop = [&](viface::packet_info const& packet) {
+        uint8_t const* data = packet.data;
+        return vector<uint8_t>(data, data + packet.length) != frame;
+    };
+
+    for (int i = 0; i < 5; i++) {
+        hook.send(frame);
+    }
+    this_thread::sleep_for(chrono::milliseconds(50));
+    dispatcher.dispatch(stop, 1000);
+    dispatcher.dispatchPackets(stop, 1000);
+    REQUIRE(remaining() == 3);
+}
+
+TEST_CASE("Dispatcher with multiple queues")
+{
+    viface::VIface tap("vifdp%d", true, -1, 2);
+    tap.up();
+    viface::VIface hook(tap.getName());
+
+    // Each queue is registered on its own
+    viface::Dispatcher dispatcher;
+    dispatcher.add(&tap, 0);
+    dispatcher.add(&tap, 1);
+    REQUIRE(dispatcher.getSize() == 2);
+    REQUIRE_THROWS(dispatcher.add(&tap, 2));
+    REQUIRE_THROWS(dispatcher.add(&tap, 1));
+
+    int count = 0;
+    for (int i = 0; i < 4; i++) {
+        hook.send(frame);
+    }
+    dispatcher.dispatch([&](string const&, uint,
+                            vector<uint8_t>& packet) {
+            count += packet == frame;
+            return count < 4;
+        }, 1000);
+    REQUIRE(count == 4);
+    REQUIRE(dispatcher.getStats(&tap, 0).packets +
+            dispatcher.getStats(&tap, 1).packets >= 4);
+
+    dispatcher.remove(&tap, 1);
+    REQUIRE_THROWS(dispatcher.remove(&tap, 1));
+    REQUIRE(dispatcher.getSize() == 1);
+}
+
+TEST_CASE("Dispatcher with virtio net header")
+{
+    viface::VIface tap("vifdp%d", true, -1, 1, viface::FLAG_VNET_HDR);
+    tap.up();
+    viface::VIface hook(tap.getName());
+
+    // Both engines hand over the packet without its header
+    for (auto engine : {viface::ENGINE_EPOLL, viface::ENGINE_IO_URING}) {
+        viface::Dispatcher dispatcher(engine);
+        dispatcher.add(&tap);
+
+        bool seen = false;
+        hook.send(frame);
+        dispatcher.dispatch([&](string const&, uint,
+                                vector<uint8_t>& packet) {
+                seen = packet == frame;
+                return !seen;
+            }, 1000);
+        REQUIRE(seen);
+        dispatcher.remove(&tap);
+    }
+}
+
+TEST_CASE("Dispatcher with XDP backend")
+{
+    viface::VIface tap("vifdp%d");
+    tap.up();
+    viface::VIface hook(tap.getName(), true, -1, 1, viface::FLAG_XDP);
+
+    // Both engines serve the socket, and send through it
+    for (auto engine : {viface::ENGINE_EPOLL, viface::ENGINE_IO_URING}) {
+        viface::Dispatcher dispatcher(engine);
+        dispatcher.add(&hook);
+        dispatcher.add(&tap);
+
+        viface::PacketBuffer buffer(2048, 0, 0);
+        copy(frame.begin(), frame.end(), buffer.put(frame.size()));
+        dispatcher.send(&hook, buffer);
+        dispatcher.send(&tap, buffer);
+        dispatcher.flush();
+
+        set<uint> seen;
+        dispatcher.dispatch([&](string const&, uint id,
+                                vector<uint8_t>& packet) {
+                if (packet == frame) {
+                    seen.insert(id);
+                }
+                return seen.size() < 2;
+            }, 1000);
+        REQUIRE(seen.size() == 2);
+    }
+}
+
+static viface::PacketBuffer frame_buffer(vector<uint8_t> const& packet)
+{
+    viface::PacketBuffer buffer(2048, 0, 0);
+    copy(packet.begin(), packet.end(), buffer.put(packet.size()));
+    return buffer;
+}
+
+TEST_CASE("Dispatcher with send queues")
+{
+    viface::VIface tap("vifdp%d");
+    tap.up();
+    viface::VIface hook(tap.getName(), true, -1, 1,
+                        viface::FLAG_IGNORE_OUTGOING);
+
+    // Count the test frames written to the tap, until all showed up
+    uint8_t memory[2048];
+    auto wait_frames = [&](int expected) {
+            int frames = 0;
+            for (int i = 0; i < 100 && frames < expected; i++) {
+                size_t size;
+                while ((size = hook.receive(memory, sizeof(memory)))) {
+                    frames += vector<uint8_t>(memory, memory + size) == frame;
+                }
+                this_thread::sleep_for(chrono::milliseconds(10));
+            }
+            return frames;
+        };
+    viface::dispatcher_cb idle = [](string const&, uint,
+                                    vector<uint8_t>&) {
+        return true;
+    };
+
+    for (auto engine : {viface::ENGINE_EPOLL, viface::ENGINE_IO_URING}) {
+        {
+            viface::Dispatcher dispatcher(engine);
+            REQUIRE_THROWS(dispatcher.addSendQueue(&tap, 0));
+            dispatcher.addSendQueue(&tap, 4);
+            REQUIRE_THROWS(dispatcher.addSendQueue(&tap));
+            REQUIRE_THROWS(dispatcher.getSendQueueStats(&hook));
+            REQUIRE_THROWS(dispatcher.enqueue(&hook, frame_buffer(frame)));
+
+            // Packets over the high-water mark are dropped
+            for (int i = 0; i < 6; i++) {
+                REQUIRE(dispatcher.enqueue(&tap, frame_buffer(frame)) ==
+                        (i < 4));
+            }
+            viface::send_queue_stats stats = dispatcher.getSendQueueStats(
+                &tap);
+            REQUIRE(stats.pending == 4);
+            REQUIRE(stats.queued == 4);
+            REQUIRE(stats.dropped == 2);
+            REQUIRE(stats.sent == 0);
+
+            // Written by dispatch(), even with no queue to receive from
+            dispatcher.dispatch(idle, 10);
+            stats = dispatcher.getSendQueueStats(&tap);
+            REQUIRE(stats.pending == 0);
+            REQUIRE(stats.sent == 4);
+            REQUIRE(stats.max_delay > 0);
+            REQUIRE(stats.delay >= stats.max_delay);
+            REQUIRE(wait_frames(4) == 4);
+
+            // Received packets are forwarded from the callback
+            dispatcher.add(&tap);
+            hook.send(frame);
+            dispatcher.dispatch([&](string const&, uint,
+                                    vector<uint8_t>& packet) {
+                    dispatcher.enqueue(&tap, frame_buffer(packet));
+                    return packet != frame;
+                }, 1000);
+            REQUIRE(wait_frames(1) == 1);
+            dispatcher.remove(&tap);
+
+            // Pending packets are written on removal
+            dispatcher.enqueue(&tap, frame_buffer(frame));
+            dispatcher.enqueue(&tap, frame_buffer(frame));
+            dispatcher.removeSendQueue(&tap);
+            REQUIRE_THROWS(dispatcher.getSendQueueStats(&tap));
+            REQUIRE(wait_frames(2) == 2);
+
+            // And on destruction
+            dispatcher.addSendQueue(&tap);
+            dispatcher.enqueue(&tap, frame_buffer(frame));
+        }
+        REQUIRE(wait_frames(1) == 1);
+    }
+
+    // Packets that fail to be written are kept, and the error reported
+    for (auto engine : {viface::ENGINE_EPOLL, viface::ENGINE_IO_URING}) {
+        viface::Dispatcher dispatcher(engine);
+        dispatcher.addSendQueue(&tap, 4);
+        tap.down();
+        for (int i = 0; i < 6; i++) {
+            dispatcher.enqueue(&tap, frame_buffer(frame));
+        }
+        REQUIRE_THROWS(dispatcher.flush());
+        viface::send_queue_stats stats = dispatcher.getSendQueueStats(&tap);
+        REQUIRE(stats.pending == 4);
+        REQUIRE(stats.dropped == 2);
+        REQUIRE(stats.sent == 0);
+
+        // And written once the interface is writable again
+        tap.up();
+        for (int i = 0; i < 100 && stats.pending > 0; i++) {
+            dispatcher.dispatch(idle, 10);
+            stats = dispatcher.getSendQueueStats(&tap);
+        }
+        REQUIRE(stats.pending == 0);
+        REQUIRE(stats.sent == 4);
+    }
+
+    // The XDP transmission ring fills up, the rest is written once the
+    // socket is writable again
+    viface::VIface xdp(tap.getName(), true, -1, 1, viface::FLAG_XDP);
+    for (auto engine : {viface::ENGINE_EPOLL, viface::ENGINE_IO_URING}) {
+        viface::Dispatcher dispatcher(engine);
+        dispatcher.addSendQueue(&xdp, 4096);
+        for (int i = 0; i < 2048; i++) {
+            dispatcher.enqueue(&xdp, frame_buffer(frame));
+        }
+        dispatcher.flush();
+        viface::send_queue_stats stats = dispatcher.getSendQueueStats(&xdp);
+        REQUIRE(stats.pending > 0);
+        REQUIRE(stats.sent > 0);
+
+        for (int i = 0; i < 100 && stats.pending > 0; i++) {
+            dispatcher.dispatch(idle, 10);
+            stats = dispatcher.getSendQueueStats(&xdp);
+        }
+        REQUIRE(stats.pending == 0);
+        REQUIRE(stats.sent == 2048);
+    }
+}
+
+TEST_CASE("Queue controller")
+{
+    viface::VIface tap("vifdp%d", true, -1, 4);
+    tap.up();
+    viface::VIface hook(tap.getName());
+
+    viface::Dispatcher dispatcher;
+    REQUIRE_THROWS(viface::QueueController(dispatcher, &tap, 0));
+    REQUIRE_THROWS(viface::QueueController(dispatcher, &tap, 5));
+
+    viface::QueueController controller(dispatcher, &tap);
+    REQUIRE(controller.getAttached() == 4);
+    REQUIRE(dispatcher.getSize() == 4);
+    REQUIRE_THROWS(controller.setThresholds(0.5, 0.1));
+
+    // Idle queues are released one at a time
+    for (uint attached = 3; attached >= 1; attached--) {
+        this_thread::sleep_for(chrono::milliseconds(1));
+        REQUIRE(controller.update() == attached);
+    }
+    this_thread::sleep_for(chrono::milliseconds(1));
+    REQUIRE(controller.update() == 1);
+    REQUIRE(tap.isAttached(0));
+    REQUIRE(!tap.isAttached(3));
+    REQUIRE(dispatcher.getSize() == 1);
+
+    // Backlog on the remaining queue brings another one back
+    dispatcher.setBudget(&tap, 1, 0);
+    for (int i = 0; i < 4; i++) {
+        hook.send(frame);
+    }
+    int count = 0;
+    dispatcher.dispatch([&](string const&, uint,
+                            vector<uint8_t>& packet) {
+            count += packet == frame;
+            return count < 4;
+        }, 1000);
+    REQUIRE(count == 4);
+    REQUIRE(controller.update() == 2);
+    REQUIRE(tap.isAttached(1));
+    REQUIRE(dispatcher.getSize() == 2);
+
+    // Frames to several destinations, spread across the queues
+    tap.setSteering(viface::STEERING_MAC);
+    auto is_test_frame = [&](uint8_t const* data, size_t length) {
+        return length == frame.size() &&
+               equal(frame.begin() + 6, frame.end(), data + 6);
+    };
+    auto send_frames = [&]() {
+        vector<uint8_t> packet = frame;
+        for (uint8_t i = 0; i < 16; i++) {
+            packet[5] = i;
+            hook.send(packet);
+        }
+        this_thread::sleep_for(chrono::milliseconds(50));
+    };
+    auto receive_frames = [&]() {
+        size_t frames = 0;
+        dispatcher.dispatchPackets([&](viface::packet_info const& packet) {
+                frames += is_test_frame(packet.data, packet.length);
+                return true;
+            }, 100);
+        return frames;
+    };
+
+    // Queues being detached are drained into the callback first
+    size_t drained = 0;
+    controller.setCallback([&](viface::packet_info const& packet) {
+            drained += is_test_frame(packet.data, packet.length);
+            return true;
+        });
+    send_frames();
+    this_thread::sleep_for(chrono::milliseconds(1));
+    REQUIRE(controller.update() == 1);
+    REQUIRE(drained > 0);
+    REQUIRE(drained + receive_frames() == 16);
+    REQUIRE(controller.getDropped() == 0);
+
+    // Without a callback, they are counted as dropped, along with anything
+    // else queued
+    for (int i = 0; i < 4; i++) {
+        hook.send(frame);
+    }
+    count = 0;
+    dispatcher.dispatch([&](string const&, uint,
+                            vector<uint8_t>& packet) {
+            count += packet == frame;
+            return count < 4;
+        }, 1000);
+    REQUIRE(controller.update() == 2);
+
+    controller.setCallback(nullptr);
+    send_frames();
+    this_thread::sleep_for(chrono::milliseconds(1));
+    REQUIRE(controller.update() == 1);
+    size_t rest = receive_frames();
+    REQUIRE(rest < 16);
+    REQUIRE(controller.getDropped() + rest >= 16);
+
+    // Nothing left attached by the caller, nothing to measure
+    tap.detachQueue(0);
+    this_thread::sleep_for(chrono::milliseconds(1));
+    REQUIRE(controller.update() == 0);
+}
+
+TEST_CASE("Dispatcher with io_uring engine")
+{
+#ifdef VIFACE_HAVE_IO_URING
+    REQUIRE(viface::Dispatcher(viface::ENGINE_IO_URING).getEngine() ==
+            viface::ENGINE_IO_URING);
+#endif
+    check_dispatcher(viface::ENGINE_IO_URING);
+
+    // Queued writes are submitted in batches
+    viface::VIface tap("vifdp%d");
+    tap.up();
+    viface::VIface hook(tap.getName());
+
+    viface::Dispatcher dispatcher(viface::ENGINE_IO_URING);
+    dispatcher.add(&hook);
+
+    viface::PacketBuffer buffer(2048, 0, 0);
+    copy(frame.begin(), frame.end(), buffer.put(frame.size()));
+    for (int i = 0; i < 8; i++) {
+        dispatcher.send(&tap, buffer);
+    }
+    dispatcher.flush();
+
+    // Hook sees the frames sent by the tap
+    int count = 0;
+    dispatcher.dispatch([&](string const&, uint,
+                            vector<uint8_t>& packet) {
+            count += packet == frame;
+            return count < 8;
+        }, 1000);
+    REQUIRE(count == 8);
+    REQUIRE(dispatcher.getSendErrors() == 0);
+    dispatcher.remove(&hook);
+}
@@ -0,0 +1,807 @@
+#include "catch.hpp"
+#include <viface/viface.hpp>
+
+#include <thread>
+#include <chrono>
+#include <cstring>
+
+using namespace std;
+
+// Ethernet 2 frame with a local experimental EtherType (0x88B5) so it can be
+// told apart from any traffic the kernel may generate on the interfaces.
+static vector<uint8_t> frame = {
+    0x66, 0x23, 0x2d, 0x28, 0xc6, 0x84, 0x66, 0x23, 0x2d, 0x28, 0xc6, 0x85,
+    0x88, 0xb5, 0x6c, 0x69, 0x62, 0x76, 0x69, 0x66, 0x61, 0x63, 0x65, 0x00,
+    0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c,
+    0x0d, 0x0e, 0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18,
+    0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20
+};
+
+static bool is_frame(uint8_t const* data, size_t size)
+{
+    return size == frame.size() && equal(frame.begin(), frame.end(), data);
+}
+
+// Poll given receive function until the test frame shows up
+template<typename Receive>
+static bool wait_frame(Receive receive)
+{
+    for (int i = 0; i < 100; i++) {
+        if (receive()) {
+            return true;
+        }
+        this_thread::sleep_for(chrono::milliseconds(10));
+    }
+    return false;
+}
+
+TEST_CASE("Zero-copy receive")
+{
+    // Create a tap interface and hook a second instance to it, so frames
+    // sent on one side are received on the other
+    viface::VIface tap("vifio%d");
+    tap.up();
+    viface::VIface hook(tap.getName());
+
+    uint8_t buffer[2048];
+
+    // Hook transmits, tap receives
+    hook.send(frame);
+    REQUIRE(wait_frame([&]() {
+            size_t size = tap.receive(buffer, sizeof(buffer));
+            return is_frame(buffer, size);
+        }));
+
+    // Tap transmits, hook receives
+    tap.send(frame);
+    REQUIRE(wait_frame([&]() {
+            vector<uint8_t> packet = hook.receive();
+            return is_frame(packet.data(), packet.size());
+        }));
+}
+
+TEST_CASE("Batched receive")
+{
+    viface::VIface tap("vifio%d");
+    tap.up();
+    viface::VIface hook(tap.getName());
+
+    // Queue a few frames in both directions
+    for (int i = 0; i < 4; i++) {
+        hook.send(frame);
+    }
+    for (int i = 0; i < 4; i++) {
+        tap.send(frame);
+    }
+
+    uint8_t memory[8][2048];
+    viface::packet_buffer buffers[8];
+    for (int i = 0; i < 8; i++) {
+        buffers[i] = {memory[i], sizeof(memory[i]), 0};
+    }
+
+    // Drain both sides, counting the test frames found
+    for (viface::VIface* iface : {&tap, &hook}) {
+        size_t found = 0;
+        REQUIRE(wait_frame([&]() {
+                size_t received = iface->receiveBatch(buffers, 8);
+                for (size_t i = 0; i < received; i++) {
+                    if (is_frame(buffers[i].data, buffers[i].length)) {
+                        found++;
+                    }
+                }
+                return found >= 4;
+            }));
+    }
+}
+
+TEST_CASE("Batched send")
+{
+    viface::VIface tap("vifio%d");
+    tap.up();
+    viface::VIface hook(tap.getName());
+
+    viface::packet_buffer buffers[4];
+    for (int i = 0; i < 4; i++) {
+        buffers[i] = {frame.data(), frame.size(), frame.size()};
+    }
+
+    // Packets are validated before sending any of them
+    viface::packet_buffer bad = {frame.data(), frame.size(), 4};
+    REQUIRE_THROWS(tap.sendBatch(&bad, 1));
+
+    REQUIRE(hook.sendBatch(buffers, 4) == 4);
+    REQUIRE(tap.sendBatch(buffers, 4) == 4);
+
+    // Every frame sent by the hook reaches the tap, every frame sent by the
+    // tap reaches the hook (which also captures its own outgoing frames)
+    size_t found_tap = 0;
+    size_t found_hook = 0;
+    uint8_t buffer[2048];
+    REQUIRE(wait_frame([&]() {
+            size_t size;
+            while ((size = tap.receive(buffer, sizeof(buffer))) > 0) {
+                found_tap += is_frame(buffer, size);
+            }
+            return found_tap >= 4;
+        }));
+    REQUIRE(wait_frame([&]() {
+            viface::packet_buffer pkt = {buffer, sizeof(buffer), 0};
+            while (hook.receiveBatch(&pkt, 1) > 0) {
+                found_hook += is_frame(pkt.data, pkt.length);
+            }
+            return found_hook >= 8;
+        }));
+}
+
+TEST_CASE("Scatter-gather send")
+{
+    viface::VIface tap("vifio%d");
+    tap.up();
+    viface::VIface hook(tap.getName());
+
+    // Ethernet header and payload kept in separate memory
+    viface::packet_segment segments[] = {
+        {frame.data(), 14},
+        {frame.data() + 14, frame.size() - 14}
+    };
+
+    hook.send(segments, 2);
+
+    uint8_t buffer[2048];
+    REQUIRE(wait_frame([&]() {
+            size_t size = tap.receive(buffer, sizeof(buffer));
+            return is_frame(buffer, size);
+        }));
+}
+
+TEST_CASE("Receive with headroom")
+{
+    viface::VIface tap("vifio%d");
+    tap.up();
+    viface::VIface hook(tap.getName());
+
+    viface::PacketBuffer buffer(2048, 64, 16);
+    REQUIRE(buffer.getCapacity() == 2048 - 64 - 16);
+    REQUIRE_THROWS(viface::PacketBuffer(128, 64, 64));
+
+    hook.send(frame);
+    REQUIRE(wait_frame([&]() {
+            tap.receive(buffer);
+            return is_frame(buffer.getData(), buffer.getLength());
+        }));
+    REQUIRE(buffer.getHeadroom() == 64);
+
+    // Encapsulate in place: outer Ethernet header and a trailer
+    uint8_t* outer = buffer.push(14);
+    REQUIRE(outer != nullptr);
+    copy(frame.begin(), frame.begin() + 14, outer);
+    REQUIRE(buffer.put(4) != nullptr);
+    REQUIRE(buffer.getLength() == frame.size() + 18);
+    REQUIRE(buffer.push(64) == nullptr);
+
+    // Decapsulate back
+    REQUIRE(buffer.pull(14) != nullptr);
+    REQUIRE(buffer.trim(4));
+    REQUIRE(is_frame(buffer.getData(), buffer.getLength()));
+
+    tap.send(buffer);
+    uint8_t memory[2048];
+    REQUIRE(wait_frame([&]() {
+            viface::packet_buffer pkt = {memory, sizeof(memory), 0};
+            while (hook.receiveBatch(&pkt, 1) > 0) {
+                if (is_frame(pkt.data, pkt.length)) {
+                    return true;
+                }
+            }
+            return false;
+        }));
+}
+
+TEST_CASE("Multi-queue")
+{
+    REQUIRE_THROWS(viface::VIface("vifio%d", true, -1, 0));
+
+    viface::VIface tap("vifio%d", true, -1, 4);
+    tap.up();
+    REQUIRE(tap.getQueues() == 4);
+    viface::VIface hook(tap.getName());
+    REQUIRE(hook.getQueues() == 1);
+
+    uint8_t memory[2048];
+    REQUIRE_THROWS(tap.receive(memory, sizeof(memory), 4));
+    REQUIRE_THROWS(tap.send(frame, 4));
+
+    // The frame lands on one of the queues
+    hook.send(frame);
+    REQUIRE(wait_frame([&]() {
+            for (uint queue = 0; queue < tap.getQueues(); queue++) {
+                size_t size = tap.receive(memory, sizeof(memory), queue);
+                if (is_frame(memory, size)) {
+                    return true;
+                }
+            }
+            return false;
+        }));
+
+    // Every queue can transmit. Drop the copy of the frame sent above, which
+    // the hook sees as outgoing traffic.
+    viface::packet_buffer pkt = {memory, sizeof(memory), 0};
+    while (hook.receiveBatch(&pkt, 1) > 0) {
+    }
+    for (uint queue = 0; queue < tap.getQueues(); queue++) {
+        tap.send(frame, queue);
+    }
+    uint count = 0;
+    wait_frame([&]() {
+            while (hook.receiveBatch(&pkt, 1) > 0) {
+                count += is_frame(pkt.data, pkt.length);
+            }
+            return count == tap.getQueues();
+        });
+    REQUIRE(count == tap.getQueues());
+
+    // Detached queues are kept open and can still transmit
+    tap.detachQueue(3);
+    REQUIRE(!tap.isAttached(3));
+    tap.detachQueue(3);
+    tap.send(frame, 3);
+    tap.attachQueue(3);
+    REQUIRE(tap.isAttached(3));
+    REQUIRE_THROWS(tap.detachQueue(4));
+    REQUIRE_THROWS(hook.detachQueue(0));
+}
+
+// Queue of the tap where the given frame shows up, or -1
+static int find_queue(viface::VIface& tap, vector<uint8_t> const& sent)
+{
+    int found = -1;
+    uint8_t memory[2048];
+
+    wait_frame([&]() {
+            for (uint queue = 0; queue < tap.getQueues(); queue++) {
+                size_t size;
+                while ((size = tap.receive(memory, sizeof(memory), queue))) {
+                    if (size == sent.size() &&
+                        equal(sent.begin(), sent.end(), memory)) {
+                        found = queue;
+                    }
+                }
+            }
+            return found >= 0;
+        });
+    return found;
+}
+
+TEST_CASE("Steering")
+{
+    viface::VIface tap("vifio%d", true, -1, 4);
+    tap.up();
+    viface::VIface hook(tap.getName());
+    REQUIRE(tap.getSteering() == viface::STEERING_KERNEL);
+    REQUIRE_THROWS(hook.setSteering(viface::STEERING_FLOW));
+
+    // By destination MAC address
+    tap.setSteering(viface::STEERING_MAC);
+    REQUIRE(tap.getSteering() == viface::STEERING_MAC);
+    for (uint8_t last = 0; last < 8; last++) {
+        vector<uint8_t> packet = frame;
+        packet[5] = last;
+        uint32_t hash = ((packet[0] << 24) | (packet[1] << 16) |
+                         (packet[2] << 8) | packet[3]) ^
+                        ((packet[4] << 8) | packet[5]);
+        hook.send(packet);
+        REQUIRE(find_queue(tap, packet) == (int) ((hash ^ (hash >> 16)) % 4));
+    }
+
+    // By VLAN id, 802.1Q tag in the frame
+    tap.setSteering(viface::STEERING_VLAN);
+    for (uint8_t vid = 1; vid <= 4; vid++) {
+        vector<uint8_t> packet = frame;
+        uint8_t tag[] = {0x81, 0x00, 0x00, vid};
+        packet.insert(packet.begin() + 12, tag, tag + 4);
+        hook.send(packet);
+        REQUIRE(find_queue(tap, packet) == vid % 4);
+    }
+
+    // By 5-tuple, UDP over IPv4
+    tap.setSteering(viface::STEERING_FLOW);
+    for (uint8_t port = 1; port <= 4; port++) {
+        vector<uint8_t> packet(frame.begin(), frame.begin() + 12);
+        uint8_t headers[] = {
+            0x08, 0x00,
+            0x45, 0x00, 0x00, 0x20, 0x00, 0x00, 0x40, 0x00,
+            0x40, 0x11, 0x00, 0x00, 0x0a, 0x00, 0x00, 0x01,
+            0x0a, 0x00, 0x00, 0x02,
+            0x30, 0x39, 0x00, port, 0x00, 0x0c, 0x00, 0x00,
+            0x01, 0x02, 0x03, 0x04
+        };
+        packet.insert(packet.end(), headers, headers + sizeof(headers));
+        uint32_t hash = 0x0a000001 ^ 0x0a000002 ^ 0x11 ^ (0x3039 << 16 | port);
+        hook.send(packet);
+        REQUIRE(find_queue(tap, packet) == (int) ((hash ^ (hash >> 16)) % 4));
+    }
+
+    REQUIRE_THROWS(tap.setSteeringProgram(0));
+    tap.setSteering(viface::STEERING_KERNEL);
+    REQUIRE(tap.getSteering() == viface::STEERING_KERNEL);
+
+    viface::VIface tun("vifio%d", false, -1, 2);
+    REQUIRE_THROWS(tun.setSteering(viface::STEERING_MAC));
+    tun.setSteering(viface::STEERING_FLOW);
+}
+
+// TCP over IPv4 super-frame, three times the segment size, and its header
+static viface::PacketBuffer tcp_superframe(viface::vnet_header& header)
+{
+    viface::PacketBuffer buffer(8192, 0, 0);
+    uint8_t* packet = buffer.put(14 + 20 + 20 + 3000);
+    memset(packet, 0, buffer.getLength());
+    copy(frame.begin(), frame.begin() + 12, packet);
+    uint8_t headers[] = {
+        0x08, 0x00,
+        0x45, 0x00, 0x0b, 0xe0, 0x00, 0x00, 0x40, 0x00,
+        0x40, 0x06, 0x00, 0x00, 0x0a, 0x00, 0x00, 0x01,
+        0x0a, 0x00, 0x00, 0x02,
+        0x30, 0x39, 0x00, 0x50, 0x00, 0x00, 0x00, 0x01,
+        0x00, 0x00, 0x00, 0x00, 0x50, 0x10, 0xff, 0xff
+    };
+    copy(headers, headers + sizeof(headers), packet + 12);
+
+    memset(&header, 0, sizeof(header));
+    header.flags = viface::VNET_HDR_F_NEEDS_CSUM;
+    header.gso_type = viface::VNET_HDR_GSO_TCPV4;
+    header.hdr_len = 54;
+    header.gso_size = 1000;
+    header.csum_start = 34;
+    header.csum_offset = 16;
+    return buffer;
+}
+
+TEST_CASE("Virtio net header")
+{
+    viface::VIface tap("vifio%d", true, -1, 1, viface::FLAG_VNET_HDR);
+    tap.up();
+    REQUIRE(tap.getFlags() == viface::FLAG_VNET_HDR);
+    viface::VIface hook(tap.getName());
+
+    // Plain frames come with an empty header
+    vector<uint8_t> memory(65536);
+    viface::vnet_header header;
+    hook.send(frame);
+    REQUIRE(wait_frame([&]() {
+            size_t size = tap.receive(memory.data(), memory.size(), header);
+            return is_frame(memory.data(), size);
+        }));
+    REQUIRE(header.gso_type == viface::VNET_HDR_GSO_NONE);
+
+    // Other receive methods strip it
+    hook.send(frame);
+    REQUIRE(wait_frame([&]() {
+            vector<uint8_t> packet = tap.receive();
+            return is_frame(packet.data(), packet.size());
+        }));
+
+    // Super-frames need a segmentation header
+    viface::PacketBuffer buffer = tcp_superframe(header);
+    REQUIRE_THROWS(tap.send(buffer));
+    tap.send(buffer, header);
+
+    // The hook sees it whole, before any segmentation
+    REQUIRE(wait_frame([&]() {
+            viface::packet_buffer pkt = {memory.data(), memory.size(), 0};
+            while (hook.receiveBatch(&pkt, 1) > 0) {
+                if (pkt.length == buffer.getLength()) {
+                    return true;
+                }
+            }
+            return false;
+        }));
+}
+
+TEST_CASE("Hooked virtio net header")
+{
+    viface::VIface tap("vifio%d");
+    tap.up();
+    viface::VIface hook(tap.getName(), true, -1, 1, viface::FLAG_VNET_HDR);
+    REQUIRE(hook.getFlags() == viface::FLAG_VNET_HDR);
+
+    vector<uint8_t> memory(65536);
+    viface::vnet_header header;
+
+    // Headers are received apart, or stripped
+    tap.send(frame);
+    REQUIRE(wait_frame([&]() {
+            size_t size = hook.receive(memory.data(), memory.size(), header);
+            return is_frame(memory.data(), size);
+        }));
+    REQUIRE(header.gso_type == viface::VNET_HDR_GSO_NONE);
+
+    tap.send(frame);
+    REQUIRE(wait_frame([&]() {
+            viface::packet_buffer pkt = {memory.data(), memory.size(), 0};
+            while (hook.receiveBatch(&pkt, 1) > 0) {
+                if (is_frame(pkt.data, pkt.length)) {
+                    return true;
+                }
+            }
+            return false;
+        }));
+
+    // Plain frames are sent with an empty header
+    hook.send(frame);
+    REQUIRE(wait_frame([&]() {
+            size_t size = tap.receive(memory.data(), memory.size());
+            return is_frame(memory.data(), size);
+        }));
+
+    // The tap has no offloads, the kernel segments super-frames for it
+    viface::PacketBuffer buffer = tcp_superframe(header);
+    hook.send(buffer, header);
+
+    int segments = 0;
+    wait_frame([&]() {
+            size_t size;
+            while ((size = tap.receive(memory.data(), memory.size()))) {
+                segments += size == 14 + 20 + 20 + 1000;
+            }
+            return segments == 3;
+        });
+    REQUIRE(segments == 3);
+}
+
+TEST_CASE("Reception ring")
+{
+    viface::VIface tap("vifio%d");
+    tap.up();
+    viface::VIface hook(tap.getName());
+    viface::packet_view views[16];
+
+    // Hooked interfaces only, with page-sized blocks
+    REQUIRE_THROWS(tap.enableRing());
+    REQUIRE_THROWS(hook.enableRing(4, 1000));
+    REQUIRE_THROWS(hook.receiveRing(views, 16));
+    size_t footprint = hook.getMemoryFootprint();
+    hook.enableRing(4, 64 * 1024);
+    REQUIRE(hook.getMemoryFootprint() >= footprint + 4 * 64 * 1024);
+    REQUIRE_THROWS(hook.enableRing());
+
+    // Frames are only delivered through the ring
+    REQUIRE_THROWS(hook.receive());
+    viface::Dispatcher dispatcher;
+    REQUIRE_THROWS(dispatcher.add(&hook));
+
+    for (int i = 0; i < 4; i++) {
+        tap.send(frame);
+    }
+
+    // Blocks are handed over on timeout, the frames may span several
+    int frames = 0;
+    for (int i = 0; i < 100 && frames < 4; i++) {
+        size_t count = hook.receiveRing(views, 16, 10);
+        for (size_t j = 0; j < count; j++) {
+            frames += is_frame(views[j].data, views[j].length);
+        }
+        if (count == 0) {
+            hook.releaseBlock();
+        }
+    }
+    REQUIRE(frames == 4);
+
+    // Releasing twice is harmless
+    hook.releaseBlock();
+    hook.releaseBlock();
+}
+
+TEST_CASE("Transmission ring")
+{
+    viface::VIface tap("vifio%d");
+    tap.up();
+    viface::VIface hook(tap.getName());
+    viface::packet_buffer slots[32];
+
+    // Hooked interfaces only, with aligned slots
+    REQUIRE_THROWS(tap.enableSendRing());
+    REQUIRE_THROWS(hook.enableSendRing(8, 1000));
+    REQUIRE_THROWS(hook.acquireSlots(slots, 8));
+    size_t footprint = hook.getMemoryFootprint();
+    hook.enableSendRing(8);
+    REQUIRE(hook.getMemoryFootprint() >= footprint + 8 * 2048);
+    REQUIRE_THROWS(hook.enableSendRing());
+
+    // Frames are written in place and sent in order
+    REQUIRE(hook.acquireSlots(slots, 4) == 4);
+    for (int i = 0; i < 4; i++) {
+        REQUIRE(slots[i].size >= frame.size());
+        memcpy(slots[i].data, frame.data(), frame.size());
+        slots[i].length = frame.size();
+    }
+    REQUIRE_THROWS(hook.sendSlots(&slots[1], 1));
+    hook.sendSlots(slots, 4);
+
+    // Other send methods copy into the ring
+    hook.send(frame);
+    viface::packet_buffer buffers[2];
+    for (int i = 0; i < 2; i++) {
+        buffers[i] = {frame.data(), frame.size(), frame.size()};
+    }
+    REQUIRE(hook.sendBatch(buffers, 2) == 2);
+
+    int frames = 0;
+    wait_frame([&]() {
+            uint8_t buffer[2048];
+            size_t size;
+            while ((size = tap.receive(buffer, sizeof(buffer)))) {
+                frames += is_frame(buffer, size);
+            }
+            return frames == 7;
+        });
+    REQUIRE(frames == 7);
+
+    // No more slots than the ring has
+    size_t acquired = hook.acquireSlots(slots, 32);
+    REQUIRE(acquired >= 8);
+    REQUIRE(acquired < 32);
+    REQUIRE(hook.getDroppedSlots() == 0);
+
+    // A frame refused by the kernel doesn't stall the ring
+    tap.down();
+    tap.setMTU(576);
+    tap.up();
+    REQUIRE(hook.acquireSlots(slots, 1) == 1);
+    memset(slots[0].data, 0, 1000);
+    memcpy(slots[0].data, frame.data(), frame.size());
+    slots[0].length = 1000;
+    REQUIRE_THROWS(hook.sendSlots(slots, 1));
+    REQUIRE(hook.acquireSlots(slots, 32) == acquired);
+    REQUIRE(hook.getDroppedSlots() == 1);
+}
+
+TEST_CASE("XDP backend")
+{
+    viface::VIface tap("vifio%d");
+    tap.up();
+
+    // Existing interfaces only, without virtio net headers
+    REQUIRE_THROWS(viface::VIface("vifxdp%d", true, -1, 1,
+                                  viface::FLAG_XDP));
+    REQUIRE_THROWS(viface::VIface(tap.getName(), true, -1, 1,
+                                  viface::FLAG_XDP | viface::FLAG_VNET_HDR));
+    viface::VIface hook(tap.getName(), true, -1, 1, viface::FLAG_XDP);
+    REQUIRE(hook.getFlags() == viface::FLAG_XDP);
+    REQUIRE_THROWS(hook.enableRing());
+    REQUIRE_THROWS(hook.enableSendRing());
+
+    // Tap transmits, hook receives
+    uint8_t buffer[2048];
+    tap.send(frame);
+    REQUIRE(wait_frame([&]() {
+            size_t size = hook.receive(buffer, sizeof(buffer));
+            return is_frame(buffer, size);
+        }));
+
+    tap.send(frame);
+    REQUIRE(wait_frame([&]() {
+            viface::packet_buffer pkt = {buffer, sizeof(buffer), 0};
+            while (hook.receiveBatch(&pkt, 1) > 0) {
+                if (is_frame(pkt.data, pkt.length)) {
+                    return true;
+                }
+            }
+            return false;
+        }));
+
+    // Hook transmits, tap receives
+    hook.send(frame);
+    viface::packet_buffer buffers[2];
+    for (int i = 0; i < 2; i++) {
+        buffers[i] = {frame.data(), frame.size(), frame.size()};
+    }
+    REQUIRE(hook.sendBatch(buffers, 2) == 2);
+
+    int frames = 0;
+    wait_frame([&]() {
+            size_t size;
+            while ((size = tap.receive(buffer, sizeof(buffer)))) {
+                frames += is_frame(buffer, size);
+            }
+            return frames == 3;
+        });
+    REQUIRE(frames == 3);
+
+    // A socket for each receive queue of the device, getting its frames
+    viface::VIface multi("vifio%d", true, -1, 2);
+    multi.up();
+    REQUIRE_THROWS(viface::VIface(multi.getName(), true, -1, 1,
+                                  viface::FLAG_XDP));
+    viface::VIface hooks(multi.getName(), true, -1, 2, viface::FLAG_XDP);
+    REQUIRE(hooks.getQueues() == 2);
+
+    for (uint queue = 0; queue < 2; queue++) {
+        multi.send(frame, queue);
+        REQUIRE(wait_frame([&]() {
+                size_t size = hooks.receive(buffer, sizeof(buffer), queue);
+                return is_frame(buffer, size);
+            }));
+    }
+}
+
+TEST_CASE("Fanout")
+{
+    viface::VIface tap("vifio%d");
+    tap.up();
+
+    // Hooked interfaces only, with a single mode and without XDP
+    REQUIRE_THROWS(viface::VIface("viffan%d", false, -1, 2,
+                                  viface::FLAG_FANOUT_LB));
+    REQUIRE_THROWS(viface::VIface(tap.getName(), true, -1, 2,
+                                  viface::FLAG_FANOUT_LB |
+                                  viface::FLAG_FANOUT_CPU));
+    REQUIRE_THROWS(viface::VIface(tap.getName(), true, -1, 2,
+                                  viface::FLAG_XDP));
+    viface::VIface cpu(tap.getName(), true, -1, 2, viface::FLAG_FANOUT_CPU);
+    viface::VIface rollover(tap.getName(), true, -1, 1,
+                            viface::FLAG_FANOUT_ROLLOVER);
+    REQUIRE(rollover.getQueues() == 1);
+    REQUIRE_THROWS(cpu.detachQueue(1));
+
+    // Count the test frames received on every queue of the hook
+    uint8_t buffer[2048];
+    auto drain = [&](viface::VIface& hook, vector<int>& frames) {
+            size_t size;
+            int total = 0;
+            for (uint queue = 0; queue < hook.getQueues(); queue++) {
+                while ((size = hook.receive(buffer, sizeof(buffer), queue))) {
+                    frames[queue] += is_frame(buffer, size);
+                }
+                total += frames[queue];
+            }
+            return total;
+        };
+
+    // The frames of a flow end up on the same queue
+    viface::VIface hash(tap.getName(), true, -1, 2);
+    REQUIRE(hash.getQueues() == 2);
+    vector<int> frames(2, 0);
+    for (int i = 0; i < 8; i++) {
+        tap.send(frame);
+    }
+    wait_frame([&]() {
+            return drain(hash, frames) == 8;
+        });
+    REQUIRE(frames[0] + frames[1] == 8);
+    REQUIRE((frames[0] == 0 || frames[1] == 0));
+
+    // Round-robin spreads them regardless
+    viface::VIface lb(tap.getName(), true, -1, 2, viface::FLAG_FANOUT_LB);
+    frames.assign(2, 0);
+    for (int i = 0; i < 8; i++) {
+        tap.send(frame);
+    }
+    wait_frame([&]() {
+            return drain(lb, frames) == 8;
+        });
+    REQUIRE(frames[0] + frames[1] == 8);
+    REQUIRE(frames[0] > 0);
+    REQUIRE(frames[1] > 0);
+}
+
+TEST_CASE("Packet socket options")
+{
+    viface::VIface tap("vifio%d");
+    tap.up();
+    uint8_t buffer[2048];
+
+    // Hooked packet sockets only
+    REQUIRE_THROWS(viface::VIface("vifopt%d", true, -1, 1,
+                                  viface::FLAG_QDISC_BYPASS));
+    REQUIRE_THROWS(viface::VIface(tap.getName(), true, -1, 1,
+                                  viface::FLAG_XDP |
+                                  viface::FLAG_IGNORE_OUTGOING));
+    REQUIRE(tap.getIgnoredOutgoing() == 0);
+
+    // Frames sent by a plain hook come back to it
+    viface::VIface echo(tap.getName());
+    echo.send(frame);
+    REQUIRE(wait_frame([&]() {
+            size_t size = echo.receive(buffer, sizeof(buffer));
+            return is_frame(buffer, size);
+        }));
+    REQUIRE(echo.getIgnoredOutgoing() == 0);
+    REQUIRE(wait_frame([&]() {
+            size_t size = tap.receive(buffer, sizeof(buffer));
+            return is_frame(buffer, size);
+        }));
+
+    viface::VIface hook(tap.getName(), true, -1, 1,
+                        viface::FLAG_IGNORE_OUTGOING);
+    for (int i = 0; i < 4; i++) {
+        hook.send(frame);
+    }
+
+    // Sent, but kept off the hook
+    int frames = 0;
+    wait_frame([&]() {
+            size_t size;
+            while ((size = tap.receive(buffer, sizeof(buffer)))) {
+                frames += is_frame(buffer, size);
+            }
+            return frames == 4;
+        });
+    REQUIRE(frames == 4);
+    REQUIRE(hook.getIgnoredOutgoing() >= 4);
+
+    size_t size;
+    while ((size = hook.receive(buffer, sizeof(buffer)))) {
+        REQUIRE(!is_frame(buffer, size));
+    }
+
+    // Incoming frames are still received
+    tap.send(frame);
+    REQUIRE(wait_frame([&]() {
+            size_t size = hook.receive(buffer, sizeof(buffer));
+            return is_frame(buffer, size);
+        }));
+
+    // Frames sent past the qdisc reach the tap all the same
+    viface::VIface bypass(tap.getName(), true, -1, 1,
+                          viface::FLAG_QDISC_BYPASS);
+    bypass.send(frame);
+    REQUIRE(wait_frame([&]() {
+            size_t size = tap.receive(buffer, sizeof(buffer));
+            return is_frame(buffer, size);
+        }));
+}
+
+TEST_CASE("Exception-free I/O")
+{
+    viface::VIface tap("vifio%d");
+    tap.up();
+    viface::VIface hook(tap.getName(), true, -1, 1,
+                        viface::FLAG_IGNORE_OUTGOING);
+
+    uint8_t memory[4][2048];
+    viface::packet_buffer buffers[4];
+    for (int i = 0; i < 4; i++) {
+        buffers[i] = {memory[i], sizeof(memory[i]), 0};
+    }
+
+    // Nothing to receive yet
+    REQUIRE(hook.tryReceive(buffers[0]) == viface::IO_AGAIN);
+
+    // Invalid requests are reported without sending anything
+    viface::packet_buffer small = {frame.data(), frame.size(), 4};
+    REQUIRE(tap.trySend(small) == viface::IO_INVALID);
+    REQUIRE(errno == EMSGSIZE);
+    viface::packet_buffer packet = {frame.data(), frame.size(), frame.size()};
+    REQUIRE(tap.trySend(packet, 1) == viface::IO_INVALID);
+
+    // Single packets
+    REQUIRE(tap.trySend(packet) == viface::IO_OK);
+    REQUIRE(wait_frame([&]() {
+            return hook.tryReceive(buffers[0]) == viface::IO_OK &&
+            is_frame(buffers[0].data, buffers[0].length);
+        }));
+
+    // Batches
+    viface::packet_buffer packets[4] = {packet, packet, packet, packet};
+    size_t sent = 0;
+    REQUIRE(tap.trySendBatch(packets, 4, sent) == viface::IO_OK);
+    REQUIRE(sent == 4);
+
+    size_t found = 0;
+    REQUIRE(wait_frame([&]() {
+            size_t received = 0;
+            viface::io_status status = hook.tryReceiveBatch(buffers, 4,
+                                                            received);
+            for (size_t i = 0; i < received; i++) {
+                found += is_frame(buffers[i].data, buffers[i].length);
+            }
+            return status != viface::IO_ERROR && found >= 4;
+        }));
+    REQUIRE(found == 4);
+
+    // Ring-enabled queues are read with receiveRing() only
+    hook.enableRing();
+    REQUIRE(hook.tryReceive(buffers[0]) == viface::IO_INVALID);
+}